@@ -0,0 +1,508 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#define _GNU_SOURCE
+#include "arena.h"
+#include "topology.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE(size) (((size) + ARENA_CHUNK - 1) & ~(ARENA_CHUNK - 1))
+
+typedef struct arena_obj
+{
+  struct arena_obj *nxt;
+} arena_obj_t;
+
+// the head of every chunk, which is aligned to its size so objects find it. objects
+// start past it, at the first multiple of their size.
+typedef struct arena_chunk
+{
+  unsigned short cls, pool;
+  unsigned int cap, nfree; // nfree counts both free list and untouched objects
+  atomic_bool evacuate; // sparse, the defragmenter moves objects out and nothing new goes in
+  arena_obj_t *free;
+  char *cur; // objects from here on were never handed out
+  struct arena_chunk *prev, *nxt; // chunks of the class with free objects
+  struct arena_chunk *aprev, *anxt; // every chunk of the class
+} arena_chunk_t;
+
+_Static_assert(sizeof(arena_chunk_t) <= ARENA_HEADER, "arena chunk header");
+
+#define ARENA_CHUNK_OF(p) ((arena_chunk_t*)((uintptr_t)(p) & ~(uintptr_t)(ARENA_CHUNK - 1)))
+
+typedef struct arena_class
+{
+  pthread_mutex_t mtx;
+  arena_chunk_t *partial, *all;
+  unsigned long chunks, used; // used counts objects out of the chunks, thread caches included
+} arena_class_t;
+
+typedef struct arena_cache
+{
+  arena_obj_t *head;
+  unsigned int n;
+} arena_cache_t;
+
+typedef struct arena
+{
+  bool huge; // try MAP_HUGETLB, then madvise(MADV_HUGEPAGE)
+  pthread_mutex_t mtx;
+  arena_obj_t *spare; // prefaulted chunks, for the table data of the processors
+  arena_class_t classes[ARENA_POOLS][ARENA_CLASSES]; // a pool per TOPOLOGY_ROLE_*
+  atomic_ulong chunks, mapped;
+  atomic_uint epoch; // raised when chunks are marked, threads then give their caches back
+} arena_t;
+
+static arena_t arena = {
+  .huge  = false,
+  .mtx   = PTHREAD_MUTEX_INITIALIZER,
+  .spare = NULL
+};
+
+static _Thread_local arena_cache_t cache[ARENA_POOLS][ARENA_CLASSES];
+static _Thread_local unsigned int epoch;
+
+static unsigned int arena_class(const size_t size)
+{
+  if (size <= ARENA_MINOBJ) return 0;
+  return (unsigned int)(sizeof(unsigned long) * 8 - __builtin_clzl(size - 1)) - 4;
+}
+
+// anonymous zeroed memory. from ARENA_CHUNK on it is aligned to and rounded up to
+// huge pages, backed by hugetlbfs when pages are reserved and by transparent huge
+// pages otherwise.
+void *arena_map(const size_t size)
+{
+  void *mem;
+
+  if (size < ARENA_CHUNK)
+  {
+    if ((mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+      perror("(arena) mmap");
+      return NULL;
+    }
+    atomic_fetch_add_explicit(&arena.mapped, size, memory_order_relaxed);
+    return mem;
+  }
+
+  const size_t lhuge = ARENA_HUGE(size);
+  if (arena.huge &&
+      (mem = mmap(NULL, lhuge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+  {
+    atomic_fetch_add_explicit(&arena.mapped, lhuge, memory_order_relaxed);
+    return mem;
+  }
+
+  // one huge page more than needed, then the ends are cut so the rest is aligned
+  const size_t lmap = lhuge + ARENA_CHUNK;
+  if ((mem = mmap(NULL, lmap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    perror("(arena) mmap");
+    return NULL;
+  }
+  char *aligned = (char*)(((uintptr_t)mem + ARENA_CHUNK - 1) & ~(uintptr_t)(ARENA_CHUNK - 1));
+  if (aligned > (char*)mem) munmap(mem, aligned - (char*)mem);
+  if (aligned + lhuge < (char*)mem + lmap) munmap(aligned + lhuge, (char*)mem + lmap - (aligned + lhuge));
+
+  if (arena.huge && madvise(aligned, lhuge, MADV_HUGEPAGE) < 0) perror("(arena) madvise");
+  atomic_fetch_add_explicit(&arena.mapped, lhuge, memory_order_relaxed);
+  return aligned;
+}
+
+void arena_unmap(void *mem, const size_t size)
+{
+  if (mem == NULL) return;
+
+  const size_t lmap = size < ARENA_CHUNK ? size : ARENA_HUGE(size);
+  if (munmap(mem, lmap) < 0) perror("(arena) munmap");
+  atomic_fetch_sub_explicit(&arena.mapped, lmap, memory_order_relaxed);
+}
+
+// a chunk for the slabs of pool, on the nodes of its role. the processors take the
+// prefaulted ones while any is left
+static arena_chunk_t *arena_chunk_new(const unsigned int pool, const unsigned int cls)
+{
+  const size_t size = (size_t)ARENA_MINOBJ << cls;
+  const size_t off = size > ARENA_HEADER ? size : ARENA_HEADER;
+  char *mem = NULL;
+
+  if (pool == TOPOLOGY_ROLE_PROCESSOR)
+  {
+    pthread_mutex_lock(&arena.mtx);
+    if (arena.spare != NULL)
+    {
+      mem = (char*)arena.spare;
+      arena.spare = arena.spare->nxt;
+    }
+    pthread_mutex_unlock(&arena.mtx);
+  }
+
+  if (mem == NULL && (mem = topology_alloc(ARENA_CHUNK, (int)pool)) == NULL) return NULL;
+  atomic_fetch_add_explicit(&arena.chunks, 1, memory_order_relaxed);
+
+  arena_chunk_t *chunk = (arena_chunk_t*)mem;
+  chunk->cls = cls;
+  chunk->pool = pool;
+  chunk->cap = chunk->nfree = (ARENA_CHUNK - off) / size;
+  atomic_init(&chunk->evacuate, false);
+  chunk->free = NULL;
+  chunk->cur = mem + off;
+  chunk->prev = chunk->nxt = NULL;
+  chunk->aprev = chunk->anxt = NULL;
+  return chunk;
+}
+
+// the class mutex must be held for the list helpers
+static void arena_partial_add(arena_class_t *c, arena_chunk_t *chunk)
+{
+  chunk->prev = NULL;
+  chunk->nxt = c->partial;
+  if (c->partial != NULL) c->partial->prev = chunk;
+  c->partial = chunk;
+}
+
+static void arena_partial_remove(arena_class_t *c, arena_chunk_t *chunk)
+{
+  if (chunk->prev != NULL) chunk->prev->nxt = chunk->nxt;
+  else c->partial = chunk->nxt;
+  if (chunk->nxt != NULL) chunk->nxt->prev = chunk->prev;
+  chunk->prev = chunk->nxt = NULL;
+}
+
+// gives an empty chunk back to the system
+static void arena_chunk_release(arena_class_t *c, arena_chunk_t *chunk)
+{
+  arena_partial_remove(c, chunk);
+  if (chunk->aprev != NULL) chunk->aprev->anxt = chunk->anxt;
+  else c->all = chunk->anxt;
+  if (chunk->anxt != NULL) chunk->anxt->aprev = chunk->aprev;
+  c->chunks--;
+  atomic_fetch_sub_explicit(&arena.chunks, 1, memory_order_relaxed);
+  topology_free(chunk, ARENA_CHUNK);
+}
+
+// returns obj to its chunk, the class mutex must be held
+static void arena_put(arena_class_t *c, arena_obj_t *obj)
+{
+  arena_chunk_t *chunk = ARENA_CHUNK_OF(obj);
+
+  obj->nxt = chunk->free;
+  chunk->free = obj;
+  if (chunk->nfree++ == 0) arena_partial_add(c, chunk);
+  c->used--;
+
+  // an empty chunk goes back, unless it is all the class has
+  if (chunk->nfree == chunk->cap && (c->chunks > 1 || atomic_load_explicit(&chunk->evacuate, memory_order_relaxed)))
+    arena_chunk_release(c, chunk);
+}
+
+// moves up to ARENA_CACHE objects of class cls of pool to the calling thread
+static int arena_refill(const unsigned int pool, const unsigned int cls)
+{
+  arena_class_t *c = &arena.classes[pool][cls];
+  arena_cache_t *tc = &cache[pool][cls];
+  const size_t size = (size_t)ARENA_MINOBJ << cls;
+  arena_chunk_t *chunk = NULL;
+  int ret = 0;
+
+  pthread_mutex_lock(&c->mtx);
+  while (tc->n < ARENA_CACHE)
+  {
+    // chunks being evacuated are passed over
+    if (chunk == NULL || chunk->nfree == 0)
+      for (chunk = c->partial; chunk != NULL; chunk = chunk->nxt)
+        if (!atomic_load_explicit(&chunk->evacuate, memory_order_relaxed)) break;
+
+    if (chunk == NULL)
+    {
+      if ((chunk = arena_chunk_new(pool, cls)) == NULL)
+      {
+        ret = tc->n > 0 ? 0 : -1;
+        break;
+      }
+      chunk->anxt = c->all;
+      if (c->all != NULL) c->all->aprev = chunk;
+      c->all = chunk;
+      c->chunks++;
+      arena_partial_add(c, chunk);
+    }
+
+    arena_obj_t *obj;
+    if (chunk->free != NULL)
+    {
+      obj = chunk->free;
+      chunk->free = obj->nxt;
+    }
+    else
+    {
+      obj = (arena_obj_t*)chunk->cur;
+      chunk->cur += size;
+    }
+    if (--chunk->nfree == 0) arena_partial_remove(c, chunk);
+    c->used++;
+
+    obj->nxt = tc->head;
+    tc->head = obj;
+    tc->n++;
+  }
+  pthread_mutex_unlock(&c->mtx);
+  return ret;
+}
+
+// gives all but keep of the calling thread's objects of class cls of pool back
+static void arena_drain(const unsigned int pool, const unsigned int cls, const unsigned int keep)
+{
+  arena_class_t *c = &arena.classes[pool][cls];
+  arena_cache_t *tc = &cache[pool][cls];
+
+  pthread_mutex_lock(&c->mtx);
+  while (tc->n > keep)
+  {
+    arena_obj_t *obj = tc->head;
+    tc->head = obj->nxt;
+    tc->n--;
+    arena_put(c, obj);
+  }
+  pthread_mutex_unlock(&c->mtx);
+}
+
+// like malloc, small objects come from huge page chunks through a per-thread cache.
+// the memory must go back through arena_free with the same size.
+void *arena_alloc(const size_t size)
+{
+  return arena_alloc_role(size, TOPOLOGY_ROLE_PROCESSOR);
+}
+
+// arena_alloc from the chunks of the TOPOLOGY_ROLE_* that uses the memory
+void *arena_alloc_role(size_t size, const int role)
+{
+  const unsigned int pool = (unsigned int)role < ARENA_POOLS ? (unsigned int)role : TOPOLOGY_ROLE_PROCESSOR;
+
+  if (size == 0) size = 1;
+  if (size > ARENA_MAXOBJ) return size >= ARENA_CHUNK ? arena_map(size) : malloc(size);
+
+  // cached objects may sit in chunks marked since, they go back to be moved out
+  if (epoch != atomic_load_explicit(&arena.epoch, memory_order_relaxed))
+  {
+    epoch = atomic_load_explicit(&arena.epoch, memory_order_relaxed);
+    arena_flush();
+  }
+
+  const unsigned int cls = arena_class(size);
+  arena_cache_t *tc = &cache[pool][cls];
+  if (tc->head == NULL && arena_refill(pool, cls) < 0) return NULL;
+
+  arena_obj_t *obj = tc->head;
+  tc->head = obj->nxt;
+  tc->n--;
+  return obj;
+}
+
+void arena_free(void *mem, size_t size)
+{
+  if (mem == NULL) return;
+  if (size == 0) size = 1;
+  if (size > ARENA_MAXOBJ)
+  {
+    if (size >= ARENA_CHUNK) arena_unmap(mem, size);
+    else free(mem);
+    return;
+  }
+
+  const unsigned int cls = arena_class(size);
+  const unsigned int pool = ARENA_CHUNK_OF(mem)->pool; // freed to the pool it came from, by any thread
+  arena_class_t *c = &arena.classes[pool][cls];
+
+  // objects of a chunk being evacuated go straight back so nothing reuses them
+  if (atomic_load_explicit(&ARENA_CHUNK_OF(mem)->evacuate, memory_order_relaxed))
+  {
+    pthread_mutex_lock(&c->mtx);
+    arena_put(c, mem);
+    pthread_mutex_unlock(&c->mtx);
+    return;
+  }
+
+  arena_cache_t *tc = &cache[pool][cls];
+  arena_obj_t *obj = mem;
+  obj->nxt = tc->head;
+  tc->head = obj;
+  if (++tc->n >= ARENA_CACHE * 2) arena_drain(pool, cls, ARENA_CACHE);
+}
+
+// NULL leaves mem as it was
+void *arena_realloc(void *mem, const size_t size, const size_t nsize)
+{
+  return arena_realloc_role(mem, size, nsize, TOPOLOGY_ROLE_PROCESSOR);
+}
+
+// arena_realloc for memory of arena_alloc_role
+void *arena_realloc_role(void *mem, const size_t size, const size_t nsize, const int role)
+{
+  if (mem == NULL) return arena_alloc_role(nsize, role);
+
+  // objects of the same class, or both from malloc, stay where they are
+  if (size <= ARENA_MAXOBJ && nsize <= ARENA_MAXOBJ && arena_class(size) == arena_class(nsize)) return mem;
+  if (size > ARENA_MAXOBJ && size < ARENA_CHUNK && nsize > ARENA_MAXOBJ && nsize < ARENA_CHUNK)
+    return realloc(mem, nsize);
+
+  void *nmem = arena_alloc_role(nsize, role);
+  if (nmem == NULL) return NULL;
+  memcpy(nmem, mem, size < nsize ? size : nsize);
+  arena_free(mem, size);
+  return nmem;
+}
+
+// hands the calling thread's cached objects back, for threads about to exit
+void arena_flush(void)
+{
+  for (unsigned int ip = 0; ip < ARENA_POOLS; ++ip)
+    for (unsigned int ic = 0; ic < ARENA_CLASSES; ++ic)
+      if (cache[ip][ic].n > 0) arena_drain(ip, ic, 0);
+}
+
+// marks the chunks used below ARENA_SPARSE percent for evacuation, returns how many.
+// only the table data of the processors is moved, so only their pool is marked
+unsigned int arena_defrag_begin(void)
+{
+  unsigned int marked = 0;
+
+  for (unsigned int ic = 0; ic < ARENA_CLASSES; ++ic)
+  {
+    arena_class_t *c = &arena.classes[TOPOLOGY_ROLE_PROCESSOR][ic];
+    pthread_mutex_lock(&c->mtx);
+    if (c->chunks > 1)
+      for (arena_chunk_t *chunk = c->partial; chunk != NULL; chunk = chunk->nxt)
+        if ((chunk->cap - chunk->nfree) * 100ul < chunk->cap * ARENA_SPARSE)
+        {
+          atomic_store_explicit(&chunk->evacuate, true, memory_order_relaxed);
+          marked++;
+        }
+    pthread_mutex_unlock(&c->mtx);
+  }
+  if (marked > 0) atomic_fetch_add_explicit(&arena.epoch, 1, memory_order_relaxed);
+  return marked;
+}
+
+// chunks still holding objects after a pass take allocations again
+void arena_defrag_end(void)
+{
+  for (unsigned int ic = 0; ic < ARENA_CLASSES; ++ic)
+  {
+    arena_class_t *c = &arena.classes[TOPOLOGY_ROLE_PROCESSOR][ic];
+    pthread_mutex_lock(&c->mtx);
+    for (arena_chunk_t *chunk = c->all; chunk != NULL; chunk = chunk->anxt)
+      atomic_store_explicit(&chunk->evacuate, false, memory_order_relaxed);
+    pthread_mutex_unlock(&c->mtx);
+  }
+}
+
+// whether the object of size bytes at mem sits in a chunk being evacuated
+bool arena_sparse(const void *mem, const size_t size)
+{
+  if (mem == NULL || size > ARENA_MAXOBJ) return false;
+  return atomic_load_explicit(&ARENA_CHUNK_OF(mem)->evacuate, memory_order_relaxed);
+}
+
+// bytes of slab chunks over the bytes of objects handed out of them, 1 when tight.
+// the table data only, the defragmenter has nothing to move in the other pools
+double arena_fragmentation(void)
+{
+  unsigned long slab = 0, used = 0;
+
+  for (unsigned int ic = 0; ic < ARENA_CLASSES; ++ic)
+  {
+    arena_class_t *c = &arena.classes[TOPOLOGY_ROLE_PROCESSOR][ic];
+    pthread_mutex_lock(&c->mtx);
+    slab += c->chunks * ARENA_CHUNK;
+    used += c->used * ((unsigned long)ARENA_MINOBJ << ic);
+    pthread_mutex_unlock(&c->mtx);
+  }
+  return used > 0 ? (double)slab / used : 1.0;
+}
+
+// reads a "Name: value kB" line of /proc/self/smaps_rollup, in bytes
+static unsigned long arena_smaps(const char *smaps, const char *name)
+{
+  const char *line = strstr(smaps, name);
+  if (line == NULL) return 0;
+  return strtoul(line + strlen(name), NULL, 10) * 1024;
+}
+
+// "arena_name:value" lines, with how much of the resident memory is on huge pages
+void arena_report(FILE *f)
+{
+  char smaps[4096];
+  size_t n = 0;
+
+  FILE *in = fopen("/proc/self/smaps_rollup", "r");
+  if (in != NULL)
+  {
+    n = fread(smaps, 1, sizeof(smaps) - 1, in);
+    fclose(in);
+  }
+  smaps[n] = '\0';
+
+  const unsigned long rss = arena_smaps(smaps, "\nRss:");
+  const unsigned long thp = arena_smaps(smaps, "\nAnonHugePages:");
+  const unsigned long hugetlb = arena_smaps(smaps, "\nPrivate_Hugetlb:") + arena_smaps(smaps, "\nShared_Hugetlb:");
+
+  fprintf(f, "arena_chunks:%lu\n", atomic_load_explicit(&arena.chunks, memory_order_relaxed));
+  fprintf(f, "arena_mapped_bytes:%lu\n", atomic_load_explicit(&arena.mapped, memory_order_relaxed));
+  fprintf(f, "arena_thp_bytes:%lu\n", thp);
+  fprintf(f, "arena_hugetlb_bytes:%lu\n", hugetlb);
+  fprintf(f, "arena_huge_pct:%lu\n", rss + hugetlb > 0 ? (thp + hugetlb) * 100 / (rss + hugetlb) : 0);
+  fprintf(f, "arena_frag_ratio:%.2f\n", arena_fragmentation());
+}
+
+// huge enables huge pages for the arena and every mapping from arena_map, prefault
+// bytes of chunks are mapped and touched now so the first writes do not fault
+int arena_setup(const bool huge, const unsigned long prefault)
+{
+  const long page = sysconf(_SC_PAGESIZE);
+
+  arena.huge = huge;
+  for (unsigned int ip = 0; ip < ARENA_POOLS; ++ip)
+    for (unsigned int ic = 0; ic < ARENA_CLASSES; ++ic)
+    {
+      arena_class_t *c = &arena.classes[ip][ic];
+      if (pthread_mutex_init(&c->mtx, NULL) != 0) return -1;
+      c->partial = c->all = NULL;
+      c->chunks = c->used = 0;
+    }
+
+  for (unsigned long ic = 0; ic < prefault / ARENA_CHUNK; ++ic)
+  {
+    char *chunk = topology_alloc(ARENA_CHUNK, TOPOLOGY_ROLE_PROCESSOR);
+    if (chunk == NULL) return -1;
+    for (unsigned long off = 0; off < ARENA_CHUNK; off += page) chunk[off] = 0;
+
+    arena_obj_t *obj = (arena_obj_t*)chunk;
+    obj->nxt = arena.spare;
+    arena.spare = obj;
+  }
+  return 0;
+}
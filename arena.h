@@ -0,0 +1,52 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARENA_CHUNK (2ul << 20) // one huge page, small objects are carved from chunks this big
+#define ARENA_MINOBJ 16
+#define ARENA_MAXOBJ 65536      // larger objects go to malloc, from ARENA_CHUNK on to a mapping of their own
+#define ARENA_CLASSES 13        // powers of two from ARENA_MINOBJ to ARENA_MAXOBJ
+#define ARENA_CACHE 32          // objects per class a thread takes from or gives back to the arena at once
+#define ARENA_HEADER 64         // of every chunk
+#define ARENA_SPARSE 30         // percent of a chunk in use under which the defragmenter empties it
+#define ARENA_POOLS 2           // chunks kept apart per TOPOLOGY_ROLE_*, each on the nodes of its threads
+
+int arena_setup(bool, unsigned long);
+void *arena_map(size_t);
+void arena_unmap(void*, size_t);
+void *arena_alloc(size_t);
+void *arena_alloc_role(size_t, int);
+void arena_free(void*, size_t);
+void *arena_realloc(void*, size_t, size_t);
+void *arena_realloc_role(void*, size_t, size_t, int);
+void arena_flush(void);
+unsigned int arena_defrag_begin(void);
+void arena_defrag_end(void);
+bool arena_sparse(const void*, size_t);
+double arena_fragmentation(void);
+void arena_report(FILE*);
+
+#endif //ARENA_H
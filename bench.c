@@ -0,0 +1,209 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "ugkvc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+
+// single thread load generator on ugkvc: round trips one at a time, then pipelined
+// SET and GET with a window of requests in flight, then MGET batches
+#define BENCH_REQUESTS 1000000
+#define BENCH_WINDOW 128
+#define BENCH_KEYS 100000
+#define BENCH_VALUE 32
+#define BENCH_BATCH 64
+
+static struct
+{
+  ugkvc_conn_t *conn;
+  unsigned int requests, window, keys, value, batch;
+  unsigned int done, failed;
+  char *val;
+} bench = {.requests = BENCH_REQUESTS, .window = BENCH_WINDOW, .keys = BENCH_KEYS, .value = BENCH_VALUE,
+  .batch = BENCH_BATCH};
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t bench_key(char *key, const unsigned int n)
+{
+  return (size_t)snprintf(key, 32, "key:%u", n % bench.keys);
+}
+
+static void bench_report(const char *name, const unsigned int n, const double secs)
+{
+  printf("%-10s %10u requests %8.3f s %12.0f req/s %8.2f us/req %u failed\n", name, n, secs, n / secs,
+    secs * 1e6 / n, bench.failed);
+  bench.failed = 0;
+}
+
+static void bench_done(const int status, const char *data, const size_t size, void *args)
+{
+  (void)data; (void)size; (void)args;
+  bench.done++;
+  if (status != PROTOCOL_STATUS_OK) bench.failed++;
+}
+
+static int bench_sync(void)
+{
+  const unsigned int n = bench.requests / 10;
+  char key[32], *value;
+  size_t lvalue;
+
+  const double start = bench_now();
+  for (unsigned int ir = 0; ir < n; ++ir)
+  {
+    const int ret = ugkvc_get(bench.conn, key, bench_key(key, ir), &value, &lvalue);
+    if (ret < 0) return -1;
+    if (ret != PROTOCOL_STATUS_OK) bench.failed++;
+    free(value);
+  }
+  bench_report("get rtt", n, bench_now() - start);
+  return 0;
+}
+
+// keeps up to window requests in flight, refilled in batches once half are answered
+static int bench_pipeline(const char *name, const bool set)
+{
+  char key[32];
+  unsigned int sent = 0;
+
+  bench.done = 0;
+  const double start = bench_now();
+  while (bench.done < bench.requests)
+  {
+    if (sent - bench.done <= bench.window / 2)
+      for (; sent < bench.requests && sent - bench.done < bench.window; ++sent)
+      {
+        const size_t lkey = bench_key(key, sent);
+        const int ret = set
+          ? ugkvc_send_set(bench.conn, key, lkey, bench.val, bench.value, bench_done, NULL)
+          : ugkvc_send_get(bench.conn, key, lkey, bench_done, NULL);
+        if (ret < 0) return -1;
+      }
+
+    // what an application event loop would do with the connection
+    struct pollfd pfd = {.fd = ugkvc_fd(bench.conn), .events = POLLIN};
+    if (ugkvc_flush(bench.conn) < 0) return -1;
+    if (ugkvc_want_write(bench.conn)) pfd.events |= POLLOUT;
+    if (poll(&pfd, 1, -1) < 0 || ugkvc_process(bench.conn) < 0) return -1;
+  }
+  bench_report(name, bench.requests, bench_now() - start);
+  return 0;
+}
+
+static int bench_mget(void)
+{
+  const unsigned int n = bench.requests / bench.batch;
+  const char **keys = malloc(bench.batch * sizeof(char*));
+  size_t *lkeys = malloc(bench.batch * sizeof(size_t)), *lvalues = malloc(bench.batch * sizeof(size_t));
+  char **values = malloc(bench.batch * sizeof(char*)), *buf = malloc(bench.batch * 32);
+  int ret = -1;
+
+  if (keys == NULL || lkeys == NULL || lvalues == NULL || values == NULL || buf == NULL) goto bench_mget_final;
+  const double start = bench_now();
+  for (unsigned int ib = 0; ib < n; ++ib)
+  {
+    for (unsigned int ik = 0; ik < bench.batch; ++ik)
+    {
+      keys[ik] = buf + ik * 32;
+      lkeys[ik] = bench_key(buf + ik * 32, ib * bench.batch + ik);
+    }
+    const int failed = ugkvc_mget(bench.conn, bench.batch, keys, lkeys, values, lvalues);
+    if (failed < 0) goto bench_mget_final;
+    bench.failed += failed;
+    for (unsigned int ik = 0; ik < bench.batch; ++ik) free(values[ik]);
+  }
+  bench_report("mget", n * bench.batch, bench_now() - start);
+  ret = 0;
+
+  bench_mget_final:
+  free(keys);
+  free(lkeys);
+  free(lvalues);
+  free(values);
+  free(buf);
+  return ret;
+}
+
+static unsigned int bench_uint(const char *arg)
+{
+  char *end;
+  const unsigned long v = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || v == 0 || v > 1u << 30)
+  {
+    fprintf(stderr, "(bench) invalid number %s\n", arg);
+    exit(EXIT_FAILURE);
+  }
+  return (unsigned int)v;
+}
+
+int main(int argc, char **argv)
+{
+  const char *host = NULL, *path = NULL;
+  unsigned short port = UGKVC_PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:u:n:w:k:v:b:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's': host = optarg; break;
+    case 'p': port = (unsigned short)bench_uint(optarg); break;
+    case 'u': path = optarg; break;
+    case 'n': bench.requests = bench_uint(optarg); break;
+    case 'w': bench.window = bench_uint(optarg); break;
+    case 'k': bench.keys = bench_uint(optarg); break;
+    case 'v': bench.value = bench_uint(optarg); break;
+    case 'b': bench.batch = bench_uint(optarg); break;
+    default:
+      fprintf(stderr, "usage: %s [-s host] [-p port] [-u unix path] [-n requests] [-w window] [-k keys] "
+        "[-v value size] [-b mget batch]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  bench.conn = path != NULL ? ugkvc_connect_unix(path) : ugkvc_connect(host, port);
+  if (bench.conn == NULL)
+  {
+    perror("(bench) connect");
+    return EXIT_FAILURE;
+  }
+  if ((bench.val = malloc(bench.value)) == NULL) return EXIT_FAILURE;
+  memset(bench.val, 'v', bench.value);
+
+  if (bench_pipeline("set", true) < 0 || bench_sync() < 0 || bench_pipeline("get", false) < 0 || bench_mget() < 0)
+  {
+    fprintf(stderr, "(bench) connection failed\n");
+    return EXIT_FAILURE;
+  }
+
+  ugkvc_close(bench.conn);
+  free(bench.val);
+  return 0;
+}
@@ -20,144 +20,794 @@
 // OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "client.h"
 #include "processor.h"
+#include "table.h"
+#include "stats.h"
+#include "arena.h"
+#include "topology.h"
+#include "ring.h"
+#include "watch.h"
+#include "trace.h"
+#if defined(__linux__)
+#include "epoll.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#define CLIENTS 8192
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#define CLIENT_READ_CHUNK 16384
+#define CLIENT_READ_BUDGET (256 * 1024)  // per wakeup, then other sockets get a turn
+#define CLIENT_WRITE_BUDGET (256 * 1024)
+#define CLIENT_STREAM_MIN (64 * 1024)    // SET frames from this size on are streamed
+#define CLIENT_MAX_FRAME (TABLE_MAXVALUE + CLIENT_STREAM_MIN) // larger frames close the connection
+#define CLIENT_MAX_INFLIGHT 1024         // requests queued or running, then reading pauses
+#define CLIENT_MAX_INPUT (64 * 1024 * 1024) // bytes of the requests queued or running, then reading pauses
+#define CLIENT_MAX_OUTPUT (8 * 1024 * 1024) // reply bytes not yet sent, then reading pauses
 
 static client_t clients[CLIENTS];
+static int cfd = -1; // epoll set the client sockets are registered in
+static bool held; // no connection reads while a handover moves the data, see client_hold
+
+static client_t *client_get(const int fd)
+{
+  if (fd < 0 || fd >= CLIENTS) return NULL;
+  if (clients[fd].fd < 0) return NULL;
+  return &clients[fd];
+}
+
+static void client_out_free(client_out_t *out)
+{
+  if (out->borrow != NULL) table_release(out->borrow);
+  trace_commit(out->trace);
+  free(out);
+}
 
 int client_clear(const int fd)
 {
-  if (fd > CLIENTS) return -1;
-  if (clients[fd].fd < 0) return -1;
+  if (fd < 0 || fd >= CLIENTS) return -1;
+  if (pthread_mutex_lock(&clients[fd].mtx) != 0) return -1;
+  if (clients[fd].fd < 0)
+  {
+    pthread_mutex_unlock(&clients[fd].mtx);
+    return -1;
+  }
 
   printf("(client) clear socket: %d\n", fd);
   clients[fd].fd = -1;
   clients[fd].locked = false;
   clients[fd].buffersize = 0;
-  if (clients->buffer != NULL) free(clients[fd].buffer);
-  if (pthread_mutex_destroy(&clients[fd].mtx) < 0) perror("(client) pthread_mutex_destroy");
-  
+  arena_free(clients[fd].buffer, clients[fd].buffercap);
+  clients[fd].buffer = NULL;
+  clients[fd].buffercap = 0;
+
+  if (clients[fd].streaming)
+  {
+    free(clients[fd].shead);
+    table_release(clients[fd].svalue);
+    clients[fd].streaming = false;
+  }
+
+  while (clients[fd].ohead != NULL)
+  {
+    client_out_t *out = clients[fd].ohead;
+    clients[fd].ohead = out->nxt;
+    client_out_free(out);
+  }
+  clients[fd].otail = NULL;
+  clients[fd].paused = false;
+  clients[fd].closing = false;
+  clients[fd].inflight = 0;
+  clients[fd].ibytes = 0;
+  clients[fd].obytes = 0;
+  if (clients[fd].ring != NULL)
+  {
+    ring_close(clients[fd].ring);
+    clients[fd].ring = NULL;
+  }
+
+  if (pthread_mutex_unlock(&clients[fd].mtx) != 0) perror("(client) pthread_mutex_unlock");
+  processor_flow_reset(fd);
+  watch_forget(fd);
   return 0;
 }
 
 int client_set(const int fd)
 {
-  if (fd > CLIENTS) return -1;
+  if (fd < 0 || fd >= CLIENTS) return -1;
   if (clients[fd].fd > -1) return -1;
 
-  clients[fd].fd = fd;
   clients[fd].locked = false;
   clients[fd].buffer = NULL;
   clients[fd].buffersize = 0;
-  if (pthread_mutex_init(&clients[fd].mtx, NULL) < 0)
+  clients[fd].buffercap = 0;
+  clients[fd].streaming = false;
+  clients[fd].ohead = NULL;
+  clients[fd].otail = NULL;
+  clients[fd].paused = held;
+  clients[fd].closing = false;
+  clients[fd].inflight = 0;
+  clients[fd].ibytes = 0;
+  clients[fd].obytes = 0;
+  clients[fd].ring = NULL;
+  clients[fd].gen++;
+  clients[fd].fd = fd;
+
+  return 0;
+}
+
+// a client talking through a shared memory ring, fd is its request eventfd
+int client_set_ring(const int fd, ring_t *ring)
+{
+  if (client_set(fd) < 0) return -1;
+  clients[fd].ring = ring;
+  return 0;
+}
+
+static int client_reserve(client_t *c, const size_t size)
+{
+  if (size <= c->buffercap) return 0;
+
+  size_t cap = c->buffercap > 0 ? c->buffercap : CLIENT_READ_CHUNK;
+  while (cap < size) cap *= 2;
+
+  char *tmpbuffer = arena_realloc_role(c->buffer, c->buffercap, cap, TOPOLOGY_ROLE_WORKER);
+  if (tmpbuffer == NULL)
+  {
+    perror("(client) arena_realloc_role");
+    return -1;
+  }
+  c->buffer = tmpbuffer;
+  c->buffercap = cap;
+  return 0;
+}
+
+// copies queued replies into the reply ring until it is full
+static int client_flush_ring_locked(client_t *c)
+{
+  bool wrote = false, blocked = false;
+
+  while (c->ohead != NULL)
+  {
+    client_out_t *out = c->ohead;
+    size_t n;
+
+    if (out->hsent < out->lheader)
+    {
+      n = ring_write(c->ring, out->header + out->hsent, out->lheader - out->hsent);
+      out->hsent += n;
+      wrote |= n > 0;
+    }
+    if (out->hsent == out->lheader && out->sent < out->size)
+    {
+      n = ring_write(c->ring, out->data + out->sent, out->size - out->sent);
+      out->sent += n;
+      wrote |= n > 0;
+    }
+
+    if (out->hsent < out->lheader || out->sent < out->size)
+    {
+      // the client signals once it made room, it may have just done so
+      if (blocked) break;
+      ring_block(c->ring);
+      blocked = true;
+      continue;
+    }
+
+    c->obytes -= out->lheader + out->size;
+    c->ohead = out->nxt;
+    if (c->ohead == NULL) c->otail = NULL;
+    trace_stamp(out->trace, TRACE_SENT);
+    client_out_free(out);
+  }
+
+  if (wrote) ring_signal(c->ring);
+  return 0;
+}
+
+// writes queued replies until the socket is full or the budget is spent, the mutex must be held
+static int client_flush_locked(client_t *c)
+{
+  size_t budget = CLIENT_WRITE_BUDGET;
+
+  if (c->ring != NULL) return client_flush_ring_locked(c);
+
+  while (c->ohead != NULL && budget > 0)
   {
-    perror("(client) pthread_mutex_init");
-    clients[fd].fd = -1;
+    client_out_t *out = c->ohead;
+    size_t left = out->size - out->sent;
+    if (left > budget) left = budget;
+
+    struct iovec iov[2] = {
+      {.iov_base = out->header + out->hsent, .iov_len = out->lheader - out->hsent},
+      {.iov_base = (char*)out->data + out->sent, .iov_len = left}
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    if (out->hsent == out->lheader)
+    {
+      msg.msg_iov = &iov[1];
+      msg.msg_iovlen = 1;
+    }
+
+    const ssize_t bytes = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (bytes < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      perror("(client) sendmsg");
+      return -1;
+    }
+
+    size_t sent = bytes;
+    if (out->hsent < out->lheader)
+    {
+      const size_t h = out->lheader - out->hsent < sent ? out->lheader - out->hsent : sent;
+      out->hsent += h;
+      sent -= h;
+    }
+    out->sent += sent;
+    budget = budget > (size_t)bytes ? budget - bytes : 0;
+
+    if (out->hsent == out->lheader && out->sent == out->size)
+    {
+      c->obytes -= out->lheader + out->size;
+      c->ohead = out->nxt;
+      if (c->ohead == NULL) c->otail = NULL;
+      trace_stamp(out->trace, TRACE_SENT);
+      client_out_free(out);
+    }
+  }
+
+  return 0;
+}
+
+static int client_arm_locked(const client_t *c)
+{
+#if defined(__linux__)
+  const bool reading = !c->paused || c->closing;
+  if (c->ring != NULL)
+  {
+    // a ring is never ready by itself, requests left behind are signalled again
+    if (reading && (ring_pending(c->ring) > 0 || atomic_load_explicit(&c->ring->closed, memory_order_acquire)))
+      ring_wake(c->ring);
+    return epoll_mod(cfd, c->fd, reading ? EPOLLIN : 0);
+  }
+  return epoll_mod(cfd, c->fd, (reading ? EPOLLIN : 0) | (c->ohead != NULL ? EPOLLOUT : 0));
+#elif defined(__APPLE__)
+  return 0;
+#endif
+}
+
+static int client_queue_locked(client_t *c, client_out_t *out)
+{
+  const bool idle = c->ohead == NULL;
+  out->trace = trace_claim();
+  if (c->otail != NULL) c->otail->nxt = out;
+  else c->ohead = out;
+  c->otail = out;
+  c->obytes += out->lheader + out->size;
+
+  // try right away, whatever does not fit goes out on EPOLLOUT
+  int ret = idle ? client_flush_locked(c) : 0;
+  if (ret == 0 && c->ohead != NULL) ret = client_arm_locked(c);
+  return ret;
+}
+
+static void client_header(client_out_t *out, const unsigned int id, const unsigned short status, const size_t size)
+{
+  const unsigned int size32 = size;
+  memcpy(out->header, &size32, 4);
+  memcpy(out->header + 4, &status, 2);
+  memcpy(out->header + 6, &id, 4);
+  out->lheader = PROTOCOL_HEADER;
+  out->hsent = 0;
+  out->sent = 0;
+  out->size = size;
+  out->trace = NULL;
+  out->nxt = NULL;
+}
+
+// answers a request the processor never saw, such as BUSY, from the reading thread
+static int client_status_locked(client_t *c, const unsigned int id, const unsigned short status)
+{
+  client_out_t *out = malloc(sizeof(client_out_t));
+  if (out == NULL) return -1;
+
+  client_header(out, id, status, 0);
+  out->data = out->inline_data;
+  out->borrow = NULL;
+  return client_queue_locked(c, out);
+}
+
+// accounts for the result of handing a request of bytes, frame header included, to the
+// processor. a full queue is answered with BUSY, unless earlier requests of the
+// connection are still running: a BUSY would overtake their replies, so 1 tells the
+// caller to pause and retry
+static int client_dispatch(client_t *c, const int ret, const unsigned int id, const unsigned long bytes)
+{
+  if (ret == 0)
+  {
+    c->inflight++;
+    c->ibytes += bytes;
+    return 0;
+  }
+
+  if (ret == PROCESSOR_EBUSY && c->inflight > 0)
+  {
+    c->paused = true;
+    stats_add(STATS_PAUSED, 1);
+    return 1;
+  }
+
+  if (ret == PROCESSOR_EBUSY)
+  {
+    stats_add(STATS_BUSY, 1);
+    return client_status_locked(c, id, PROTOCOL_STATUS_BUSY);
+  }
+  return client_status_locked(c, id, PROTOCOL_STATUS_ERROR);
+}
+
+static bool client_full(const client_t *c)
+{
+  return c->inflight >= CLIENT_MAX_INFLIGHT || c->ibytes >= CLIENT_MAX_INPUT || c->obytes >= CLIENT_MAX_OUTPUT;
+}
+
+// the value of a large SET is allocated up front and filled by client_read as the
+// body arrives, so it is never held twice
+static int client_stream_begin(client_t *c, const unsigned int id, const unsigned short cmd, const char *head,
+  const unsigned int lhead, const unsigned long lvalue)
+{
+  if ((c->shead = malloc(lhead)) == NULL) return -1;
+  if ((c->svalue = table_alloc(lvalue)) == NULL)
+  {
+    free(c->shead);
     return -1;
   }
 
+  memcpy(c->shead, head, lhead);
+  c->lshead = lhead;
+  c->sid = id;
+  c->scmd = cmd;
+  c->lsvalue = lvalue;
+  c->sfilled = 0;
+  c->streaming = true;
   return 0;
 }
 
-int client_append(const int fd, const char *data, const size_t datasize)
+// the value stays with the client when the request has to be retried
+static int client_stream_end(client_t *c)
+{
+  const int ret = processor_enqueue_value(c->fd, c->lshead, c->sid, c->scmd, c->shead, c->svalue, c->lsvalue,
+    trace_sample(c->fd, c->sid, c->scmd));
+  const int dispatched = client_dispatch(c, ret, c->sid, PROTOCOL_HEADER + c->lshead + c->lsvalue);
+  if (dispatched > 0) return 0;
+
+  if (ret < 0) table_release(c->svalue);
+  free(c->shead);
+  c->streaming = false;
+  return dispatched;
+}
+
+// dispatches every complete frame in the buffer and keeps the partial one
+static int client_parse(client_t *c)
 {
   unsigned int messagesize = 0, messageid = 0;
   unsigned short messagecmd = 0;
+  size_t offset = 0;
+
+  // a finished streamed SET that was held back by a full queue
+  if (c->streaming && c->sfilled == c->lsvalue && client_stream_end(c) < 0) return -1;
+
+  while (!c->streaming && c->buffersize - offset >= PROTOCOL_HEADER)
+  {
+    const char *frame = c->buffer + offset;
+    const size_t avail = c->buffersize - offset - PROTOCOL_HEADER;
 
-  if (fd > CLIENTS) return -1;
-  if (clients[fd].fd < 0) return -1;
+    memcpy(&messagesize, frame, 4);
+    memcpy(&messagecmd, frame + 4, 2);
+    memcpy(&messageid, frame + 6, 4);
 
-  if (pthread_mutex_lock(&clients[fd].mtx) < 0)
+    if (messagesize > CLIENT_MAX_FRAME) return -1;
+    if (client_full(c))
+    {
+      // stop here, the rest stays buffered until replies drain
+      c->paused = true;
+      stats_add(STATS_PAUSED, 1);
+      break;
+    }
+
+    if ((messagecmd & ~(PROTOCOL_FLAG_NAMESPACE | PROTOCOL_FLAG_DEADLINE)) == PROTOCOL_CMD_SET &&
+      messagesize >= CLIENT_STREAM_MIN)
+    {
+      // the head keeps the deadline and namespace prefixes, the processor takes them off
+      const unsigned int ns = (messagecmd & PROTOCOL_FLAG_NAMESPACE ? 2 : 0) +
+        (messagecmd & PROTOCOL_FLAG_DEADLINE ? 4 : 0);
+      unsigned int keysize, valuesize;
+
+      if (avail < ns + 8) break;
+      memcpy(&keysize, frame + PROTOCOL_HEADER + ns, 4);
+      memcpy(&valuesize, frame + PROTOCOL_HEADER + ns + 4, 4);
+      if (ns + 8ul + keysize + valuesize != messagesize) return -1;
+      if (avail < ns + 8ul + keysize) break;
+
+      const unsigned int lhead = ns + 8 + keysize;
+      if (client_stream_begin(c, messageid, messagecmd, frame + PROTOCOL_HEADER, lhead, valuesize) < 0) return -1;
+
+      const size_t have = avail - lhead;
+      c->sfilled = have < valuesize ? have : valuesize;
+      memcpy(c->svalue, frame + PROTOCOL_HEADER + lhead, c->sfilled);
+      offset += PROTOCOL_HEADER + lhead + c->sfilled;
+
+      if (c->sfilled == c->lsvalue && client_stream_end(c) < 0) return -1;
+      continue;
+    }
+
+    if (messagesize > avail) break;
+
+    // dispatch message here
+    const int ret = client_dispatch(c, processsor_enqueue(c->fd, messagesize, messageid, messagecmd,
+      frame + PROTOCOL_HEADER, trace_sample(c->fd, messageid, messagecmd)), messageid, PROTOCOL_HEADER + messagesize);
+    if (ret < 0) return -1;
+    if (ret > 0) break;
+
+    offset += PROTOCOL_HEADER + messagesize;
+  }
+
+  // now free what was consumed, keeping a partial frame for the next read
+  if (offset == c->buffersize)
+  {
+    c->buffersize = 0;
+  } else if (offset > 0)
+  {
+    memmove(c->buffer, c->buffer + offset, c->buffersize - offset);
+    c->buffersize -= offset;
+  }
+
+  return 0;
+}
+
+// reads from the socket, or takes from the request ring: -1 with EAGAIN once it is empty,
+// 0 once the ring was closed
+static ssize_t client_recv(client_t *c, char *dst, const size_t want)
+{
+  if (c->ring == NULL) return read(c->fd, dst, want);
+  if (atomic_load_explicit(&c->ring->closed, memory_order_acquire)) return 0;
+
+  const size_t n = ring_read(c->ring, dst, want);
+  if (n > 0) return (ssize_t)n;
+  errno = EAGAIN;
+  return -1;
+}
+
+// reads what the socket has, up to CLIENT_READ_BUDGET. 0 when the peer closed,
+// -1 on error, 1 otherwise.
+int client_read(const int fd)
+{
+  size_t budget = CLIENT_READ_BUDGET;
+  ssize_t bytes = 1; // a paused connection may still see an EPOLLIN taken before it paused, it reads nothing
+  int ret = 1;
+  client_t *c;
+
+  if ((c = client_get(fd)) == NULL) return -1;
+  if (pthread_mutex_lock(&c->mtx) != 0)
   {
     perror("(client) pthread_mutex_lock");
     return -1;
   }
 
-  clients[fd].locked = true;
+  c->locked = true;
+  trace_locked();
+
+  // a ring wakes its worker for requests and for room to reply alike
+  if (c->ring != NULL)
+  {
+    ring_ack(c->ring);
+    if (c->ohead != NULL && client_flush_locked(c) < 0) goto client_read_error;
+  }
+
+  // the peer of a connection handed over reads the end of the stream and closes, what
+  // it sent meanwhile is for the successor to answer on a new connection
+  if (c->closing)
+  {
+    char scratch[CLIENT_READ_CHUNK];
+    while ((bytes = client_recv(c, scratch, sizeof(scratch))) > 0)
+      ;
+  }
 
-  if (clients[fd].buffer == NULL)
-    if ((clients[fd].buffer = malloc(datasize)) == NULL)
+  while (budget > 0 && !c->paused && !c->closing)
+  {
+    if (c->streaming)
     {
-      perror("(client) malloc");
-      return -1;
+      size_t want = c->lsvalue - c->sfilled;
+      if (want > budget) want = budget;
+      if ((bytes = client_recv(c, c->svalue + c->sfilled, want)) <= 0) break;
+      c->sfilled += bytes;
+      budget -= bytes;
+      if (c->sfilled == c->lsvalue && client_parse(c) < 0) goto client_read_error;
+      continue;
     }
-  else
+
+    if (client_reserve(c, c->buffersize + CLIENT_READ_CHUNK) < 0) goto client_read_error;
+    if ((bytes = client_recv(c, c->buffer + c->buffersize, CLIENT_READ_CHUNK)) <= 0) break;
+    c->buffersize += bytes;
+    budget -= bytes;
+    if (client_parse(c) < 0) goto client_read_error;
+  }
+
+  if (bytes == 0) ret = 0;
+  else if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+  {
+    perror("(client) read");
+    ret = -1;
+  }
+  goto client_unlock;
+
+  client_read_error:
+  ret = -1;
+
+  client_unlock:
+  c->locked = false;
+  if (pthread_mutex_unlock(&c->mtx) != 0)
   {
-    char *tmpbuffer = realloc(clients[fd].buffer, clients[fd].buffersize + datasize);
-    if (tmpbuffer == NULL)
+    perror("(client) pthread_mutex_unlock");
+    return -1;
+  }
+
+  return ret;
+}
+
+// picks up reading once the connection drained to half its limits, the frames
+// left in the buffer go first
+static void client_resume_locked(client_t *c)
+{
+  if (!c->paused || held) return;
+  if (c->inflight > CLIENT_MAX_INFLIGHT / 2 || c->ibytes > CLIENT_MAX_INPUT / 2 || c->obytes > CLIENT_MAX_OUTPUT / 2)
+    return;
+
+  c->paused = false;
+  if (client_parse(c) < 0)
+  {
+    // a bad frame, the worker sees the hang up on its next read and closes
+    if (c->ring == NULL) shutdown(c->fd, SHUT_RDWR);
+    else
     {
-      perror("(client) realloc");
-      return client_clear(fd);
+      atomic_store_explicit(&c->ring->closed, true, memory_order_release);
+      ring_wake(c->ring);
     }
   }
+  if (client_arm_locked(c) < 0) perror("(client) client_arm_locked");
+}
+
+int client_flush(const int fd)
+{
+  client_t *c;
+  int ret = 0;
+
+  if ((c = client_get(fd)) == NULL) return 0;
+  if (pthread_mutex_lock(&c->mtx) != 0) return -1;
+  if (c->fd == fd)
+  {
+    ret = client_flush_locked(c);
+    if (ret == 0) client_resume_locked(c);
+  }
+  pthread_mutex_unlock(&c->mtx);
+  return ret;
+}
 
-  memcpy(clients[fd].buffer + clients[fd].buffersize, data, datasize);
-  clients[fd].buffersize += datasize;
+// the connection now on fd, requests carry it so their answers cannot reach a later one
+unsigned int client_gen(const int fd)
+{
+  client_t *c = client_get(fd);
+  return c != NULL ? c->gen : 0;
+}
 
-  // check for a full message
-  // if we have -> put it in the execution queue / another worker will handle
-  // free the buffer here and unlock mutex.
+// called by the processor once a request of connection gen was answered, bytes as
+// handed to client_dispatch
+void client_done(const int fd, const unsigned int gen, const unsigned long bytes)
+{
+  client_t *c;
 
-  // if message is not ready
-  // unlock mtx
+  if ((c = client_get(fd)) == NULL) return;
+  if (pthread_mutex_lock(&c->mtx) != 0) return;
+  if (c->fd == fd && c->gen == gen)
+  {
+    if (c->inflight > 0) c->inflight--;
+    c->ibytes -= bytes < c->ibytes ? bytes : c->ibytes;
+    client_resume_locked(c);
+  }
+  pthread_mutex_unlock(&c->mtx);
+}
 
-  while (clients[fd].buffersize > 10)
+// with hold, stops reading requests on every connection while a handover moves the
+// data, the ones read already are still answered. without, picks reading up again
+void client_hold(const bool hold)
+{
+  held = hold;
+  for (unsigned int ic = 0; ic < CLIENTS; ++ic)
   {
-    memcpy(&messagesize, clients[fd].buffer, 4);
-    if (messagesize > (clients[fd].buffersize - 10)) goto client_unlock;
+    client_t *c = &clients[ic];
+    if (pthread_mutex_lock(&c->mtx) != 0) continue;
+    if (c->fd >= 0)
+    {
+      if (!hold) client_resume_locked(c);
+      else if (!c->paused)
+      {
+        c->paused = true;
+        if (client_arm_locked(c) < 0) perror("(client) client_arm_locked");
+      }
+    }
+    pthread_mutex_unlock(&c->mtx);
+  }
+}
 
-    memcpy(&messagecmd, clients[fd].buffer + 4, 2);
-    memcpy(&messageid, clients[fd].buffer + 6, 4);
+// requests read and not answered yet, over every connection
+unsigned long client_pending(void)
+{
+  unsigned long pending = 0;
 
-    char data[messagesize];
-    memcpy(&data, clients[fd].buffer + 10, messagesize);
+  for (unsigned int ic = 0; ic < CLIENTS; ++ic)
+  {
+    client_t *c = &clients[ic];
+    if (pthread_mutex_lock(&c->mtx) != 0) continue;
+    if (c->fd >= 0) pending += c->inflight;
+    pthread_mutex_unlock(&c->mtx);
+  }
+  return pending;
+}
 
-    // dispatch message here
-    //write(fd, message, messagesize);
-    if (processsor_enqueue(fd, messagesize, messageid, messagecmd, data) < 0)
+// ends the connections held by client_hold once their answers are out: the peer sees
+// the stream end after the last one and reconnects, to the successor by then. returns
+// how many connections are still open
+unsigned int client_finish(void)
+{
+  unsigned int open = 0;
+
+  for (unsigned int ic = 0; ic < CLIENTS; ++ic)
+  {
+    client_t *c = &clients[ic];
+    if (pthread_mutex_lock(&c->mtx) != 0) continue;
+    if (c->fd >= 0)
     {
-      exit(EXIT_FAILURE);
+      open++;
+      if (!c->closing && c->inflight == 0 && c->ohead == NULL)
+      {
+        c->closing = true;
+        if (c->ring == NULL) shutdown(c->fd, SHUT_WR);
+        else
+        {
+          atomic_store_explicit(&c->ring->closed, true, memory_order_release);
+          ring_wake(c->ring);
+        }
+        if (client_arm_locked(c) < 0) perror("(client) client_arm_locked");
+      }
     }
-    // ...
-    // now free
-    int diff = clients[fd].buffersize - (messagesize + 10);
-    if (diff > 0)
-    {
-      char *tmpbuffer = malloc(diff);
-      free(clients[fd].buffer);
-      clients[fd].buffer = tmpbuffer;
-      clients[fd].buffersize = diff;
-    } else
+    pthread_mutex_unlock(&c->mtx);
+  }
+  return open;
+}
+
+static int client_queue(const int fd, const unsigned int gen, client_out_t *out)
+{
+  client_t *c;
+
+  if ((c = client_get(fd)) == NULL || pthread_mutex_lock(&c->mtx) != 0)
+  {
+    client_out_free(out);
+    return -1;
+  }
+  if (c->fd != fd || c->gen != gen)
+  {
+    pthread_mutex_unlock(&c->mtx);
+    client_out_free(out);
+    return -1;
+  }
+
+  const int ret = client_queue_locked(c, out);
+  pthread_mutex_unlock(&c->mtx);
+  return ret;
+}
+
+// re-arms the socket for input, and for output while replies are queued
+int client_arm(const int fd)
+{
+  client_t *c;
+  int ret;
+
+  if ((c = client_get(fd)) == NULL) return 0;
+  if (pthread_mutex_lock(&c->mtx) != 0) return -1;
+  ret = c->fd == fd ? client_arm_locked(c) : 0;
+  pthread_mutex_unlock(&c->mtx);
+  return ret;
+}
+
+// queues a reply frame for connection gen, the payload is copied
+int client_reply(const int fd, const unsigned int gen, const unsigned int id, const unsigned short status,
+  const char *data, const size_t size)
+{
+  client_out_t *out = malloc(sizeof(client_out_t) + size);
+  if (out == NULL) return -1;
+
+  client_header(out, id, status, size);
+  if (size > 0) memcpy(out->inline_data, data, size);
+  out->data = out->inline_data;
+  out->borrow = NULL;
+  return client_queue(fd, gen, out);
+}
+
+// queues a frame the connection did not ask for, with id 0. one that does not keep
+// up with its output misses it, 1 is returned then
+int client_push(const int fd, const unsigned short status, const char *data, const size_t size)
+{
+  client_t *c;
+  int ret = 1;
+
+  if ((c = client_get(fd)) == NULL) return -1;
+  if (pthread_mutex_lock(&c->mtx) != 0) return -1;
+  if (c->fd != fd) ret = -1;
+  else if (c->obytes < CLIENT_MAX_OUTPUT)
+  {
+    client_out_t *out = malloc(sizeof(client_out_t) + size);
+    if (out == NULL) ret = -1;
+    else
     {
-      free(clients[fd].buffer);
-      clients[fd].buffer = NULL;
-      clients[fd].buffersize = 0;
+      client_header(out, 0, status, size);
+      if (size > 0) memcpy(out->inline_data, data, size);
+      out->data = out->inline_data;
+      out->borrow = NULL;
+      ret = client_queue_locked(c, out);
     }
-
-    messagesize = 0;
-    messagecmd = 0;
-    messageid = 0;
   }
+  pthread_mutex_unlock(&c->mtx);
+  return ret;
+}
 
-  client_unlock:
-  if (pthread_mutex_unlock(&clients[fd].mtx) < 0)
+// queues a reply frame sending size bytes at data straight out of a borrowed table
+// value, which is released once written
+int client_reply_borrowed(const int fd, const unsigned int gen, const unsigned int id, const unsigned short status,
+  const char *borrow, const char *data, const size_t size)
+{
+  return client_reply_prefixed(fd, gen, id, status, NULL, 0, borrow, data, size);
+}
+
+// like client_reply_borrowed, with up to CLIENT_PREFIX_MAX bytes of prefix sent
+// ahead of the value
+int client_reply_prefixed(const int fd, const unsigned int gen, const unsigned int id, const unsigned short status,
+  const char *prefix, const unsigned int lprefix, const char *borrow, const char *data, const size_t size)
+{
+  client_out_t *out;
+
+  if (lprefix > CLIENT_PREFIX_MAX || (out = malloc(sizeof(client_out_t))) == NULL)
   {
-    perror("(client) pthread_mutex_unlock");
-    return client_clear(fd);
+    table_release(borrow);
+    return -1;
   }
 
-  return 0;
+  client_header(out, id, status, lprefix + size);
+  if (lprefix > 0) memcpy(out->header + PROTOCOL_HEADER, prefix, lprefix);
+  out->lheader += lprefix;
+  out->size = size;
+  out->data = data;
+  out->borrow = borrow;
+  return client_queue(fd, gen, out);
 }
 
-void client_setup(void)
+void client_setup(const int epollfd)
 {
+  cfd = epollfd;
   for(unsigned int ic = 0; ic < CLIENTS; ++ic)
   {
     clients[ic].fd = -1;
     clients[ic].locked = false;
     clients[ic].buffer = NULL;
+    clients[ic].streaming = false;
+    clients[ic].ohead = NULL;
+    clients[ic].otail = NULL;
+    clients[ic].paused = false;
+    clients[ic].closing = false;
+    clients[ic].inflight = 0;
+    clients[ic].ibytes = 0;
+    clients[ic].obytes = 0;
+    clients[ic].ring = NULL;
+    if (pthread_mutex_init(&clients[ic].mtx, NULL) != 0) perror("(client) pthread_mutex_init");
   }
 }
\ No newline at end of file
@@ -21,20 +21,72 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "protocol.h"
+#include "ring.h"
+#include "trace.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#define CLIENTS 8192
+#define CLIENT_PREFIX_MAX 8 // bytes a reply can carry ahead of a borrowed value
+
+typedef struct client_out
+{
+  char header[PROTOCOL_HEADER + CLIENT_PREFIX_MAX];
+  unsigned int lheader, hsent;
+  const char *data;
+  const char *borrow; // table value to release once sent, NULL when data is inline
+  trace_span_t *trace; // of the request answered, when it is traced
+  size_t size, sent;
+  struct client_out *nxt;
+  char inline_data[];
+} client_out_t;
 
 typedef struct client
 {
   pthread_mutex_t mtx;
-  size_t buffersize;
+  size_t buffersize, buffercap;
   int fd;
+  unsigned int gen; // connections the fd has carried, answers for an earlier one are dropped
   bool locked;
   char *buffer;
+
+  // large SET being read straight into its value
+  bool streaming;
+  unsigned int sid, lshead;
+  unsigned short scmd; // PROTOCOL_CMD_SET and its flags
+  char *shead; // SET header and key, behind the namespace if any
+  char *svalue;
+  unsigned long lsvalue, sfilled;
+
+  client_out_t *ohead, *otail;
+
+  // backpressure, reading stops while too much is in flight or waiting to be sent
+  bool paused;
+  bool closing; // handed over, the write side is shut and input is thrown away, see client_finish
+  unsigned int inflight;
+  size_t ibytes; // of the requests in flight, as framed
+  size_t obytes;
+
+  ring_t *ring; // shared memory transport, NULL for sockets
 } client_t;
 
-void client_setup(void);
+void client_setup(int);
 int client_clear(int);
 int client_set(int);
-int client_append(const int,const char*,const size_t);
+int client_set_ring(int, ring_t*);
+int client_read(int);
+int client_flush(int);
+int client_arm(int);
+unsigned int client_gen(int);
+void client_done(int, unsigned int, unsigned long);
+void client_hold(bool);
+unsigned long client_pending(void);
+unsigned int client_finish(void);
+int client_reply(int, unsigned int, unsigned int, unsigned short, const char*, size_t);
+int client_reply_borrowed(int, unsigned int, unsigned int, unsigned short, const char*, const char*, size_t);
+int client_push(int, unsigned short, const char*, size_t);
+int client_reply_prefixed(int, unsigned int, unsigned int, unsigned short, const char*, unsigned int, const char*,
+  const char*, size_t);
 #endif //CLIENT_H
\ No newline at end of file
@@ -0,0 +1,183 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_HASHLOG 12
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12     // the last match starts at least this far from the end
+#define LZ4_LASTLITERALS 5 // and the block always ends with this many literals
+#define LZ4_MAXOFFSET 65535
+
+static inline uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t lz4hash(const uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ4_HASHLOG);
+}
+
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, size_t len)
+{
+  while (len >= 255)
+  {
+    if (op >= oend) return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend, const unsigned char *lit,
+  const size_t llit, const size_t offset, const size_t lmatch)
+{
+  if (op >= oend) return NULL;
+  unsigned char *token = op++;
+
+  *token = (unsigned char)((llit >= 15 ? 15 : llit) << 4);
+  if (llit >= 15 && (op = put_length(op, oend, llit - 15)) == NULL) return NULL;
+  if ((size_t)(oend - op) < llit) return NULL;
+  memcpy(op, lit, llit);
+  op += llit;
+
+  // the last sequence carries literals only
+  if (lmatch == 0) return op;
+
+  if (oend - op < 2) return NULL;
+  *op++ = (unsigned char)(offset & 0xff);
+  *op++ = (unsigned char)(offset >> 8);
+
+  const size_t ml = lmatch - LZ4_MINMATCH;
+  *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+  if (ml >= 15 && (op = put_length(op, oend, ml - 15)) == NULL) return NULL;
+  return op;
+}
+
+// greedy single probe compressor. returns the compressed size, or 0 when the
+// output would not fit in cap bytes, which callers use to skip poor ratios.
+size_t compress_lz4(const char *src, const size_t lsrc, char *dst, const size_t cap)
+{
+  uint32_t table[1 << LZ4_HASHLOG];
+  const unsigned char *in = (const unsigned char*)src;
+  const unsigned char *ip = in, *anchor = in, *iend = in + lsrc;
+  unsigned char *op = (unsigned char*)dst, *oend = op + cap;
+  unsigned int misses = 0;
+
+  if (lsrc > LZ4_MFLIMIT)
+  {
+    const unsigned char *mflimit = iend - LZ4_MFLIMIT, *matchlimit = iend - LZ4_LASTLITERALS;
+
+    memset(table, 0, sizeof(table));
+    ip++;
+    while (ip < mflimit)
+    {
+      const uint32_t h = lz4hash(read32(ip));
+      const unsigned char *ref = in + table[h];
+      table[h] = (uint32_t)(ip - in);
+
+      if (ref >= ip || ip - ref > LZ4_MAXOFFSET || read32(ref) != read32(ip))
+      {
+        // skip faster through data that does not compress
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      const unsigned char *mp = ip + LZ4_MINMATCH, *rp = ref + LZ4_MINMATCH;
+      while (mp < matchlimit && *mp == *rp)
+      {
+        mp++;
+        rp++;
+      }
+
+      if ((op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip)) == NULL) return 0;
+      ip = mp;
+      anchor = ip;
+      if (ip - 2 >= in && ip < mflimit) table[lz4hash(read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+    }
+  }
+
+  if ((op = put_sequence(op, oend, anchor, iend - anchor, 0, 0)) == NULL) return 0;
+  return (size_t)(op - (unsigned char*)dst);
+}
+
+// decodes exactly ldst bytes, -1 on malformed input
+long decompress_lz4(const char *src, const size_t lsrc, char *dst, const size_t ldst)
+{
+  const unsigned char *ip = (const unsigned char*)src, *iend = ip + lsrc;
+  unsigned char *op = (unsigned char*)dst, *oend = op + ldst;
+
+  while (ip < iend)
+  {
+    const unsigned char token = *ip++;
+    size_t len = token >> 4;
+
+    if (len == 15)
+    {
+      unsigned char b;
+      do
+      {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return -1;
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return -1;
+    const size_t offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst)) return -1;
+
+    len = token & 15;
+    if (len == 15)
+    {
+      unsigned char b;
+      do
+      {
+        if (ip >= iend) return -1;
+        b = *ip++;
+        len += b;
+      } while (b == 255);
+    }
+    len += LZ4_MINMATCH;
+    if (len > (size_t)(oend - op)) return -1;
+
+    const unsigned char *match = op - offset;
+    if (offset >= len) memcpy(op, match, len);
+    else for (size_t ib = 0; ib < len; ++ib) op[ib] = match[ib];
+    op += len;
+  }
+
+  if (op != oend) return -1;
+  return (long)ldst;
+}
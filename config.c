@@ -0,0 +1,232 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "config.h"
+#include "worker.h"
+#include "processor.h"
+#include "table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
+
+static config_t config = {
+  .workers    = WORKERS,
+  .processors = PROCESSOR_WORKERS,
+  .affinity   = CONFIG_AFFINITY_NONE,
+  .cpus       = NULL,
+  .ordered    = false,
+  .compressmin = 0,
+  .readcache  = false,
+  .tierfile   = NULL,
+  .tiermemory = 1ul << 30,
+  .namespaces = 1,
+  .import     = NULL,
+  .hugepages  = false,
+  .prefault   = 0,
+  .defrag     = 0,
+  .handover   = NULL,
+  .unixpath   = NULL,
+  .ring       = NULL,
+  .trace      = 0,
+  .slowlog    = 10000
+};
+
+static void config_usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -w, --workers=N        network worker threads (default %d)\n"
+    "  -p, --processors=N     processor threads (default %d)\n"
+    "  -a, --affinity=POLICY  none, compact, spread or list (default none)\n"
+    "  -c, --cpus=LIST        cpu list for --affinity=list, e.g. 0-3,8\n"
+    "  -o, --ordered-index    maintain the ordered key index used by SCAN\n"
+    "  -z, --compress-min=N   lz4 compress values of at least N bytes, 16 or more (default 0, off)\n"
+    "  -r, --read-cache       keep per-thread copies of the hottest keys\n"
+    "  -t, --tier-file=PATH   spill cold values to PATH.<n> on local disk\n"
+    "  -m, --tier-memory=N    bytes of values kept in memory with --tier-file (default 1 GiB)\n"
+    "  -n, --namespaces=N     independent keyspaces requests can select (default 1)\n"
+    "  -i, --import=PATH      load the records of PATH into namespace 0 before serving\n"
+    "  -H, --huge-pages       back table and connection memory with 2 MiB pages\n"
+    "  -P, --prefault=N       map and touch N bytes of arena memory at startup\n"
+    "  -d, --defrag=PCT       compact sparse arena chunks using at most PCT%% of a cpu (default 0, off)\n"
+    "  -R, --handover=PATH    take the listener and data of the server at PATH, then wait there\n"
+    "                         for a successor to hand them to\n"
+    "  -u, --unix=PATH        also listen on the unix socket PATH\n"
+    "  -S, --ring=PATH        take shared memory rings from local clients at PATH\n"
+    "  -T, --trace=N          trace the stages of 1 in N requests for TRACE (default 0, off)\n"
+    "  -L, --slowlog=US       log requests taking at least US for SLOWLOG (default 10000, 0 off)\n",
+    name, WORKERS, PROCESSOR_WORKERS);
+}
+
+static int config_uint(const char *arg, unsigned int *out)
+{
+  char *end;
+  unsigned long v = strtoul(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || v == 0 || v > 1024) return -1;
+  *out = (unsigned int)v;
+  return 0;
+}
+
+static int config_affinity(const char *arg)
+{
+  if (strcmp(arg, "none") == 0) return CONFIG_AFFINITY_NONE;
+  if (strcmp(arg, "compact") == 0) return CONFIG_AFFINITY_COMPACT;
+  if (strcmp(arg, "spread") == 0) return CONFIG_AFFINITY_SPREAD;
+  if (strcmp(arg, "list") == 0) return CONFIG_AFFINITY_LIST;
+  return -1;
+}
+
+int config_parse(int argc, char **argv)
+{
+  int opt;
+  static const struct option options[] = {
+    {"workers",    required_argument, NULL, 'w'},
+    {"processors", required_argument, NULL, 'p'},
+    {"affinity",   required_argument, NULL, 'a'},
+    {"cpus",       required_argument, NULL, 'c'},
+    {"ordered-index", no_argument,    NULL, 'o'},
+    {"compress-min", required_argument, NULL, 'z'},
+    {"read-cache", no_argument,       NULL, 'r'},
+    {"tier-file",  required_argument, NULL, 't'},
+    {"tier-memory", required_argument, NULL, 'm'},
+    {"namespaces", required_argument, NULL, 'n'},
+    {"import",     required_argument, NULL, 'i'},
+    {"huge-pages", no_argument,       NULL, 'H'},
+    {"prefault",   required_argument, NULL, 'P'},
+    {"defrag",     required_argument, NULL, 'd'},
+    {"handover",   required_argument, NULL, 'R'},
+    {"unix",       required_argument, NULL, 'u'},
+    {"ring",       required_argument, NULL, 'S'},
+    {"trace",      required_argument, NULL, 'T'},
+    {"slowlog",    required_argument, NULL, 'L'},
+    {"help",       no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "w:p:a:c:oz:rt:m:n:i:HP:d:R:u:S:T:L:h", options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'w':
+      if (config_uint(optarg, &config.workers) < 0) goto config_parse_error;
+      break;
+    case 'p':
+      if (config_uint(optarg, &config.processors) < 0) goto config_parse_error;
+      break;
+    case 'a':
+      if ((config.affinity = config_affinity(optarg)) < 0) goto config_parse_error;
+      break;
+    case 'c':
+      config.cpus = optarg;
+      break;
+    case 'o':
+      config.ordered = true;
+      break;
+    case 't':
+      config.tierfile = optarg;
+      break;
+    case 'm':
+    {
+      char *end;
+      config.tiermemory = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') goto config_parse_error;
+      break;
+    }
+    case 'r':
+      config.readcache = true;
+      break;
+    case 'n':
+      if (config_uint(optarg, &config.namespaces) < 0) goto config_parse_error;
+      break;
+    case 'i':
+      config.import = optarg;
+      break;
+    case 'H':
+      config.hugepages = true;
+      break;
+    case 'P':
+    {
+      char *end;
+      config.prefault = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') goto config_parse_error;
+      break;
+    }
+    case 'u':
+      config.unixpath = optarg;
+      break;
+    case 'S':
+      config.ring = optarg;
+      break;
+    case 'R':
+      config.handover = optarg;
+      break;
+    case 'L':
+    {
+      char *end;
+      config.slowlog = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') goto config_parse_error;
+      break;
+    }
+    case 'T':
+    {
+      char *end;
+      const unsigned long every = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0' || every > UINT_MAX) goto config_parse_error;
+      config.trace = (unsigned int)every;
+      break;
+    }
+    case 'd':
+      if (config_uint(optarg, &config.defrag) < 0 || config.defrag > 100) goto config_parse_error;
+      break;
+    case 'z':
+    {
+      char *end;
+      config.compressmin = strtoul(optarg, &end, 10);
+      if (*optarg == '\0' || *end != '\0') goto config_parse_error;
+      if (config.compressmin != 0 && config.compressmin < TABLE_MINCOMPRESS) goto config_parse_error;
+      break;
+    }
+    default:
+      goto config_parse_error;
+    }
+  }
+
+  // a cpu list alone implies the list policy
+  if (config.cpus != NULL && config.affinity == CONFIG_AFFINITY_NONE)
+    config.affinity = CONFIG_AFFINITY_LIST;
+  if (config.affinity == CONFIG_AFFINITY_LIST && config.cpus == NULL)
+  {
+    fprintf(stderr, "(config) --affinity=list requires --cpus\n");
+    goto config_parse_error;
+  }
+
+  return 0;
+
+  config_parse_error:
+  config_usage(argv[0]);
+  return -1;
+}
+
+const config_t *config_get(void)
+{
+  return &config;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "ufkvs.h"
+#include <stdbool.h>
+
+#define CONFIG_AFFINITY_NONE UFKVS_AFFINITY_NONE
+#define CONFIG_AFFINITY_COMPACT UFKVS_AFFINITY_COMPACT
+#define CONFIG_AFFINITY_SPREAD UFKVS_AFFINITY_SPREAD
+#define CONFIG_AFFINITY_LIST UFKVS_AFFINITY_LIST
+
+typedef struct config
+{
+  unsigned int workers;
+  unsigned int processors;
+  int affinity;
+  char *cpus; // explicit cpu list, only used by CONFIG_AFFINITY_LIST
+  bool ordered; // keep the ordered key index needed by SCAN
+  unsigned long compressmin; // compress values from this size on, 0 disables
+  bool readcache; // processor threads keep copies of hot values
+  char *tierfile; // cold values spill to this file, NULL keeps everything in memory
+  unsigned long tiermemory; // bytes of values kept in memory with a tier file
+  unsigned int namespaces; // keyspaces, each a table of its own
+  char *import; // records loaded into namespace 0 at startup, NULL for none
+  bool hugepages; // arena and large mappings on huge pages
+  unsigned long prefault; // bytes of arena chunks touched at startup
+  unsigned int defrag; // percent of a cpu the defragmenter may use, 0 disables it
+  char *handover; // unix socket where the running server hands over to its successor, NULL for none
+  char *unixpath; // unix socket listened on next to the tcp port, NULL for none
+  char *ring; // unix socket where local clients set up shared memory rings, NULL for none
+  unsigned int trace; // 1 in trace requests is traced, 0 for none
+  unsigned long slowlog; // us, requests taking longer go to the slow log, 0 for none
+} config_t;
+
+int config_parse(int, char**);
+const config_t *config_get(void);
+
+#endif //CONFIG_H
@@ -0,0 +1,111 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "defrag.h"
+#include "arena.h"
+#include "table.h"
+#include "stats.h"
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct defrag
+{
+  unsigned int pct; // of a cpu the thread may use
+  pthread_t thread;
+} defrag_t;
+
+static defrag_t defrag = {
+  .pct = 0
+};
+
+// sleeps long enough after work ns of cpu to keep the thread within its budget
+static void defrag_yield(const unsigned long work)
+{
+  const unsigned long idle = work * (100 - defrag.pct) / defrag.pct;
+  const struct timespec ts = {.tv_sec = (time_t)(idle / 1000000000ul), .tv_nsec = (long)(idle % 1000000000ul)};
+  if (idle > 0) nanosleep(&ts, NULL);
+}
+
+// one pass: marks the sparse chunks, then walks every namespace a slice of buckets
+// at a time moving their objects out. returns how many moved.
+static unsigned long defrag_pass(void)
+{
+  unsigned long total = 0;
+
+  if (arena_defrag_begin() == 0) return 0;
+
+  for (unsigned int in = 0; in < table_namespaces(); ++in)
+  {
+    table *t = table_namespace(in);
+    unsigned long cursor = 0;
+    do
+    {
+      const unsigned long start = stats_cputime();
+      const int moved = table_defrag(t, &cursor, DEFRAG_SLICE);
+      const unsigned long work = stats_cputime() - start;
+
+      stats_add(STATS_DEFRAG_NS, work);
+      if (moved < 0) break;
+      stats_add(STATS_DEFRAG_MOVED, (unsigned long)moved);
+      total += (unsigned long)moved;
+      defrag_yield(work);
+    } while (cursor != 0);
+  }
+
+  arena_defrag_end();
+  stats_add(STATS_DEFRAG_PASSES, 1);
+  return total;
+}
+
+static void *defrag_thread_fn(void *args)
+{
+  (void)args;
+  const struct timespec interval = {.tv_sec = DEFRAG_INTERVAL_MS / 1000,
+    .tv_nsec = DEFRAG_INTERVAL_MS % 1000 * 1000000l};
+
+  double floor = DEFRAG_RATIO;
+
+  while (1)
+  {
+    nanosleep(&interval, NULL);
+
+    // what the tables do not own (connection buffers, thread caches) cannot be moved,
+    // after a pass that got nothing done the next waits for things to get worse
+    const double ratio = arena_fragmentation();
+    if (ratio < floor) continue;
+    floor = defrag_pass() > 0 ? DEFRAG_RATIO : ratio * DEFRAG_BACKOFF;
+    if (floor < DEFRAG_RATIO) floor = DEFRAG_RATIO;
+  }
+  return NULL;
+}
+
+// pct of a cpu is what the defragmenter may spend, 0 leaves it off
+int defrag_setup(const unsigned int pct)
+{
+  if (pct == 0) return 0;
+  defrag.pct = pct > 100 ? 100 : pct;
+  if (pthread_create(&defrag.thread, NULL, defrag_thread_fn, NULL) != 0)
+  {
+    perror("(defrag) pthread_create");
+    return -1;
+  }
+  return 0;
+}
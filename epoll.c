@@ -21,6 +21,7 @@
 
 #include "epoll.h"
 #include "client.h"
+#include "trace.h"
 #include <unistd.h>
 #include <errno.h>
 
@@ -43,6 +44,7 @@ int epoll_loop(const int listenfd, const int epollfd, hocon hoconfn, hin hinfn,
       perror("(epoll) epoll_wait");
       return -1;
     }
+    trace_woke();
 
     for (unsigned int ifd = 0; ifd < listfd; ++ifd)
     {
@@ -54,14 +56,19 @@ int epoll_loop(const int listenfd, const int epollfd, hocon hoconfn, hin hinfn,
           if (events[ifd].events & EPOLLERR) perror("(epoll) EPOLLERR");
           if (events[ifd].events & EPOLLHUP) perror("(epoll) EPOLLHUP");
 
-          close(fd);
+          // cleared first, the fd number is not handed out again before that
           if (client_clear(fd) < 0) perror("(epoll) client_clear");
+          close(fd);
           continue;
       }
 
-      if (hoconfn != NULL && fd == listenfd) hoconfn();
-      else if (hinfn != NULL && events[ifd].events & EPOLLIN) hinfn(fd);
-      else if (houtfn != NULL && events[ifd].events & EPOLLOUT) houtfn();
+      if (hoconfn != NULL && fd == listenfd)
+      {
+        hoconfn();
+        continue;
+      }
+      if (hinfn != NULL && events[ifd].events & EPOLLIN) hinfn(fd);
+      if (houtfn != NULL && events[ifd].events & EPOLLOUT) houtfn(fd);
     }
   }
 
@@ -27,7 +27,7 @@
 #include <stdbool.h>
 
 typedef void (*hin)(int);
-typedef void (*hout)(void);
+typedef void (*hout)(int);
 typedef void (*hocon)(void);
 
 static inline int epoll_new()
@@ -59,6 +59,21 @@ static inline int epoll_inadd(const int epollfd, const int fd, const bool onesho
   return 0;
 }
 
+static inline int epoll_mod(const int epollfd, const int fd, const unsigned int ev)
+{
+  struct epoll_event events;
+  events.data.fd = fd;
+  events.events = ev | EPOLLET | EPOLLONESHOT;
+
+  if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &events) < 0)
+  {
+    perror("(epoll) epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
 static inline int epoll_inmod(const int epollfd, const int fd)
 {
   struct epoll_event events;
@@ -0,0 +1,763 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#define _GNU_SOURCE
+#include "handover.h"
+#include "table.h"
+#include "import.h"
+#include "tier.h"
+#include "client.h"
+#include "socket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+
+typedef struct handover
+{
+  int lfd; // the listener handed over with the data
+  int ufd; // the unix listener handed over too, -1 without one
+  int hfd; // where successors connect
+  int cfd; // to the predecessor, handover_restore reads the data from it
+  int tierfd; // the tier file taken over, -1 without one
+  unsigned int flags; // of the predecessor's header
+  handover_stop_fn stop;
+  pthread_t thread;
+} handover_t;
+
+static handover_t handover = {
+  .lfd    = -1,
+  .ufd    = -1,
+  .hfd    = -1,
+  .cfd    = -1,
+  .tierfd = -1
+};
+
+// records of one kind waiting to go out as a chunk
+typedef struct handover_chunk
+{
+  char *data;
+  unsigned long size, cap;
+} handover_chunk_t;
+
+// what the predecessor streams a namespace with, a chunk per kind but HANDOVER_END
+typedef struct handover_out
+{
+  int fd;
+  unsigned int ns;
+  handover_chunk_t chunks[HANDOVER_DEL];
+} handover_out_t;
+
+static int handover_addr(const char *path, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path))
+  {
+    fprintf(stderr, "(handover) path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+// reads n bytes from the other side, which closing early is an error too
+static int handover_recv(const int fd, void *buf, const size_t n)
+{
+  size_t done = 0;
+
+  while (done < n)
+  {
+    const ssize_t r = read(fd, (char*)buf + done, n - done);
+    if (r == 0)
+    {
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+static int handover_send(const int fd, const void *buf, const size_t n)
+{
+  size_t done = 0;
+
+  while (done < n)
+  {
+    const ssize_t r = send(fd, (const char*)buf + done, n - done, MSG_NOSIGNAL);
+    if (r < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += (size_t)r;
+  }
+  return 0;
+}
+
+static void handover_sleep(void)
+{
+  const struct timespec interval = {.tv_sec = 0, .tv_nsec = HANDOVER_POLL_MS * 1000000l};
+  nanosleep(&interval, NULL);
+}
+
+// asks the process serving at path for its data, handover_restore loads it once the
+// store is open. returns 1 when taken over, 0 when nobody serves there and the caller
+// starts cold.
+int handover_take(const char *path)
+{
+  struct sockaddr_un addr;
+  char header[HANDOVER_HEADER];
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = header, .iov_len = HANDOVER_HEADER};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+  int fd, tierfd = -1;
+  unsigned int gen;
+
+  if (handover_addr(path, &addr) < 0) return -1;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("(handover) socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    close(fd);
+    if (errno == ENOENT || errno == ECONNREFUSED) return 0;
+    perror("(handover) connect");
+    return -1;
+  }
+
+  printf("(handover) taking over from %s\n", path);
+  const ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (n == 0)
+  {
+    fprintf(stderr, "(handover) %s gave up, starting cold\n", path);
+    close(fd);
+    return 0;
+  }
+  if (n < 0)
+  {
+    perror("(handover) recvmsg");
+    goto handover_take_error;
+  }
+
+  // the tier file comes with the first bytes of the header
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+    memcpy(&tierfd, CMSG_DATA(cmsg), sizeof(int));
+  if (handover_recv(fd, header + n, HANDOVER_HEADER - (size_t)n) < 0 || memcmp(header, HANDOVER_MAGIC, 8) != 0)
+  {
+    fprintf(stderr, "(handover) no handover from %s\n", path);
+    goto handover_take_error;
+  }
+  memcpy(&handover.flags, header + 12, 4);
+  memcpy(&gen, header + 16, 4);
+  if (((handover.flags & HANDOVER_TIER) != 0) != (tierfd >= 0))
+  {
+    fprintf(stderr, "(handover) the tier file does not match the header from %s\n", path);
+    goto handover_take_error;
+  }
+
+  if (tierfd >= 0)
+  {
+    // the tier goes on with the file if it is set up, otherwise the restore reads it
+    handover.tierfd = tierfd;
+    tier_inherit(tierfd, gen);
+  }
+  handover.cfd = fd;
+  return 1;
+
+  handover_take_error:
+  if (tierfd >= 0) close(tierfd);
+  close(fd);
+  return -1;
+}
+
+// table_insert of the *n entries, *n is 0 after unless the table refused them all
+static int handover_insert(table *t, table_s **entries, unsigned int *n, unsigned long *count)
+{
+  const int dropped = table_insert(t, entries, *n);
+  if (dropped < 0) return -1;
+
+  *count += *n - dropped;
+  *n = 0;
+  if (dropped == 0) return 0;
+  fprintf(stderr, "(handover) %d keys dropped, out of memory for the index\n", dropped);
+  return -1;
+}
+
+// links the cold records of a chunk, at the tier file when the tier took it over and
+// read back into memory otherwise. *count gets the keys linked
+static int handover_cold(table *t, const char *data, const unsigned long size, const bool adopted,
+  unsigned long *count)
+{
+  table_s *entries[IMPORT_BATCH];
+  unsigned int n = 0, lkey;
+  unsigned long loc, lstored, lvalue, lbuf = 0;
+  char *buf = NULL;
+
+  *count = 0;
+  for (unsigned long off = 0; off < size; off += HANDOVER_COLD_RECORD + lkey)
+  {
+    if (size - off < HANDOVER_COLD_RECORD) goto handover_cold_error;
+    memcpy(&lkey, data + off, 4);
+    memcpy(&loc, data + off + 8, 8);
+    memcpy(&lstored, data + off + 16, 8);
+    memcpy(&lvalue, data + off + 24, 8);
+    const char *key = data + off + HANDOVER_COLD_RECORD;
+    if (size - off - HANDOVER_COLD_RECORD < lkey || lstored > TABLE_MAXVALUE) goto handover_cold_error;
+
+    table_s *e;
+    if (adopted) e = table_entry_tier(lkey, key, lvalue, loc, lstored);
+    else
+    {
+      // the record header keeps the encoding the value had in memory at 24, see tier_header
+      const unsigned long lrecord = TIER_HEADER + lkey + lstored;
+      if (lrecord > lbuf)
+      {
+        char *nbuf = realloc(buf, lrecord);
+        if (nbuf == NULL) goto handover_cold_error;
+        buf = nbuf;
+        lbuf = lrecord;
+      }
+      if (pread(handover.tierfd, buf, lrecord, (off_t)TIER_OFF(loc)) != (ssize_t)lrecord)
+      {
+        fprintf(stderr, "(handover) short read of the tier file at %lu\n", TIER_OFF(loc));
+        goto handover_cold_error;
+      }
+      e = table_entry_stored(t, lkey, key, lvalue, buf + TIER_HEADER + lkey, lstored, (unsigned char)buf[24]);
+    }
+    if (e == NULL) goto handover_cold_error;
+
+    entries[n++] = e;
+    if (n == IMPORT_BATCH && handover_insert(t, entries, &n, count) < 0) goto handover_cold_error;
+  }
+  if (n > 0 && handover_insert(t, entries, &n, count) < 0) goto handover_cold_error;
+  free(buf);
+  return 0;
+
+  handover_cold_error:
+  for (unsigned int ie = 0; ie < n; ++ie) table_entry_free(entries[ie]);
+  free(buf);
+  return -1;
+}
+
+// removes the keys of the deletion records of a chunk, data has a byte to spare at
+// the end so each key can be terminated in place. *count gets the keys removed
+static int handover_del(table *t, char *data, const unsigned long size, unsigned long *count)
+{
+  unsigned int lkey;
+
+  *count = 0;
+  for (unsigned long off = 0; off < size; off += 4 + lkey)
+  {
+    if (size - off < 4) return -1;
+    memcpy(&lkey, data + off, 4);
+    if (size - off - 4 < lkey) return -1;
+
+    char *key = data + off + 4;
+    const char next = key[lkey];
+    key[lkey] = '\0';
+    if (table_del(t, key) == 0) (*count)++;
+    key[lkey] = next;
+  }
+  return 0;
+}
+
+// loads the chunks the predecessor sends up to HANDOVER_END, on nthreads threads each.
+// *keys gets the keys linked and *deleted the ones removed
+static int handover_load(const unsigned int nthreads, const bool adopted, unsigned long *keys,
+  unsigned long *deleted)
+{
+  char header[HANDOVER_CHUNK_HEADER];
+  unsigned int kind, ns, dropped = UINT_MAX;
+  unsigned long bytes, count = 0, lbuf = 0;
+  char *buf = NULL;
+  int ret;
+
+  while (1)
+  {
+    if (handover_recv(handover.cfd, header, HANDOVER_CHUNK_HEADER) < 0) goto handover_load_rerror;
+    memcpy(&kind, header, 4);
+    memcpy(&ns, header + 4, 4);
+    memcpy(&bytes, header + 8, 8);
+    if (kind == HANDOVER_END) break;
+    // a chunk runs past HANDOVER_CHUNK by one record at most, keys are shorter than values
+    if (kind > HANDOVER_DEL || bytes > HANDOVER_CHUNK + 2 * TABLE_MAXVALUE)
+    {
+      fprintf(stderr, "(handover) bad chunk of kind %u and %lu bytes\n", kind, bytes);
+      goto handover_load_error;
+    }
+
+    if (bytes + 1 > lbuf)
+    {
+      char *nbuf = realloc(buf, bytes + 1);
+      if (nbuf == NULL)
+      {
+        perror("(handover) realloc");
+        goto handover_load_error;
+      }
+      buf = nbuf;
+      lbuf = bytes + 1;
+    }
+    if (handover_recv(handover.cfd, buf, bytes) < 0) goto handover_load_rerror;
+
+    if (ns >= table_namespaces())
+    {
+      if (ns != dropped) fprintf(stderr, "(handover) namespace %u dropped, --namespaces is %u\n", ns, table_namespaces());
+      dropped = ns;
+      continue;
+    }
+
+    table *t = table_namespace(ns);
+    if (kind == HANDOVER_HOT) ret = import_data(t, buf, bytes, nthreads, &count);
+    else if (kind == HANDOVER_COLD) ret = handover_cold(t, buf, bytes, adopted, &count);
+    else ret = handover_del(t, buf, bytes, &count);
+    if (ret != 0)
+    {
+      fprintf(stderr, "(handover) namespace %u failed after %lu keys of a chunk\n", ns, count);
+      goto handover_load_error;
+    }
+    if (kind == HANDOVER_DEL) *deleted += count;
+    else *keys += count;
+  }
+
+  free(buf);
+  return 0;
+
+  handover_load_rerror:
+  perror("(handover) read");
+  handover_load_error:
+  free(buf);
+  return -1;
+}
+
+// lets go of a tier file the tier did not take over, its values are in memory now
+static void handover_drop_tier(void)
+{
+  char link[32], path[PATH_MAX];
+  ssize_t n;
+
+  if (handover.tierfd < 0 || tier_inherited()) return;
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", handover.tierfd);
+  if ((n = readlink(link, path, sizeof(path) - 1)) > 0)
+  {
+    path[n] = '\0';
+    if (unlink(path) < 0) perror("(handover) unlink");
+  }
+  close(handover.tierfd);
+  handover.tierfd = -1;
+}
+
+// the listeners close the handover, *lfd gets the tcp one and *ufd the unix one or -1
+static int handover_listeners(int *lfd, int *ufd)
+{
+  char byte;
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+  const unsigned int nfds = handover.flags & HANDOVER_UNIX ? 2 : 1;
+  int fds[2] = {-1, -1};
+
+  ssize_t n;
+  while ((n = recvmsg(handover.cfd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  if (n != 1)
+  {
+    if (n == 0) errno = ECONNRESET;
+    perror("(handover) recvmsg");
+    return -1;
+  }
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int)))
+  {
+    fprintf(stderr, "(handover) the listeners did not come\n");
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  *lfd = fds[0];
+  *ufd = fds[1];
+  return 0;
+}
+
+// loads what the predecessor of handover_take sends into the namespaces, on nthreads
+// threads each, and takes its listeners over: *lfd gets the tcp one and *ufd the unix
+// one or -1. nothing happens without a predecessor
+int handover_restore(const unsigned int nthreads, int *lfd, int *ufd)
+{
+  unsigned long keys = 0, written = 0, deleted = 0;
+  const char ack = 'l';
+  int ret = -1;
+
+  if (handover.cfd < 0) return 0;
+  const bool adopted = tier_inherited();
+  if (handover_load(nthreads, adopted, &keys, &deleted) < 0) goto handover_restore_final;
+  printf("(handover) loaded %lu keys%s\n", keys, handover.tierfd < 0 ? "" :
+    adopted ? ", the cold ones left in the tier" : ", the cold ones read from the tier");
+
+  // the predecessor stops taking writes now, the ones it took meanwhile follow
+  if (handover_send(handover.cfd, &ack, 1) < 0)
+  {
+    perror("(handover) send");
+    goto handover_restore_final;
+  }
+  if (handover_load(nthreads, adopted, &written, &deleted) < 0 || handover_listeners(lfd, ufd) < 0)
+    goto handover_restore_final;
+
+  printf("(handover) restored %lu keys written and %lu deleted since\n", written, deleted);
+  ret = 0;
+
+  handover_restore_final:
+  close(handover.cfd);
+  handover.cfd = -1;
+  handover_drop_tier();
+  return ret;
+}
+
+// makes room for n more bytes in c
+static char *handover_grow(handover_chunk_t *c, const unsigned long n)
+{
+  if (c->size + n > c->cap)
+  {
+    const unsigned long cap = c->size + n > 2 * c->cap ? c->size + n : 2 * c->cap;
+    char *ndata = realloc(c->data, cap);
+    if (ndata == NULL) return NULL;
+    c->data = ndata;
+    c->cap = cap;
+  }
+  char *dst = c->data + c->size;
+  c->size += n;
+  return dst;
+}
+
+// sends the records of one kind gathered so far
+static int handover_flush(handover_out_t *out, const unsigned int kind)
+{
+  handover_chunk_t *c = &out->chunks[kind - 1];
+  char header[HANDOVER_CHUNK_HEADER];
+
+  if (c->size == 0) return 0;
+  memcpy(header, &kind, 4);
+  memcpy(header + 4, &out->ns, 4);
+  memcpy(header + 8, &c->size, 8);
+  if (handover_send(out->fd, header, HANDOVER_CHUNK_HEADER) < 0 || handover_send(out->fd, c->data, c->size) < 0)
+  {
+    perror("(handover) send");
+    return -1;
+  }
+  c->size = 0;
+  return 0;
+}
+
+// sends the chunks gathered up to HANDOVER_CHUNK, or all of them with all
+static int handover_flush_all(handover_out_t *out, const bool all)
+{
+  for (unsigned int kind = HANDOVER_HOT; kind <= HANDOVER_DEL; ++kind)
+    if ((all || out->chunks[kind - 1].size >= HANDOVER_CHUNK) && handover_flush(out, kind) < 0) return -1;
+  return 0;
+}
+
+static int handover_end(const int fd)
+{
+  char header[HANDOVER_CHUNK_HEADER] = {0};
+
+  if (handover_send(fd, header, HANDOVER_CHUNK_HEADER) < 0)
+  {
+    perror("(handover) send");
+    return -1;
+  }
+  return 0;
+}
+
+// adds the record of an entry to its chunk, with the read lock held. 1 once a chunk
+// is full, so the lock is given back to send it
+static int handover_entry(const table_s *s, void *args)
+{
+  handover_out_t *out = args;
+  char *dst;
+
+  if (s->enc == TABLE_ENC_TIER)
+  {
+    handover_chunk_t *c = &out->chunks[HANDOVER_COLD - 1];
+    if ((dst = handover_grow(c, HANDOVER_COLD_RECORD + s->lkey)) == NULL) return -1;
+    memcpy(dst, &s->lkey, 4);
+    memset(dst + 4, 0, 4);
+    memcpy(dst + 8, &s->loc, 8);
+    memcpy(dst + 16, &s->cvalue, 8);
+    memcpy(dst + 24, &s->lvalue, 8);
+    memcpy(dst + HANDOVER_COLD_RECORD, s->key, s->lkey);
+    return c->size >= HANDOVER_CHUNK;
+  }
+
+  handover_chunk_t *c = &out->chunks[HANDOVER_HOT - 1];
+  const unsigned int lvalue = (unsigned int)s->lvalue;
+  if ((dst = handover_grow(c, IMPORT_RECORD + s->lkey + lvalue)) == NULL) return -1;
+  memcpy(dst, &s->lkey, 4);
+  memcpy(dst + 4, &lvalue, 4);
+  memcpy(dst + IMPORT_RECORD, s->key, s->lkey);
+  if (table_read(s, dst + IMPORT_RECORD + s->lkey) != 0) return -1;
+  return c->size >= HANDOVER_CHUNK;
+}
+
+// a key written since table_track, as it is now or as deleted
+static int handover_written(const char *key, const table_s *s, void *args)
+{
+  handover_out_t *out = args;
+  char *dst;
+
+  if (s != NULL) return handover_entry(s, args);
+
+  handover_chunk_t *c = &out->chunks[HANDOVER_DEL - 1];
+  const unsigned int lkey = (unsigned int)strlen(key);
+  if ((dst = handover_grow(c, 4 + lkey)) == NULL) return -1;
+  memcpy(dst, &lkey, 4);
+  memcpy(dst + 4, key, lkey);
+  return c->size >= HANDOVER_CHUNK;
+}
+
+// streams every namespace to fd a few buckets per read lock, writers go on meanwhile.
+// with written, only the keys written since table_track
+static int handover_stream(const int fd, const bool written)
+{
+  handover_out_t out = {.fd = fd};
+  int ret = -1;
+
+  for (out.ns = 0; out.ns < table_namespaces(); ++out.ns)
+  {
+    table *t = table_namespace(out.ns);
+    unsigned long cursor = 0;
+    int r;
+
+    do
+    {
+      r = written ? table_tracked(t, &cursor, HANDOVER_BUCKETS, handover_written, &out) :
+        table_iterate(t, &cursor, HANDOVER_BUCKETS, handover_entry, &out);
+      if (r < 0)
+      {
+        fprintf(stderr, "(handover) namespace %u could not be %s\n", out.ns,
+          r == TABLE_ELOST ? "brought up to date, keys written were lost" : "streamed");
+        goto handover_stream_final;
+      }
+      if (handover_flush_all(&out, false) < 0) goto handover_stream_final;
+    } while (written ? r == 0 : cursor != 0);
+    if (handover_flush_all(&out, true) < 0) goto handover_stream_final;
+  }
+  ret = handover_end(fd);
+
+  handover_stream_final:
+  for (unsigned int kind = HANDOVER_HOT; kind <= HANDOVER_DEL; ++kind) free(out.chunks[kind - 1].data);
+  return ret;
+}
+
+// the header, with the tier file the cold records point into when there is one
+static int handover_hello(const int cfd, const unsigned int flags, const unsigned int gen, const int tierfd)
+{
+  const unsigned int namespaces = table_namespaces();
+  const unsigned int zero = 0;
+  char header[HANDOVER_HEADER];
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = header, .iov_len = HANDOVER_HEADER};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+  memcpy(header, HANDOVER_MAGIC, 8);
+  memcpy(header + 8, &namespaces, 4);
+  memcpy(header + 12, &flags, 4);
+  memcpy(header + 16, &gen, 4);
+  memcpy(header + 20, &zero, 4);
+  if (tierfd >= 0)
+  {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &tierfd, sizeof(int));
+  }
+
+  const ssize_t n = sendmsg(cfd, &msg, MSG_NOSIGNAL);
+  if (n < 0 || handover_send(cfd, header + n, HANDOVER_HEADER - (size_t)n) < 0)
+  {
+    perror("(handover) sendmsg");
+    return -1;
+  }
+  return 0;
+}
+
+// the listeners, the last the successor takes
+static int handover_send_listeners(const int cfd)
+{
+  char byte = 'h';
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf};
+  const int fds[2] = {handover.lfd, handover.ufd};
+  const unsigned int nfds = handover.ufd >= 0 ? 2 : 1;
+
+  memset(cbuf, 0, sizeof(cbuf));
+  msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+  if (sendmsg(cfd, &msg, MSG_NOSIGNAL) != 1)
+  {
+    perror("(handover) sendmsg");
+    return -1;
+  }
+  return 0;
+}
+
+// the writes taken while the successor loaded, sent once nothing else can come in:
+// reading stops, what was read is answered and the tables freeze. on errors the
+// process goes on serving
+static int handover_finish(const int cfd)
+{
+  const unsigned int namespaces = table_namespaces();
+  unsigned int ms = 0;
+
+  handover.stop(true);
+  client_hold(true);
+  for (; client_pending() > 0 && ms < HANDOVER_DRAIN_MS; ms += HANDOVER_POLL_MS) handover_sleep();
+  if (ms >= HANDOVER_DRAIN_MS) fprintf(stderr, "(handover) requests still running are turned away\n");
+  for (unsigned int in = 0; in < namespaces; ++in) table_freeze(table_namespace(in));
+
+  if (handover_stream(cfd, true) == 0 && handover_send_listeners(cfd) == 0) return 0;
+
+  for (unsigned int in = 0; in < namespaces; ++in) table_thaw(table_namespace(in));
+  client_hold(false);
+  handover.stop(false);
+  return -1;
+}
+
+// hands the data and the listeners to the successor on cfd, serving on meanwhile, then
+// ends the connections and exits
+static void handover_give(const int cfd)
+{
+  const unsigned int namespaces = table_namespaces();
+  unsigned int flags = handover.ufd >= 0 ? HANDOVER_UNIX : 0, gen = 0;
+  unsigned int ms = 0, open;
+  int tierfd;
+  char ack;
+
+  printf("(handover) handing over to a successor\n");
+  // the cold records stay where they are, writes from here on are sent again
+  if ((tierfd = tier_handover(&gen)) >= 0) flags |= HANDOVER_TIER;
+  for (unsigned int in = 0; in < namespaces; ++in) table_track(table_namespace(in), true);
+
+  if (handover_hello(cfd, flags, gen, tierfd) < 0 || handover_stream(cfd, false) < 0) goto handover_give_error;
+  if (handover_recv(cfd, &ack, 1) < 0)
+  {
+    perror("(handover) read");
+    goto handover_give_error;
+  }
+  if (handover_finish(cfd) < 0) goto handover_give_error;
+  close(cfd);
+  close(handover.hfd);
+
+  // new connections wait in the backlog for the successor, the ones here are answered
+  printf("(handover) done, ending connections\n");
+  while ((open = client_finish()) > 0 && ms < HANDOVER_DRAIN_MS)
+  {
+    handover_sleep();
+    ms += HANDOVER_POLL_MS;
+  }
+  if (open > 0) fprintf(stderr, "(handover) %u connections still open\n", open);
+  printf("(handover) exiting\n");
+  exit(EXIT_SUCCESS);
+
+  handover_give_error:
+  fprintf(stderr, "(handover) the successor did not take over, serving on\n");
+  for (unsigned int in = 0; in < namespaces; ++in) table_track(table_namespace(in), false);
+  tier_resume();
+  close(cfd);
+}
+
+static void *handover_thread_fn(void *args)
+{
+  (void)args;
+  int cfd;
+
+  while ((cfd = accept4(handover.hfd, NULL, NULL, SOCK_CLOEXEC)) >= 0 || errno == EINTR)
+    if (cfd >= 0) handover_give(cfd);
+  perror("(handover) accept");
+  return NULL;
+}
+
+// waits for a successor at path to hand the data and the listeners lfd and ufd (-1 for
+// none) over to. stop(true) has the server leave new connections to the successor,
+// stop(false) takes them back when the successor did not make it
+int handover_listen(const char *path, const int lfd, const int ufd, const handover_stop_fn stop)
+{
+  struct sockaddr_un addr;
+
+  if (handover_addr(path, &addr) < 0) return -1;
+  handover.lfd = lfd;
+  handover.ufd = ufd;
+  handover.stop = stop;
+
+  if ((handover.hfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("(handover) socket");
+    return -1;
+  }
+  // a socket left at path is from a predecessor that is gone or handed over
+  if (socket_unlink_stale(path) < 0) goto handover_listen_error;
+  if (bind(handover.hfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    perror("(handover) bind");
+    goto handover_listen_error;
+  }
+  if (listen(handover.hfd, 1) < 0)
+  {
+    perror("(handover) listen");
+    goto handover_listen_error;
+  }
+  if (pthread_create(&handover.thread, NULL, handover_thread_fn, NULL) != 0)
+  {
+    perror("(handover) pthread_create");
+    goto handover_listen_error;
+  }
+  return 0;
+
+  handover_listen_error:
+  close(handover.hfd);
+  handover.hfd = -1;
+  return -1;
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdbool.h>
+
+// a process started with the handover path of a running one takes over its data and
+// listening sockets instead of starting cold, while the running one goes on serving
+// until the successor has loaded:
+//  1. the predecessor sends HANDOVER_MAGIC | namespaces (4) | flags (4) | tier generation (4) | 0 (4)
+//     with the tier file attached, and keeps the keys written from then on, see table_track
+//  2. it streams its namespaces as chunks of kind (4) | namespace (4) | bytes (8) | records,
+//     import records for the values in memory and for the ones in the tier file
+//       lkey (4) | pad (4) | loc (8) | lstored (8) | lvalue (8) | key
+//     whose values are not read back. HANDOVER_END ends the stream
+//  3. the successor answers with a byte once it loaded the stream. the predecessor stops
+//     accepting and reading requests, waits for the ones read to be answered and freezes
+//     its tables. the keys written since 1. follow as they are now, the deleted ones as
+//       lkey (4) | key
+//     then HANDOVER_END, then the listeners with a byte
+//  4. the predecessor ends its connections once their answers are out and exits. up to
+//     the listeners, a failure on either side has it thaw and go on serving
+#define HANDOVER_MAGIC "ugkvhov3"
+#define HANDOVER_HEADER 24
+#define HANDOVER_CHUNK_HEADER 16
+#define HANDOVER_COLD_RECORD 32 // a cold record ahead of its key
+#define HANDOVER_CHUNK (16ul << 20) // records sent at once, a chunk runs past it by one record at most
+#define HANDOVER_BUCKETS 256 // walked per read lock while streaming
+#define HANDOVER_DRAIN_MS 5000 // for the requests read to be answered, then again for connections to end
+#define HANDOVER_POLL_MS 10
+#define HANDOVER_UNIX 0x1 // the unix listener comes with the tcp one
+#define HANDOVER_TIER 0x2 // the tier file comes with the header
+
+#define HANDOVER_END 0
+#define HANDOVER_HOT 1
+#define HANDOVER_COLD 2
+#define HANDOVER_DEL 3
+
+typedef void (*handover_stop_fn)(bool); // true stops accepting, false picks it up again
+
+int handover_take(const char*);
+int handover_restore(unsigned int, int*, int*);
+int handover_listen(const char*, int, int, handover_stop_fn);
+
+#endif //HANDOVER_H
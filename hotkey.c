@@ -0,0 +1,217 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "hotkey.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct hotkey_top
+{
+  char key[HOTKEY_KEYMAX];
+  unsigned int count;
+} hotkey_top_t;
+
+typedef struct hotkey_entry
+{
+  char *key;
+  char *value;
+  unsigned long lvalue, stamp;
+  unsigned int ns;
+} hotkey_entry_t;
+
+static atomic_uint sketch[HOTKEY_DEPTH][HOTKEY_WIDTH];
+static atomic_ulong observed;
+static atomic_uint threshold = HOTKEY_MINHITS; // estimate a key needs to be hot
+
+static pthread_mutex_t topmtx = PTHREAD_MUTEX_INITIALIZER;
+static hotkey_top_t top[HOTKEY_TOPK];
+static unsigned int ntop = 0;
+
+static _Thread_local unsigned int tick;
+static _Thread_local hotkey_entry_t cache[HOTKEY_CACHE];
+
+static unsigned long hotkey_hash(const char *key)
+{
+  unsigned long h = 14695981039346656037ul;
+  for (const char *p = key; *p; p++)
+  {
+    h ^= (unsigned char)*p;
+    h *= 1099511628211ul;
+  }
+  return h;
+}
+
+// row ir of the sketch, from two halves of one hash
+static unsigned int hotkey_slot(const unsigned long h, const unsigned int ir)
+{
+  const unsigned int h1 = h, h2 = (h >> 32) | 1;
+  return (h1 + ir * h2) & (HOTKEY_WIDTH - 1);
+}
+
+static unsigned int hotkey_estimate(const unsigned long h)
+{
+  unsigned int est = UINT32_MAX;
+  for (unsigned int ir = 0; ir < HOTKEY_DEPTH; ++ir)
+  {
+    const unsigned int c = atomic_load_explicit(&sketch[ir][hotkey_slot(h, ir)], memory_order_relaxed);
+    if (c < est) est = c;
+  }
+  return est;
+}
+
+// topmtx must be held
+static void hotkey_threshold(void)
+{
+  unsigned int min = HOTKEY_MINHITS;
+  if (ntop == HOTKEY_TOPK)
+  {
+    min = UINT32_MAX;
+    for (unsigned int it = 0; it < ntop; ++it) if (top[it].count < min) min = top[it].count;
+    if (min < HOTKEY_MINHITS) min = HOTKEY_MINHITS;
+  }
+  atomic_store_explicit(&threshold, min, memory_order_relaxed);
+}
+
+static void hotkey_decay(void)
+{
+  pthread_mutex_lock(&topmtx);
+  for (unsigned int ir = 0; ir < HOTKEY_DEPTH; ++ir)
+    for (unsigned int iw = 0; iw < HOTKEY_WIDTH; ++iw)
+      atomic_store_explicit(&sketch[ir][iw], atomic_load_explicit(&sketch[ir][iw], memory_order_relaxed) / 2,
+        memory_order_relaxed);
+  for (unsigned int it = 0; it < ntop; ++it) top[it].count /= 2;
+  hotkey_threshold();
+  pthread_mutex_unlock(&topmtx);
+}
+
+static void hotkey_offer(const char *key, const unsigned int est)
+{
+  const size_t lkey = strlen(key);
+  unsigned int it, imin = 0;
+
+  if (lkey >= HOTKEY_KEYMAX) return;
+  pthread_mutex_lock(&topmtx);
+
+  for (it = 0; it < ntop; ++it)
+  {
+    if (strcmp(top[it].key, key) == 0) break;
+    if (top[it].count < top[imin].count) imin = it;
+  }
+
+  if (it == ntop)
+  {
+    if (ntop < HOTKEY_TOPK) ntop++;
+    else if (est > top[imin].count) it = imin;
+    else goto hotkey_offer_final;
+    memcpy(top[it].key, key, lkey + 1);
+  }
+  top[it].count = est;
+  hotkey_threshold();
+
+  hotkey_offer_final:
+  pthread_mutex_unlock(&topmtx);
+}
+
+// counts a GET of key, sampled per thread to keep the shared sketch cold
+void hotkey_touch(const char *key)
+{
+  if (++tick % HOTKEY_SAMPLE != 0) return;
+
+  const unsigned long h = hotkey_hash(key);
+  unsigned int est = UINT32_MAX;
+  for (unsigned int ir = 0; ir < HOTKEY_DEPTH; ++ir)
+  {
+    const unsigned int c = atomic_fetch_add_explicit(&sketch[ir][hotkey_slot(h, ir)], 1, memory_order_relaxed) + 1;
+    if (c < est) est = c;
+  }
+
+  if ((atomic_fetch_add_explicit(&observed, 1, memory_order_relaxed) + 1) % HOTKEY_DECAY == 0) hotkey_decay();
+  if (est >= atomic_load_explicit(&threshold, memory_order_relaxed)) hotkey_offer(key, est);
+}
+
+bool hotkey_hot(const char *key)
+{
+  return hotkey_estimate(hotkey_hash(key)) >= atomic_load_explicit(&threshold, memory_order_relaxed);
+}
+
+// "hotkey:<estimated gets> <key>" lines, hottest first
+void hotkey_report(FILE *f)
+{
+  hotkey_top_t sorted[HOTKEY_TOPK];
+  unsigned int n;
+
+  pthread_mutex_lock(&topmtx);
+  memcpy(sorted, top, sizeof(top));
+  n = ntop;
+  pthread_mutex_unlock(&topmtx);
+
+  for (unsigned int i = 1; i < n; ++i)
+  {
+    const hotkey_top_t t = sorted[i];
+    unsigned int j = i;
+    for (; j > 0 && sorted[j - 1].count < t.count; --j) sorted[j] = sorted[j - 1];
+    sorted[j] = t;
+  }
+
+  for (unsigned int i = 0; i < n; ++i)
+    fprintf(f, "hotkey:%lu %s\n", (unsigned long)sorted[i].count * HOTKEY_SAMPLE, sorted[i].key);
+}
+
+// the calling thread's copy of key in namespace ns if it was taken at stamp, valid
+// until the thread calls hotkey_cache_put again
+const char *hotkey_cache_get(const unsigned int ns, const char *key, const unsigned long stamp, unsigned long *lvalue)
+{
+  const hotkey_entry_t *e = &cache[(hotkey_hash(key) + ns) & (HOTKEY_CACHE - 1)];
+
+  if (e->key == NULL || e->ns != ns || e->stamp != stamp || strcmp(e->key, key) != 0) return NULL;
+  *lvalue = e->lvalue;
+  return e->value;
+}
+
+// keeps a copy of value for key of namespace ns in the calling thread, stamp being
+// the table stamp read before the value was
+void hotkey_cache_put(const unsigned int ns, const char *key, const unsigned long stamp, const char *value,
+  const unsigned long lvalue)
+{
+  hotkey_entry_t *e = &cache[(hotkey_hash(key) + ns) & (HOTKEY_CACHE - 1)];
+  char *tmp;
+
+  if (lvalue > HOTKEY_CACHE_VALUE) return;
+  if (e->key == NULL || strcmp(e->key, key) != 0)
+  {
+    if ((tmp = strdup(key)) == NULL) return;
+    free(e->key);
+    e->key = tmp;
+  }
+  if (e->value == NULL && (e->value = malloc(HOTKEY_CACHE_VALUE)) == NULL)
+  {
+    free(e->key);
+    e->key = NULL;
+    return;
+  }
+
+  memcpy(e->value, value, lvalue);
+  e->lvalue = lvalue;
+  e->stamp = stamp;
+  e->ns = ns;
+}
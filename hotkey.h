@@ -0,0 +1,43 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef HOTKEY_H
+#define HOTKEY_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#define HOTKEY_DEPTH 4
+#define HOTKEY_WIDTH 8192     // count-min sketch of HOTKEY_DEPTH rows, power of two
+#define HOTKEY_SAMPLE 16      // one GET in this many per thread is counted
+#define HOTKEY_DECAY 65536    // counted GETs between halving all counts, so old heat fades
+#define HOTKEY_TOPK 16
+#define HOTKEY_KEYMAX 64      // longer keys are not tracked
+#define HOTKEY_MINHITS 8      // counted GETs before a key can be hot
+#define HOTKEY_CACHE 64       // entries of each thread's read cache, power of two
+#define HOTKEY_CACHE_VALUE 4096 // larger values are not cached
+
+void hotkey_touch(const char*);
+bool hotkey_hot(const char*);
+void hotkey_report(FILE*);
+const char *hotkey_cache_get(unsigned int, const char*, unsigned long, unsigned long*);
+void hotkey_cache_put(unsigned int, const char*, unsigned long, const char*, unsigned long);
+
+#endif //HOTKEY_H
@@ -0,0 +1,198 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "import.h"
+#include "topology.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct import_part
+{
+  table *t;
+  const char *start, *end; // whole records
+  unsigned long count;
+  int ret;
+} import_part_t;
+
+// walks the record headers once to check the file and cut it into nparts runs of
+// about the same size, *count gets the number of records
+static int import_split(const char *map, const unsigned long size, import_part_t *parts, const unsigned int nparts,
+  unsigned long *count)
+{
+  const unsigned long chunk = size / nparts + 1;
+  unsigned int ip = 0;
+  unsigned long off = 0;
+  unsigned int lkey, lvalue;
+
+  *count = 0;
+  parts[0].start = map;
+  while (off < size)
+  {
+    if (size - off < IMPORT_RECORD) return IMPORT_EINVAL;
+    memcpy(&lkey, map + off, 4);
+    memcpy(&lvalue, map + off + 4, 4);
+    if (lvalue > TABLE_MAXVALUE || size - off - IMPORT_RECORD < (unsigned long)lkey + lvalue) return IMPORT_EINVAL;
+    if (memchr(map + off + IMPORT_RECORD, '\0', lkey) != NULL) return IMPORT_EINVAL; // keys are c strings
+
+    off += IMPORT_RECORD + lkey + lvalue;
+    (*count)++;
+    if (off >= chunk * (ip + 1) && ip + 1 < nparts)
+    {
+      parts[ip].end = map + off;
+      parts[++ip].start = map + off;
+    }
+  }
+  parts[ip].end = map + size;
+  for (ip++; ip < nparts; ++ip) parts[ip].start = parts[ip].end = map + size;
+  return 0;
+}
+
+// builds the entries of one run outside the lock and links them a batch at a time
+static void *import_fn(void *args)
+{
+  import_part_t *part = args;
+  table_s *batch[IMPORT_BATCH];
+  unsigned int n = 0, lkey, lvalue;
+
+  part->ret = 0;
+  part->count = 0;
+  for (const char *p = part->start; p < part->end || n > 0; )
+  {
+    if (p < part->end && n < IMPORT_BATCH)
+    {
+      memcpy(&lkey, p, 4);
+      memcpy(&lvalue, p + 4, 4);
+      if ((batch[n] = table_entry(part->t, lkey, p + IMPORT_RECORD, lvalue, p + IMPORT_RECORD + lkey)) == NULL)
+      {
+        part->ret = -1;
+        break;
+      }
+      n++;
+      p += IMPORT_RECORD + lkey + lvalue;
+      continue;
+    }
+
+    const int dropped = table_insert(part->t, batch, n);
+    if (dropped != 0)
+    {
+      // dropped entries are gone with the rest of the batch, only a refused one is ours
+      if (dropped > 0)
+      {
+        fprintf(stderr, "(import) %d of %u keys dropped, out of memory for the index\n", dropped, n);
+        part->count += n - dropped;
+        n = 0;
+      }
+      part->ret = -1;
+      break;
+    }
+    part->count += n;
+    n = 0;
+  }
+
+  for (unsigned int ie = 0; ie < n; ++ie) table_entry_free(batch[ie]);
+  arena_flush();
+  return NULL;
+}
+
+// loads the size bytes of records at data into t on nthreads threads, bypassing the
+// request queue. the table is sized for them first. *count gets the keys stored,
+// IMPORT_EINVAL when the records are malformed, in which case nothing is loaded.
+int import_data(table *t, const char *data, const unsigned long size, unsigned int nthreads, unsigned long *count)
+{
+  import_part_t parts[IMPORT_MAXTHREADS];
+  pthread_t threads[IMPORT_MAXTHREADS];
+  unsigned long records;
+  int ret;
+
+  *count = 0;
+  if (size == 0) return 0;
+  if (nthreads == 0) nthreads = 1;
+  if (nthreads > IMPORT_MAXTHREADS) nthreads = IMPORT_MAXTHREADS;
+
+  if ((ret = import_split(data, size, parts, nthreads, &records)) != 0) return ret;
+  // without the room the table grows as it goes
+  if ((ret = table_reserve(t, t->ctable + records)) != 0)
+    fprintf(stderr, "(import) table_reserve of %lu keys returned %d\n", t->ctable + records, ret);
+
+  unsigned int started = 0;
+  for (; started < nthreads; ++started)
+  {
+    parts[started].t = t;
+    if (topology_thread_create(&threads[started], TOPOLOGY_ROLE_PROCESSOR, started, import_fn, &parts[started]) < 0)
+    {
+      perror("(import) topology_thread_create");
+      break;
+    }
+  }
+
+  ret = started == nthreads ? 0 : -1;
+  for (unsigned int it = 0; it < started; ++it)
+  {
+    pthread_join(threads[it], NULL);
+    *count += parts[it].count;
+    if (parts[it].ret != 0) ret = -1;
+  }
+  return ret;
+}
+
+// import_data of the file at path
+int import_file(table *t, const char *path, const unsigned int nthreads, unsigned long *count)
+{
+  struct stat st;
+  char *map = NULL;
+  int fd, ret = -1;
+
+  *count = 0;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    perror("(import) open");
+    return -1;
+  }
+  if (fstat(fd, &st) < 0)
+  {
+    perror("(import) fstat");
+    goto import_file_final;
+  }
+  if (st.st_size == 0)
+  {
+    ret = 0;
+    goto import_file_final;
+  }
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+  {
+    perror("(import) mmap");
+    map = NULL;
+    goto import_file_final;
+  }
+  madvise(map, st.st_size, MADV_WILLNEED);
+  ret = import_data(t, map, st.st_size, nthreads, count);
+
+  import_file_final:
+  if (map != NULL) munmap(map, st.st_size);
+  close(fd);
+  return ret;
+}
@@ -1,7 +1,10 @@
+#include "config.h"
 #include "server.h"
+#include <stdlib.h>
 
-int main(void)
+int main(int argc, char **argv)
 {
+    if (config_parse(argc, argv) < 0) return EXIT_FAILURE;
     server_start();
     return 0;
 }
\ No newline at end of file
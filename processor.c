@@ -20,94 +20,920 @@
 // OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "processor.h"
 #include "table.h"
+#include "topology.h"
+#include "protocol.h"
+#include "config.h"
+#include "client.h"
+#include "stats.h"
+#include "hotkey.h"
+#include "tier.h"
+#include "arena.h"
+#include "watch.h"
+#include "trace.h"
+#include "slowlog.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h> //tmp
+#include <limits.h>
+
+#define SCAN_MAXLIMIT 1000
+#define ITERATE_MAXCOUNT 1024
+#define ITERATE_MAXBYTES (4 * 1024 * 1024) // reply size past which ITERATE stops at the next bucket
+
+static void processor_run(processor_item_t*);
+static void processor_finish(processor_item_t*);
 
 static processor_t proc = {
   .cnd  = PTHREAD_COND_INITIALIZER,
   .mtx  = PTHREAD_MUTEX_INITIALIZER,
-  .head = NULL,
-  .tail = NULL
+  .count = 0,
+  .bytes = 0,
+  .ready = 0,
+  .flows = NULL
 };
 
-static int processor_get(const processor_item_t *item)
+static int processor_reply(const processor_item_t *item, const unsigned short status, const char *data, const unsigned int size)
+{
+  return client_reply(item->fd, item->gen, item->id, status, data, size);
+}
+
+// a request that could not run. BUSY while its namespace is frozen for a handover, the
+// client tries again and gets the successor
+static int processor_failed(const processor_item_t *item)
+{
+  const bool frozen = item->table != NULL && table_frozen(item->table);
+  return processor_reply(item, frozen ? PROTOCOL_STATUS_BUSY : PROTOCOL_STATUS_ERROR, NULL, 0);
+}
+
+// copies len bytes at offset out of the payload as a c string, NULL if out of bounds
+static char *processor_string(const processor_item_t *item, const unsigned int offset, const unsigned int len)
+{
+  if (offset > item->size || len > item->size - offset) return NULL;
+
+  char *str = malloc(len + 1);
+  if (str == NULL) return NULL;
+
+  memcpy(str, item->data + offset, len);
+  str[len] = '\0';
+  return str;
+}
+
+// points at len bytes at offset inside the payload, NULL if out of bounds
+static const char *processor_bytes(const processor_item_t *item, const unsigned int offset, const unsigned int len)
+{
+  if (offset > item->size || len > item->size - offset) return NULL;
+  return item->data + offset;
+}
+
+static unsigned long processor_cost(const processor_item_t *item)
+{
+  return PROTOCOL_HEADER + item->size + item->lvalue;
+}
+
+static void processor_ring_push(processor_ring_t *ring, processor_flow_t *flow)
+{
+  flow->nxt = NULL;
+  if (ring->tail != NULL) ring->tail->nxt = flow;
+  else ring->head = flow;
+  ring->tail = flow;
+  flow->active = true;
+  proc.ready++;
+}
+
+static processor_flow_t *processor_ring_pop(processor_ring_t *ring)
+{
+  processor_flow_t *flow = ring->head;
+  ring->head = flow->nxt;
+  if (ring->head == NULL) ring->tail = NULL;
+  flow->nxt = NULL;
+  flow->active = false;
+  proc.ready--;
+  return flow;
+}
+
+static void processor_ring_remove(processor_ring_t *ring, processor_flow_t *flow)
+{
+  processor_flow_t *prev = NULL;
+  for (processor_flow_t *it = ring->head; it != NULL; prev = it, it = it->nxt)
+  {
+    if (it != flow) continue;
+    if (prev != NULL) prev->nxt = it->nxt;
+    else ring->head = it->nxt;
+    if (ring->tail == it) ring->tail = prev;
+    flow->nxt = NULL;
+    flow->active = false;
+    proc.ready--;
+    return;
+  }
+}
+
+// deficit round robin: the connection at the head of a ring is served when its
+// deficit covers the next request, otherwise it gets a quantum and waits for the
+// next round. the high class goes first. a served connection leaves its ring until
+// processor_flow_done, so its requests run one at a time and in order while other
+// connections go to the other workers. proc.mtx must be held and proc.ready > 0.
+static processor_item_t *processor_next(void)
+{
+  for (unsigned int ic = 0; ic < PROCESSOR_CLASSES; ++ic)
+  {
+    processor_ring_t *ring = &proc.rings[ic];
+
+    while (ring->head != NULL)
+    {
+      processor_flow_t *flow = ring->head;
+      processor_item_t *item = flow->head;
+      const unsigned long cost = processor_cost(item);
+
+      if (flow->deficit < cost)
+      {
+        // alone in the ring there is nobody to be fair to
+        flow->deficit = ring->head == ring->tail ? cost : flow->deficit + PROCESSOR_QUANTUM;
+        if (ring->head != ring->tail) processor_ring_push(ring, processor_ring_pop(ring));
+        continue;
+      }
+
+      flow->deficit -= cost;
+      flow->head = item->nxt;
+      if (flow->head == NULL) flow->tail = NULL;
+      flow->running = true;
+      processor_ring_pop(ring);
+      item->nxt = NULL;
+      return item;
+    }
+  }
+  return NULL;
+}
+
+// the request taken from fd is answered, its next one may run
+static void processor_flow_done(const int fd)
+{
+  processor_flow_t *flow = &proc.flows[fd];
+
+  flow->running = false;
+  if (flow->head == NULL)
+  {
+    flow->deficit = 0;
+    return;
+  }
+
+  processor_ring_push(&proc.rings[flow->cls], flow);
+  if (pthread_cond_signal(&proc.cnd) != 0) perror("(processor) processor_flow_done pthread_cond_signal");
+}
+
+static void processor_wait_stats(const processor_item_t *item, const unsigned char cls)
+{
+  const unsigned long now = stats_now();
+  const unsigned long wait = now > item->enqueued ? now - item->enqueued : 0;
+  const unsigned int base = cls == PROCESSOR_CLASS_HIGH ? STATS_WAIT_HIGH_COUNT : STATS_WAIT_NORMAL_COUNT;
+
+  stats_add(base, 1);
+  stats_add(base + 1, wait);
+  stats_max(base + 2, wait);
+}
+
+// moves a connection to another class, queued requests included
+static void processor_flow_class(const int fd, const unsigned char cls)
+{
+  if (fd < 0 || fd >= CLIENTS || cls >= PROCESSOR_CLASSES) return;
+  if (pthread_mutex_lock(&proc.mtx) != 0) return;
+
+  processor_flow_t *flow = &proc.flows[fd];
+  if (flow->cls != cls && flow->active)
+  {
+    processor_ring_remove(&proc.rings[flow->cls], flow);
+    processor_ring_push(&proc.rings[cls], flow);
+  }
+  flow->cls = cls;
+
+  pthread_mutex_unlock(&proc.mtx);
+}
+
+// a closed connection: its queued requests are dropped and the next one on the fd
+// starts in the normal class. one already running answers nobody, see client_gen
+void processor_flow_reset(const int fd)
+{
+  if (fd < 0 || fd >= CLIENTS) return;
+  if (pthread_mutex_lock(&proc.mtx) != 0) return;
+
+  processor_flow_t *flow = &proc.flows[fd];
+  if (flow->active) processor_ring_remove(&proc.rings[flow->cls], flow);
+  while (flow->head != NULL)
+  {
+    processor_item_t *item = flow->head;
+    flow->head = item->nxt;
+    table_release(item->value);
+    free(item->trace);
+    proc.count--;
+    proc.bytes -= item->bytes;
+    free(item->data);
+    free(item);
+  }
+  flow->tail = NULL;
+  flow->deficit = 0;
+  flow->cls = PROCESSOR_CLASS_NORMAL;
+
+  pthread_mutex_unlock(&proc.mtx);
+}
+
+// a request the client stopped waiting for is answered TIMEOUT without touching the
+// table, what it would have cost goes to the shed counters
+static bool processor_shed(processor_item_t *item)
+{
+  if (item->timeout == 0) return false;
+
+  const unsigned long now = stats_now();
+  const unsigned long wait = now > item->enqueued ? now - item->enqueued : 0;
+  if (wait <= item->timeout) return false;
+
+  stats_add(STATS_SHED_REQUESTS, 1);
+  stats_add(STATS_SHED_BYTES, processor_cost(item));
+  stats_add(STATS_SHED_WAIT_NS, wait);
+  table_release(item->value);
+  processor_reply(item, PROTOCOL_STATUS_TIMEOUT, NULL, 0);
+  processor_finish(item);
+  return true;
+}
+
+// brings a cold value back on a loader thread and runs the request again
+static void processor_load(void *args)
+{
+  processor_item_t *item = args;
+  const int ret = table_load(item->table, item->cold);
+
+  free(item->cold);
+  item->cold = NULL;
+  if (ret == -1)
+  {
+    processor_failed(item);
+    processor_finish(item);
+    return;
+  }
+  processor_run(item);
+}
+
+// parks a request on a cold key, taking over key. the connection's next requests
+// wait as they do behind any running one, the worker moves on to other connections.
+static int processor_defer(processor_item_t *item, char *key)
+{
+  item->cold = key;
+  // the span waits with the request, the loader runs it again. item is not ours past tier_submit
+  item->trace = trace_claim();
+  if (tier_submit(processor_load, item) < 0)
+  {
+    trace_set_current(item->trace);
+    item->trace = NULL;
+    free(key);
+    item->cold = NULL;
+    return -1;
+  }
+  return PROCESSOR_DEFERRED;
+}
+
+static int processor_get(processor_item_t *item)
 {
   unsigned int keysize;
+  const char *value;
+  unsigned long lstored, lvalue;
+  unsigned char enc = TABLE_ENC_RAW;
+  unsigned long long version = 0;
+  int ret;
 
+  if (item->size < 4) return -1;
   memcpy(&keysize, item->data, 4);
 
-  char *key = malloc(keysize);
+  char *key = processor_string(item, 4, keysize);
   if (key == NULL) return -1;
+  hotkey_touch(key);
 
-  memcpy(key, item->data + 4, keysize);
-
-  const table_s *found = table_getbk(key);
-  if (found == NULL)
+  // hot keys are answered from this thread's own copy while the table has no newer write
+  const bool withversion = item->cmd & PROTOCOL_FLAG_VERSION;
+  const bool cache = config_get()->readcache && !(item->cmd & (PROTOCOL_FLAG_LZ4 | PROTOCOL_FLAG_VERSION));
+  const unsigned long stamp = cache ? table_stamp(item->table, key) : 0;
+  if (cache && (value = hotkey_cache_get(item->ns, key, stamp, &lvalue)) != NULL)
   {
     free(key);
-    return -1;
+    stats_add(STATS_CACHE_HITS, 1);
+    return processor_reply(item, PROTOCOL_STATUS_OK, value, lvalue);
   }
 
-  write(item->fd, found->value, found->lvalue);
+  // the value is sent straight from the table in chunks, nothing is copied. clients
+  // that accept lz4 get compressed values as stored.
+  if (item->cmd & PROTOCOL_FLAG_LZ4)
+    ret = table_borrow_encoded(item->table, key, &value, &lstored, &lvalue, &enc, &version);
+  else ret = table_borrow(item->table, key, &value, &lvalue, &version);
+  if (cache && ret == 0)
+  {
+    stats_add(STATS_CACHE_MISSES, 1);
+    if (hotkey_hot(key)) hotkey_cache_put(item->ns, key, stamp, value, lvalue);
+  }
+  if (ret == TABLE_ECOLD) return processor_defer(item, key);
   free(key);
+  if (ret == TABLE_ENOENT) return processor_reply(item, PROTOCOL_STATUS_NOTFOUND, NULL, 0);
+  if (ret < 0) return -1;
 
-  return 0;
+  // with PROTOCOL_FLAG_VERSION the entry version (8) goes ahead of the value
+  const unsigned int lprefix = withversion ? 8 : 0;
+  if (enc == TABLE_ENC_LZ4)
+    return client_reply_prefixed(item->fd, item->gen, item->id, PROTOCOL_STATUS_OK | PROTOCOL_FLAG_LZ4,
+      (const char*)&version, lprefix, value, value, lstored);
+  return client_reply_prefixed(item->fd, item->gen, item->id, PROTOCOL_STATUS_OK, (const char*)&version, lprefix,
+    value, value, lvalue);
 }
 
 static int processor_set(const processor_item_t *item)
 {
   unsigned int keysize, valuesize;
 
+  if (item->size < 8)
+  {
+    table_release(item->value);
+    return -1;
+  }
   memcpy(&keysize, item->data, 4);
   memcpy(&valuesize, item->data + 4, 4);
 
-  char *key = malloc(keysize);
-  if (key == NULL) return -1;
+  char *key = processor_string(item, 8, keysize);
+  if (key == NULL)
+  {
+    table_release(item->value);
+    return -1;
+  }
 
-  char *value = malloc(valuesize);
-  if (value == NULL)
+  // streamed values were read into a table buffer already and are adopted as is
+  if (item->value != NULL)
+  {
+    const int ret = table_adopt(item->table, keysize, key, item->lvalue, item->value);
+    if (ret < 0) table_release(item->value);
+    else watch_notify(item->ns, key, WATCH_EVENT_SET);
+    free(key);
+    return ret < 0 ? -1 : processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+  }
+
+  // values are binary, the table copies them straight out of the frame
+  const char *value = processor_bytes(item, 8 + keysize, valuesize);
+  if (value == NULL || table_add(item->table, keysize, valuesize, key, value) < 0)
   {
     free(key);
     return -1;
   }
 
-  memcpy(key, item->data + 8, keysize);
-  memcpy(value, item->data + 8 + keysize, valuesize);
+  watch_notify(item->ns, key, WATCH_EVENT_SET);
+  free(key);
+  return processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+}
+
+// request: keysize (4) | valuesize (4) | version (8) | key | value. the SET only happens
+// when the entry is at version, 0 for a key that must not exist yet.
+// reply: the new version (8), or with PROTOCOL_STATUS_CONFLICT the current one
+static int processor_cas(const processor_item_t *item)
+{
+  unsigned int keysize, valuesize;
+  unsigned long long expected, version;
+
+  if (item->size < 16) return -1;
+  memcpy(&keysize, item->data, 4);
+  memcpy(&valuesize, item->data + 4, 4);
+  memcpy(&expected, item->data + 8, 8);
+
+  char *key = processor_string(item, 16, keysize);
+  if (key == NULL) return -1;
+
+  const char *value = processor_bytes(item, 16 + keysize, valuesize);
+  const int ret = value != NULL ? table_cas(item->table, keysize, valuesize, key, value, expected, &version) : -1;
+  if (ret == 0) watch_notify(item->ns, key, WATCH_EVENT_SET);
+  free(key);
 
-  if (table_add(keysize, valuesize, key, value) < 0)
+  if (ret == TABLE_ECONFLICT) return processor_reply(item, PROTOCOL_STATUS_CONFLICT, (const char*)&version, 8);
+  if (ret < 0) return -1;
+  return processor_reply(item, PROTOCOL_STATUS_OK, (const char*)&version, 8);
+}
+
+// request: keysize (4) | datasize (4) | offset (8) | key | data, offset is omitted by APPEND
+// reply:   the new value length (8)
+static int processor_setrange(const processor_item_t *item, const bool append)
+{
+  unsigned int keysize, datasize, header = append ? 8 : 16;
+  unsigned long offset = TABLE_APPEND, lvalue;
+
+  if (item->size < header) return -1;
+  memcpy(&keysize, item->data, 4);
+  memcpy(&datasize, item->data + 4, 4);
+  if (!append) memcpy(&offset, item->data + 8, 8);
+  if (!append && offset == TABLE_APPEND) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+
+  char *key = processor_string(item, header, keysize);
+  if (key == NULL) return -1;
+
+  const char *data = processor_bytes(item, header + keysize, datasize);
+  if (data == NULL)
   {
     free(key);
-    free(value);
     return -1;
   }
 
-  write(item->fd, value, valuesize);
+  const int ret = table_setrange(item->table, keysize, key, offset, datasize, data, &lvalue);
+  if (ret == 0) watch_notify(item->ns, key, WATCH_EVENT_SET);
+  free(key);
+
+  if (ret == TABLE_EINVAL) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  if (ret < 0) return -1;
+  return processor_reply(item, PROTOCOL_STATUS_OK, (const char*)&lvalue, 8);
+}
+
+// request: keysize (4) | offset (8) | length (8) | key
+// reply:   the bytes of the value in [offset, offset + length), clipped to its end
+static int processor_getrange(processor_item_t *item)
+{
+  unsigned int keysize;
+  unsigned long offset, length, lvalue;
+  const char *value;
+
+  if (item->size < 20) return -1;
+  memcpy(&keysize, item->data, 4);
+  memcpy(&offset, item->data + 4, 8);
+  memcpy(&length, item->data + 12, 8);
+
+  char *key = processor_string(item, 20, keysize);
+  if (key == NULL) return -1;
+
+  const int ret = table_borrow(item->table, key, &value, &lvalue, NULL);
+  if (ret == TABLE_ECOLD) return processor_defer(item, key);
+  free(key);
+  if (ret == TABLE_ENOENT) return processor_reply(item, PROTOCOL_STATUS_NOTFOUND, NULL, 0);
+  if (ret < 0) return -1;
+
+  if (offset >= lvalue) offset = length = 0;
+  else if (length > lvalue - offset) length = lvalue - offset;
+  return client_reply_borrowed(item->fd, item->gen, item->id, PROTOCOL_STATUS_OK, value, value + offset, length);
+}
+
+static int processor_del(const processor_item_t *item)
+{
+  unsigned int keysize;
+
+  if (item->size < 4) return -1;
+  memcpy(&keysize, item->data, 4);
+
+  char *key = processor_string(item, 4, keysize);
+  if (key == NULL) return -1;
+
+  const int found = table_del(item->table, key);
+  if (found == 0) watch_notify(item->ns, key, WATCH_EVENT_DEL);
+  free(key);
+  if (found != 0 && table_frozen(item->table)) return -1;
+
+  return processor_reply(item, found == 0 ? PROTOCOL_STATUS_OK : PROTOCOL_STATUS_NOTFOUND, NULL, 0);
+}
+
+// request: keysize (4) | delta (8, signed) | key
+// reply:   the new value (8, signed)
+static int processor_incrby(const processor_item_t *item, const bool negate)
+{
+  unsigned int keysize;
+  long long delta, result;
+
+  if (item->size < 12) return -1;
+  memcpy(&keysize, item->data, 4);
+  memcpy(&delta, item->data + 4, 8);
+  if (negate)
+  {
+    if (delta == LLONG_MIN) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+    delta = -delta;
+  }
+
+  char *key = processor_string(item, 12, keysize);
+  if (key == NULL) return -1;
+
+  const int ret = table_incr(item->table, keysize, key, delta, &result);
+  if (ret == 0) watch_notify(item->ns, key, WATCH_EVENT_SET);
+  free(key);
+
+  if (ret == TABLE_EINVAL) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  if (ret < 0) return -1;
+  return processor_reply(item, PROTOCOL_STATUS_OK, (const char*)&result, 8);
+}
+
+// request: keysize (4) | key. the connection is pushed an event for every write or
+// delete of the key until UNWATCH, see watch.h
+static int processor_watch(const processor_item_t *item, const bool add)
+{
+  unsigned int keysize;
+
+  if (item->size < 4) return -1;
+  memcpy(&keysize, item->data, 4);
+
+  char *key = processor_string(item, 4, keysize);
+  if (key == NULL) return -1;
 
+  const int ret = add ? watch_add(item->fd, item->ns, key) : watch_remove(item->fd, item->ns, key);
   free(key);
-  free(value);
+
+  if (ret == WATCH_ENOENT) return processor_reply(item, PROTOCOL_STATUS_NOTFOUND, NULL, 0);
+  if (ret < 0) return -1;
+  return processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+}
+
+typedef struct processor_buf
+{
+  char *data;
+  size_t size, cap;
+  unsigned int count, last;
+} processor_buf_t;
+
+static int processor_buf_reserve(processor_buf_t *reply, const size_t size)
+{
+  if (reply->size + size > reply->cap)
+  {
+    size_t cap = reply->cap * 2;
+    while (cap < reply->size + size) cap *= 2;
+    char *tmp = realloc(reply->data, cap);
+    if (tmp == NULL) return -1;
+    reply->data = tmp;
+    reply->cap = cap;
+  }
   return 0;
 }
 
-static int processor_exec(const processor_item_t *item)
+static int processor_buf_put(processor_buf_t *reply, const void *data, const unsigned int size)
+{
+  if (processor_buf_reserve(reply, size) < 0) return -1;
+  memcpy(reply->data + reply->size, data, size);
+  reply->size += size;
+  return 0;
+}
+
+static int processor_scan_fn(const char *key, void *args)
+{
+  processor_buf_t *reply = args;
+  const unsigned int lkey = strlen(key);
+
+  reply->last = reply->size;
+  if (processor_buf_put(reply, &lkey, 4) < 0) return -1;
+  if (processor_buf_put(reply, key, lkey) < 0) return -1;
+  reply->count++;
+  return 0;
+}
+
+// request: limit (4) | lprefix (4) | lstart (4) | lend (4) | lcursor (4) | prefix | start | end | cursor
+// reply:   count (4) | count * (lkey (4) | key) | lcursor (4) | cursor
+// the cursor is the last key returned and is empty once the scan is complete.
+static int processor_scan(const processor_item_t *item)
+{
+  unsigned int limit, lens[4], offset = 20;
+  char *args[4] = {NULL, NULL, NULL, NULL};
+  processor_buf_t reply = {.size = 4, .cap = 256, .count = 0, .last = 0};
+  bool more;
+  int ret = -1;
+
+  if (item->size < 20) return -1;
+  memcpy(&limit, item->data, 4);
+  memcpy(lens, item->data + 4, 16);
+  if (limit == 0 || limit > SCAN_MAXLIMIT) limit = SCAN_MAXLIMIT;
+
+  for (unsigned int ia = 0; ia < 4; ++ia)
+  {
+    if (lens[ia] == 0) continue;
+    if ((args[ia] = processor_string(item, offset, lens[ia])) == NULL) goto processor_scan_final;
+    offset += lens[ia];
+  }
+
+  if ((reply.data = malloc(reply.cap)) == NULL) goto processor_scan_final;
+  if (table_scan(item->table, args[0], args[1], args[2], args[3], limit, processor_scan_fn, &reply, &more) < 0)
+  {
+    ret = processor_reply(item, PROTOCOL_STATUS_UNSUPPORTED, NULL, 0);
+    goto processor_scan_final;
+  }
+  memcpy(reply.data, &reply.count, 4);
+
+  if (more && reply.count > 0)
+  {
+    unsigned int lcursor;
+    memcpy(&lcursor, reply.data + reply.last, 4);
+    if (processor_buf_put(&reply, reply.data + reply.last, 4 + lcursor) < 0) goto processor_scan_final;
+  }
+  else
+  {
+    const unsigned int lcursor = 0;
+    if (processor_buf_put(&reply, &lcursor, 4) < 0) goto processor_scan_final;
+  }
+
+  ret = processor_reply(item, PROTOCOL_STATUS_OK, reply.data, reply.size);
+
+  processor_scan_final:
+  for (unsigned int ia = 0; ia < 4; ++ia) free(args[ia]);
+  free(reply.data);
+  return ret;
+}
+
+static int processor_iterate_fn(const table_s *s, void *args)
+{
+  processor_buf_t *reply = args;
+  const unsigned int lkey = s->lkey, lvalue = s->lvalue;
+
+  if (processor_buf_put(reply, &lkey, 4) < 0) return -1;
+  if (processor_buf_put(reply, &lvalue, 4) < 0) return -1;
+  if (processor_buf_put(reply, s->key, lkey) < 0) return -1;
+  if (processor_buf_reserve(reply, lvalue) < 0) return -1;
+  if (table_read(s, reply->data + reply->size) < 0) return -1;
+  reply->size += lvalue;
+  reply->count++;
+  return reply->size >= ITERATE_MAXBYTES ? 1 : 0;
+}
+
+// request: cursor (8) | count (4), start with cursor 0
+// reply:   cursor (8) | n (4) | n * (lkey (4) | lvalue (4) | key | value)
+// count bounds the buckets visited per call and the reply stops at the first bucket
+// boundary past ITERATE_MAXBYTES, the iteration is over once the returned cursor is 0 again.
+static int processor_iterate(const processor_item_t *item)
+{
+  unsigned long cursor;
+  unsigned int count;
+  processor_buf_t reply = {.size = 12, .cap = 4096, .count = 0};
+  int ret = -1;
+
+  if (item->size < 12) return -1;
+  memcpy(&cursor, item->data, 8);
+  memcpy(&count, item->data + 8, 4);
+  if (count == 0 || count > ITERATE_MAXCOUNT) count = ITERATE_MAXCOUNT;
+
+  if ((reply.data = malloc(reply.cap)) == NULL) return -1;
+  if (table_iterate(item->table, &cursor, count, processor_iterate_fn, &reply) < 0) goto processor_iterate_final;
+  memcpy(reply.data, &cursor, 8);
+  memcpy(reply.data + 8, &reply.count, 4);
+
+  ret = processor_reply(item, PROTOCOL_STATUS_OK, reply.data, reply.size);
+
+  processor_iterate_final:
+  free(reply.data);
+  return ret;
+}
+
+// request: keys (8), the namespace is sized to hold that many without resizing
+static int processor_reserve(const processor_item_t *item)
+{
+  unsigned long keys;
+
+  if (item->size != 8) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  memcpy(&keys, item->data, 8);
+
+  const int ret = table_reserve(item->table, keys);
+  if (ret == TABLE_EINVAL) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  if (ret < 0) return -1;
+  return processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+}
+
+// payload: class(1), PROCESSOR_CLASS_HIGH or PROCESSOR_CLASS_NORMAL for this connection
+static int processor_class(const processor_item_t *item)
+{
+  unsigned char cls;
+
+  if (item->size != 1) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  memcpy(&cls, item->data, 1);
+  if (cls >= PROCESSOR_CLASSES) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+
+  processor_flow_class(item->fd, cls);
+  return processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+}
+
+// reply: "name:value" lines
+static int processor_stats(const processor_item_t *item)
+{
+  char *data = NULL;
+  size_t size = 0;
+
+  FILE *f = open_memstream(&data, &size);
+  if (f == NULL) return -1;
+  stats_report(f);
+  table_report(f);
+  arena_report(f);
+  hotkey_report(f);
+  tier_report(f);
+  watch_report(f);
+  if (fclose(f) != 0)
+  {
+    free(data);
+    return -1;
+  }
+
+  const int ret = processor_reply(item, PROTOCOL_STATUS_OK, data, size);
+  free(data);
+  return ret;
+}
+
+// reply: the traced requests as chrome trace event json, see trace.h
+static int processor_trace(const processor_item_t *item)
+{
+  char *data = NULL;
+  size_t size = 0;
+
+  if (!trace_enabled()) return processor_reply(item, PROTOCOL_STATUS_UNSUPPORTED, NULL, 0);
+  FILE *f = open_memstream(&data, &size);
+  if (f == NULL) return -1;
+  trace_dump(f);
+  if (fclose(f) != 0)
+  {
+    free(data);
+    return -1;
+  }
+
+  const int ret = processor_reply(item, PROTOCOL_STATUS_OK, data, size);
+  free(data);
+  return ret;
+}
+
+// request: op (1) | count (4), see slowlog.h
+// reply:   for SLOWLOG_GET, the newest count entries as lines, all of them without count
+static int processor_slowlog(const processor_item_t *item)
+{
+  unsigned int count = 0;
+  char *data = NULL;
+  size_t size = 0;
+
+  if (item->size < 1) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  if (item->data[0] == SLOWLOG_RESET)
+  {
+    slowlog_reset();
+    return processor_reply(item, PROTOCOL_STATUS_OK, NULL, 0);
+  }
+  if (item->data[0] != SLOWLOG_GET) return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  if (item->size >= 5) memcpy(&count, item->data + 1, 4);
+
+  FILE *f = open_memstream(&data, &size);
+  if (f == NULL) return -1;
+  slowlog_report(f, count);
+  if (fclose(f) != 0)
+  {
+    free(data);
+    return -1;
+  }
+
+  const int ret = processor_reply(item, PROTOCOL_STATUS_OK, data, size);
+  free(data);
+  return ret;
+}
+
+static int processor_exec(processor_item_t *item)
 {
   int ret;
 
+  if ((item->table = table_namespace(item->ns)) == NULL)
+  {
+    table_release(item->value);
+    return processor_reply(item, PROTOCOL_STATUS_INVALID, NULL, 0);
+  }
+
   // distinguish data here
-  switch (item->cmd)
+  switch (item->cmd & PROTOCOL_CMD_MASK)
   {
-  case 1:
-    return processor_set(item);
-  case 2:
-    return processor_get(item);
+  case PROTOCOL_CMD_SET:
+    ret = processor_set(item);
+    break;
+  case PROTOCOL_CMD_GET:
+    ret = processor_get(item);
+    break;
+  case PROTOCOL_CMD_DEL:
+    ret = processor_del(item);
+    break;
+  case PROTOCOL_CMD_SCAN:
+    ret = processor_scan(item);
+    break;
+  case PROTOCOL_CMD_ITERATE:
+    ret = processor_iterate(item);
+    break;
+  case PROTOCOL_CMD_INCRBY:
+    ret = processor_incrby(item, false);
+    break;
+  case PROTOCOL_CMD_DECRBY:
+    ret = processor_incrby(item, true);
+    break;
+  case PROTOCOL_CMD_APPEND:
+    ret = processor_setrange(item, true);
+    break;
+  case PROTOCOL_CMD_GETRANGE:
+    ret = processor_getrange(item);
+    break;
+  case PROTOCOL_CMD_SETRANGE:
+    ret = processor_setrange(item, false);
+    break;
+  case PROTOCOL_CMD_STATS:
+    ret = processor_stats(item);
+    break;
+  case PROTOCOL_CMD_CLASS:
+    ret = processor_class(item);
+    break;
+  case PROTOCOL_CMD_CAS:
+    ret = processor_cas(item);
+    break;
+  case PROTOCOL_CMD_RESERVE:
+    ret = processor_reserve(item);
+    break;
+  case PROTOCOL_CMD_WATCH:
+    ret = processor_watch(item, true);
+    break;
+  case PROTOCOL_CMD_UNWATCH:
+    ret = processor_watch(item, false);
+    break;
+  case PROTOCOL_CMD_TRACE:
+    ret = processor_trace(item);
+    break;
+  case PROTOCOL_CMD_SLOWLOG:
+    ret = processor_slowlog(item);
+    break;
   default:
-    return -1;
+    return processor_reply(item, PROTOCOL_STATUS_UNSUPPORTED, NULL, 0);
+  }
+
+  if (ret < 0) return processor_failed(item);
+  return ret;
+}
+
+// lets the connection's next request go
+static void processor_finish(processor_item_t *item)
+{
+  // after processing we can free the proc item, a streamed value was adopted or released
+  const int fd = item->fd;
+  const unsigned int gen = item->gen;
+  const unsigned long bytes = item->bytes;
+  trace_commit(trace_claim()); // a span whose reply was never queued
+  free(item->data);
+  free(item);
+
+  if (pthread_mutex_lock(&proc.mtx) != 0)
+  {
+    perror("(processor) processor_run pthread_mutex_lock");
+    exit(EXIT_FAILURE);
+  }
+  processor_flow_done(fd);
+  if (pthread_mutex_unlock(&proc.mtx) != 0)
+  {
+    perror("(processor) pthread_mutex_unlock");
+    exit(EXIT_FAILURE);
+  }
+  client_done(fd, gen, bytes);
+}
+
+// where the key starts in the payload of cmd, after its length (4) at 0. 0 for commands without one
+static unsigned int processor_key_offset(const unsigned short cmd)
+{
+  switch (cmd & PROTOCOL_CMD_MASK)
+  {
+  case PROTOCOL_CMD_GET:
+  case PROTOCOL_CMD_DEL:
+  case PROTOCOL_CMD_WATCH:
+  case PROTOCOL_CMD_UNWATCH:
+    return 4;
+  case PROTOCOL_CMD_SET:
+  case PROTOCOL_CMD_APPEND:
+    return 8;
+  case PROTOCOL_CMD_INCRBY:
+  case PROTOCOL_CMD_DECRBY:
+    return 12;
+  case PROTOCOL_CMD_CAS:
+  case PROTOCOL_CMD_SETRANGE:
+    return 16;
+  case PROTOCOL_CMD_GETRANGE:
+    return 20;
+  default:
+    return 0;
   }
 }
 
+// logs a request that took from threshold on since it was queued, the item is still ours
+static void processor_slow(const processor_item_t *item, const unsigned long start, const unsigned long lock)
+{
+  const unsigned long threshold = slowlog_threshold(), end = stats_now();
+  const unsigned long wait = start > item->enqueued ? start - item->enqueued : 0;
+  const unsigned int offset = processor_key_offset(item->cmd);
+  unsigned int lkey = 0;
+  const char *key = NULL;
+
+  if (threshold == 0 || wait + (end - start) < threshold) return;
+  if (offset > 0 && item->size >= 4)
+  {
+    memcpy(&lkey, item->data, 4);
+    key = processor_bytes(item, offset, lkey);
+  }
+  slowlog_request(item->cmd & PROTOCOL_CMD_MASK, item->ns, key, lkey, processor_cost(item), wait, lock,
+    end - start > lock ? end - start - lock : 0);
+}
+
+// runs a request and finishes it, unless it was deferred
+static void processor_run(processor_item_t *item)
+{
+  // the span goes out with the reply
+  trace_set_current(item->trace);
+  item->trace = NULL;
+  if (processor_shed(item)) return;
+
+  const unsigned long lockwait = table_lockwait(), start = stats_now();
+  if (processor_exec(item) == PROCESSOR_DEFERRED) return;
+  processor_slow(item, start, table_lockwait() - lockwait);
+  processor_finish(item);
+}
+
 static void *processor_worker_fn(void *args)
 {
+  (void)args;
   while(1)
   {
     if (pthread_mutex_lock(&proc.mtx) < 0)
@@ -116,15 +942,17 @@ static void *processor_worker_fn(void *args)
       exit(EXIT_FAILURE);
     }
 
-    while (proc.head == NULL)
+    while (proc.ready == 0)
       if (pthread_cond_wait(&proc.cnd, &proc.mtx) < 0)
       {
         perror("(processor) worker_fn pthread_cond_wait");
         exit(EXIT_FAILURE);
       }
     
-    processor_item_t *item = proc.head;
-    proc.head = item->nxt;
+    processor_item_t *item = processor_next();
+    const unsigned char cls = proc.flows[item->fd].cls;
+    proc.count--;
+    proc.bytes -= item->bytes;
 
     if (pthread_mutex_unlock(&proc.mtx) < 0)
     {
@@ -132,82 +960,168 @@ static void *processor_worker_fn(void *args)
       exit(EXIT_FAILURE);
     }
     // free to proc
-    processor_exec(item);
-    // -------
+    trace_stamp(item->trace, TRACE_START);
+    processor_wait_stats(item, cls);
+    processor_run(item);
+  }
+}
 
-    // after processing we can free the proc item
-    free(item->data);
-    free(item);
+static int processor_push(processor_item_t *item)
+{
+  if (pthread_mutex_lock(&proc.mtx) != 0)
+  {
+    perror("(processor) processor_enqueue pthread_mutex_lock");
+    return -1;
+  }
+
+  if (proc.count >= PROCESSOR_MAXQUEUE || proc.bytes + item->bytes > PROCESSOR_MAXBYTES)
+  {
+    pthread_mutex_unlock(&proc.mtx);
+    return PROCESSOR_EBUSY;
   }
+
+  processor_flow_t *flow = &proc.flows[item->fd];
+  if (flow->tail != NULL) flow->tail->nxt = item;
+  else flow->head = item;
+  flow->tail = item;
+  if (!flow->active && !flow->running) processor_ring_push(&proc.rings[flow->cls], flow);
+  item->enqueued = stats_now();
+  trace_stamp(item->trace, TRACE_QUEUED);
+  proc.count++;
+  proc.bytes += item->bytes;
+
+  if (pthread_cond_signal(&proc.cnd) != 0) perror("(processor) processor_enqueue pthread_cond_signal");
+  if (pthread_mutex_unlock(&proc.mtx) != 0)
+  {
+    perror("(processor) processor_enqueue pthread_mutex_unlock");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
 }
 
-int processsor_enqueue(int fd, unsigned int size, unsigned int id, unsigned short cmd, const char* data)
+static processor_item_t *processor_item(int fd, unsigned int size, unsigned int id, unsigned short cmd, const char* data,
+  trace_span_t *trace)
 {
+  if (fd < 0 || fd >= CLIENTS) return NULL;
+
   processor_item_t *item = malloc(sizeof(processor_item_t));
-  if (item == NULL) return -1;
-  
-  item->data = malloc(size);
+  if (item == NULL) return NULL;
+  item->trace = trace;
+  const unsigned int frame = size;
+
+  // the deadline and namespace prefixes are taken off, handlers see the usual payload.
+  // a namespace that is missing selects none and the request is refused when it runs
+  item->timeout = 0;
+  if (cmd & PROTOCOL_FLAG_DEADLINE)
+  {
+    unsigned int timeout = 0;
+    if (size >= 4) memcpy(&timeout, data, 4);
+    item->timeout = timeout * 1000ul;
+    data += size >= 4 ? 4 : size;
+    size -= size >= 4 ? 4 : size;
+  }
+
+  item->ns = 0;
+  if (cmd & PROTOCOL_FLAG_NAMESPACE)
+  {
+    unsigned short ns = USHRT_MAX;
+    if (size >= 2) memcpy(&ns, data, 2);
+    item->ns = ns;
+    data += size >= 2 ? 2 : size;
+    size -= size >= 2 ? 2 : size;
+  }
+
+  item->data = malloc(size > 0 ? size : 1);
   if (item->data == NULL)
   {
     free(item);
-    return -1;
+    return NULL;
   }
 
   memcpy(item->data, data, size);
   item->fd = fd;
+  item->gen = client_gen(fd);
   item->cmd = cmd;
   item->id = id;
   item->size = size;
+  item->bytes = PROTOCOL_HEADER + frame;
+  item->value = NULL;
+  item->lvalue = 0;
+  item->cold = NULL;
   item->nxt = NULL;
+  return item;
+}
 
-  if (pthread_mutex_lock(&proc.mtx) < 0) goto processor_enqueue_error;
-
-  if (proc.head == NULL)
+// queues a request, -1 when out of memory and PROCESSOR_EBUSY when the queue is full.
+// the item takes over trace, it is dropped on failure
+int processsor_enqueue(int fd, unsigned int size, unsigned int id, unsigned short cmd, const char* data,
+  trace_span_t *trace)
+{
+  processor_item_t *item = processor_item(fd, size, id, cmd, data, trace);
+  if (item == NULL)
   {
-    proc.head = item;
-    proc.tail = item;
-    goto processor_enqueue_final;
+    free(trace);
+    return -1;
   }
 
-  if (proc.tail != NULL)
+  const int ret = processor_push(item);
+  if (ret < 0)
   {
-    proc.tail->nxt = item;
-    proc.tail = item;
-    goto processor_enqueue_final;
+    free(item->trace);
+    free(item->data);
+    free(item);
+    return ret;
   }
+  return 0;
+}
 
-  if (pthread_mutex_unlock(&proc.mtx) < 0)
+// like processsor_enqueue, with a value from table_alloc the item takes over. on
+// failure the value stays with the caller
+int processor_enqueue_value(int fd, unsigned int size, unsigned int id, unsigned short cmd, const char* data,
+  char *value, unsigned long lvalue, trace_span_t *trace)
+{
+  processor_item_t *item = processor_item(fd, size, id, cmd, data, trace);
+  if (item == NULL)
   {
-    perror("(processor) processor_enqueue pthread_mutex_unlock");
-    exit(EXIT_FAILURE);
+    free(trace);
+    return -1;
   }
 
-  processor_enqueue_error:
-  free(item->data);
-  free(item);
-  return -1;
-
-  processor_enqueue_final:
-  if (pthread_cond_signal(&proc.cnd) < 0)
+  item->value = value;
+  item->lvalue = lvalue;
+  item->bytes += lvalue;
+  const int ret = processor_push(item);
+  if (ret < 0)
   {
-    perror("(processor) processor_enqueue pthread_cond_signal");
-    goto processor_enqueue_error;
-  }
-  if (pthread_mutex_unlock(&proc.mtx) < 0)
-  {
-    perror("(processor) processor_enqueue pthread_mutex_unlock");
-    goto processor_enqueue_error;
+    free(item->trace);
+    free(item->data);
+    free(item);
+    return ret;
   }
   return 0;
 }
 
-int processor_setup_workers(void)
+int processor_setup_workers(const unsigned int nworkers)
 {
-  if (table_setup() == NULL) return -1;
-  for (unsigned int iw = 0; iw < PROCESSOR_WORKERS; ++iw)
-    if (pthread_create(&proc.workers[iw], NULL, processor_worker_fn, NULL) < 0)
+  if (watch_setup(table_namespaces()) < 0) return -1;
+  trace_setup(config_get()->trace);
+  slowlog_setup(config_get()->slowlog * 1000ul);
+  if ((proc.flows = calloc(CLIENTS, sizeof(processor_flow_t))) == NULL)
+  {
+    perror("(processor) calloc");
+    return -1;
+  }
+  for (unsigned int ic = 0; ic < CLIENTS; ++ic) proc.flows[ic].cls = PROCESSOR_CLASS_NORMAL;
+  if ((proc.workers = calloc(nworkers, sizeof(pthread_t))) == NULL)
+  {
+    perror("(processor) calloc");
+    return -1;
+  }
+  proc.nworkers = nworkers;
+  for (unsigned int iw = 0; iw < nworkers; ++iw)
+    if (topology_thread_create(&proc.workers[iw], TOPOLOGY_ROLE_PROCESSOR, iw, processor_worker_fn, NULL) < 0)
     {
-      perror("(processor) pthread_create");
+      perror("(processor) topology_thread_create");
       return -1;
     }
   return 0;
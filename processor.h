@@ -21,28 +21,74 @@
 #ifndef PROCESSOR_H
 #define PROCESSOR_H
 
+#include "trace.h"
 #include <pthread.h>
+#include <stdbool.h>
 
 #define PROCESSOR_WORKERS 4
+#define PROCESSOR_MAXQUEUE 65536 // queued requests, past this the server answers BUSY
+#define PROCESSOR_MAXBYTES (1ul << 30) // bytes of queued requests, past this the server answers BUSY
+#define PROCESSOR_EBUSY -2
+#define PROCESSOR_DEFERRED 1 // the request waits for the tier and is run again
+#define PROCESSOR_QUANTUM 16384 // bytes a connection is served per round
+
+// connections in PROCESSOR_CLASS_HIGH are always served before the normal ones
+#define PROCESSOR_CLASS_HIGH 0
+#define PROCESSOR_CLASS_NORMAL 1
+#define PROCESSOR_CLASSES 2
 
 typedef struct processor_item
 {
   unsigned short cmd;
   int fd; //clients file descriptor
+  unsigned int gen; // connection on fd that sent it, see client_gen
   unsigned int size, id;
   char *data;
+  char *value; // value of a streamed SET, read by the client straight into a table buffer
+  unsigned long lvalue;
+  unsigned long bytes; // the whole frame as it came, held against the queue and the connection
+  unsigned long enqueued; // ns, for the queue wait stats
+  unsigned long timeout; // ns from enqueued the client still wants the reply, 0 for ever
+  unsigned int ns; // namespace the request works on
+  struct table *table; // of ns, looked up when the request runs
+  char *cold; // key a loader brings back from the tier before the request runs again
+  trace_span_t *trace; // NULL unless the request is sampled
   struct processor_item *nxt;
 } processor_item_t;
 
+// requests of one connection, served deficit round robin against the others of its class.
+// they run one at a time, so a connection sees its replies in request order
+typedef struct processor_flow
+{
+  struct processor_item *head, *tail;
+  unsigned long deficit;
+  unsigned char cls;
+  bool active; // in the ring of its class
+  bool running; // a worker has one of its requests
+  struct processor_flow *nxt;
+} processor_flow_t;
+
+typedef struct processor_ring
+{
+  struct processor_flow *head, *tail;
+} processor_ring_t;
+
 typedef struct processor
 {
   pthread_mutex_t mtx;
   pthread_cond_t cnd;
-  pthread_t workers[PROCESSOR_WORKERS];
-  struct processor_item *head, *tail;
+  unsigned int nworkers, count;
+  unsigned long bytes; // of the queued requests, see processor_item.bytes
+  unsigned int ready; // flows in the rings
+  pthread_t *workers;
+  processor_flow_t *flows; // by client fd
+  processor_ring_t rings[PROCESSOR_CLASSES];
 } processor_t;
 
-int processor_setup_workers(void);
-int processsor_enqueue(int,unsigned int, unsigned int, unsigned short, const char*);
+int processor_setup_workers(unsigned int);
+int processsor_enqueue(int,unsigned int, unsigned int, unsigned short, const char*, trace_span_t*);
+int processor_enqueue_value(int,unsigned int, unsigned int, unsigned short, const char*, char*, unsigned long,
+  trace_span_t*);
+void processor_flow_reset(int);
 
 #endif //PROCESSOR_H
\ No newline at end of file
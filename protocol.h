@@ -0,0 +1,70 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// every frame, request or reply, starts with:
+//   size (4) | cmd or status (2) | id (4)
+// followed by size bytes of payload. replies carry the id of the request.
+#define PROTOCOL_HEADER 10
+
+// flags in the high bits of cmd and status
+#define PROTOCOL_CMD_MASK 0x0fff
+#define PROTOCOL_FLAG_LZ4 0x8000 // GET: the client decodes lz4, reply: the payload is
+                                 // the raw length (4) and an lz4 block
+#define PROTOCOL_FLAG_VERSION 0x4000 // GET: the reply starts with the entry version (8)
+#define PROTOCOL_FLAG_NAMESPACE 0x2000 // request: the payload starts with the namespace (2),
+                                       // the rest is the usual payload. without it, namespace 0
+#define PROTOCOL_FLAG_DEADLINE 0x1000 // request: the payload starts with a timeout in us (4), ahead
+                                      // of the namespace. a request still queued once it passed is
+                                      // answered PROTOCOL_STATUS_TIMEOUT without being run
+
+#define PROTOCOL_CMD_SET 1
+#define PROTOCOL_CMD_GET 2
+#define PROTOCOL_CMD_DEL 3
+#define PROTOCOL_CMD_SCAN 4
+#define PROTOCOL_CMD_ITERATE 5
+#define PROTOCOL_CMD_INCRBY 6
+#define PROTOCOL_CMD_DECRBY 7
+#define PROTOCOL_CMD_APPEND 8
+#define PROTOCOL_CMD_GETRANGE 9
+#define PROTOCOL_CMD_SETRANGE 10
+#define PROTOCOL_CMD_STATS 11
+#define PROTOCOL_CMD_CLASS 12
+#define PROTOCOL_CMD_CAS 13
+#define PROTOCOL_CMD_RESERVE 14
+// 15 is not used, files are imported with -i or ufkvs_import and never named by a client
+#define PROTOCOL_CMD_WATCH 16
+#define PROTOCOL_CMD_UNWATCH 17
+#define PROTOCOL_CMD_TRACE 18
+#define PROTOCOL_CMD_SLOWLOG 19
+
+#define PROTOCOL_STATUS_OK 0
+#define PROTOCOL_STATUS_NOTFOUND 1
+#define PROTOCOL_STATUS_ERROR 2
+#define PROTOCOL_STATUS_UNSUPPORTED 3
+#define PROTOCOL_STATUS_INVALID 4
+#define PROTOCOL_STATUS_BUSY 5 // the server is overloaded, the request was not run
+#define PROTOCOL_STATUS_CONFLICT 6 // CAS saw another version
+#define PROTOCOL_STATUS_EVENT 7 // pushed with id 0 for a WATCH, see watch.h
+#define PROTOCOL_STATUS_TIMEOUT 8 // the deadline of the request passed before it ran
+
+#endif //PROTOCOL_H
@@ -0,0 +1,338 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#define _GNU_SOURCE
+#include "ring.h"
+#include "client.h"
+#include "socket.h"
+#include "epoll.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define RING_EVENTS 64
+#define RING_SETUP_TIMEOUT_MS 1000 // for the setup message of a connected client
+
+// one thread takes setups and watches their connections, the rings themselves are
+// served by the workers like sockets
+typedef struct ring_server
+{
+  int lfd;
+  int pfd; // epoll of the listener and the setup connections
+  int wfd; // worker epoll the request eventfds go to
+  pthread_t thread;
+} ring_server_t;
+
+static ring_server_t rings = {
+  .lfd = -1,
+  .pfd = -1,
+  .wfd = -1
+};
+
+// maps the ring of a setup message on cfd, NULL when it is not one
+static ring_t *ring_open(const int cfd)
+{
+  char byte;
+  char cbuf[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+  const struct timeval timeout = {.tv_sec = RING_SETUP_TIMEOUT_MS / 1000,
+    .tv_usec = RING_SETUP_TIMEOUT_MS % 1000 * 1000};
+  struct stat st;
+  ring_t *r = NULL;
+  int fds[3];
+
+  if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) perror("(ring) setsockopt");
+  if (recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC) != 1) return NULL;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return NULL;
+  if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+  {
+    // whatever came is closed
+    for (size_t ifd = 0; ifd < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++ifd)
+      close(((int*)CMSG_DATA(cmsg))[ifd]);
+    return NULL;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  // an unsealed memfd could be shrunk under the mapping, the server would fault on it
+  const int seals = fcntl(fds[0], F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+  {
+    fprintf(stderr, "(ring) unsealed ring from %d\n", cfd);
+    goto ring_open_error;
+  }
+  if (fstat(fds[0], &st) < 0 || st.st_size < RING_HEADER) goto ring_open_error;
+  if ((r = calloc(1, sizeof(ring_t))) == NULL) goto ring_open_error;
+  r->lmap = st.st_size;
+  if ((r->shm = mmap(NULL, r->lmap, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED)
+  {
+    perror("(ring) mmap");
+    goto ring_open_error;
+  }
+  close(fds[0]);
+  fds[0] = -1;
+
+  r->size = r->shm->size;
+  if (r->shm->magic != RING_MAGIC || r->size < RING_MINSIZE || r->size > RING_MAXSIZE ||
+      (r->size & (r->size - 1)) != 0 || r->lmap < RING_HEADER + 2 * r->size || fds[1] >= CLIENTS)
+  {
+    fprintf(stderr, "(ring) bad ring from %d\n", cfd);
+    munmap(r->shm, r->lmap);
+    goto ring_open_error;
+  }
+  if ((r->wake = fcntl(fds[1], F_DUPFD_CLOEXEC, 0)) < 0)
+  {
+    perror("(ring) fcntl");
+    munmap(r->shm, r->lmap);
+    goto ring_open_error;
+  }
+  r->requests = (char*)r->shm + RING_HEADER;
+  r->replies = r->requests + r->size;
+  r->efd = fds[1];
+  r->rfd = fds[2];
+  r->cfd = cfd;
+  atomic_init(&r->closed, false);
+  atomic_init(&r->refs, 1); // the ring thread's
+  return r;
+
+  ring_open_error:
+  free(r);
+  for (unsigned int ifd = 0; ifd < 3; ++ifd)
+    if (fds[ifd] >= 0) close(fds[ifd]);
+  return NULL;
+}
+
+static void ring_accept(void)
+{
+  const char ok = 0, refused = 1;
+  int cfd;
+
+  while ((cfd = accept4(rings.lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+  {
+    ring_t *r = ring_open(cfd);
+    if (r == NULL || socket_set_nblocking(r->efd) < 0 || client_set_ring(r->efd, r) < 0)
+    {
+      if (r != NULL)
+      {
+        close(r->efd);
+        r->cfd = -1;
+        ring_release(r);
+      }
+      if (send(cfd, &refused, 1, MSG_NOSIGNAL) != 1) perror("(ring) send");
+      close(cfd);
+      continue;
+    }
+    atomic_fetch_add_explicit(&r->refs, 1, memory_order_relaxed); // the client slot's
+
+    // the client slot exists before a worker sees the first signal
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = r};
+    if (epoll_ctl(rings.pfd, EPOLL_CTL_ADD, cfd, &ev) < 0 || epoll_inadd(rings.wfd, r->efd, true) < 0)
+    {
+      perror("(ring) epoll_ctl");
+      epoll_ctl(rings.pfd, EPOLL_CTL_DEL, cfd, NULL);
+      if (send(cfd, &refused, 1, MSG_NOSIGNAL) != 1) perror("(ring) send");
+      const int efd = r->efd;
+      ring_release(r); // nobody watches cfd
+      if (client_clear(efd) < 0) perror("(ring) client_clear");
+      close(efd);
+      continue;
+    }
+
+    printf("(ring) ring of %lu bytes on: %d\n", r->size, r->efd);
+    if (send(cfd, &ok, 1, MSG_NOSIGNAL) != 1) perror("(ring) send");
+  }
+}
+
+static void *ring_thread_fn(void *args)
+{
+  (void)args;
+  struct epoll_event events[RING_EVENTS];
+  int n;
+
+  while ((n = epoll_wait(rings.pfd, events, RING_EVENTS, -1)) >= 0 || errno == EINTR)
+    for (int ie = 0; ie < n; ++ie)
+    {
+      ring_t *r = events[ie].data.ptr;
+      if (r == NULL)
+      {
+        ring_accept();
+        continue;
+      }
+
+      // the client went away or the server closed the ring, see ring_close. the worker
+      // serving it lets go of the client slot on the wakeup, this thread of its watch
+      if (epoll_ctl(rings.pfd, EPOLL_CTL_DEL, r->cfd, NULL) < 0) perror("(ring) epoll_ctl");
+      atomic_store_explicit(&r->closed, true, memory_order_release);
+      ring_wake(r);
+      ring_release(r);
+    }
+
+  perror("(ring) epoll_wait");
+  return NULL;
+}
+
+// takes up to n request bytes
+size_t ring_read(ring_t *r, char *dst, size_t n)
+{
+  const unsigned long tail = atomic_load_explicit(&r->shm->rtail, memory_order_relaxed);
+  const unsigned long head = atomic_load_explicit(&r->shm->rhead, memory_order_acquire);
+  size_t avail = head - tail;
+
+  if (avail > r->size) avail = r->size; // a confused client only hurts itself
+  if (n > avail) n = avail;
+  if (n == 0) return 0;
+
+  const size_t off = tail & (r->size - 1), first = n < r->size - off ? n : r->size - off;
+  memcpy(dst, r->requests + off, first);
+  memcpy(dst + first, r->requests, n - first);
+  atomic_store_explicit(&r->shm->rtail, tail + n, memory_order_release);
+  return n;
+}
+
+size_t ring_pending(const ring_t *r)
+{
+  return atomic_load_explicit(&r->shm->rhead, memory_order_acquire) -
+    atomic_load_explicit(&r->shm->rtail, memory_order_relaxed);
+}
+
+// puts as many of the n reply bytes as there is room for
+size_t ring_write(ring_t *r, const char *src, size_t n)
+{
+  const unsigned long head = atomic_load_explicit(&r->shm->whead, memory_order_relaxed);
+  const unsigned long tail = atomic_load_explicit(&r->shm->wtail, memory_order_acquire);
+  const size_t used = head - tail, room = used < r->size ? r->size - used : 0;
+
+  if (n > room) n = room;
+  if (n == 0) return 0;
+
+  const size_t off = head & (r->size - 1), first = n < r->size - off ? n : r->size - off;
+  memcpy(r->replies + off, src, first);
+  memcpy(r->replies, src + first, n - first);
+  atomic_store_explicit(&r->shm->whead, head + n, memory_order_release);
+  return n;
+}
+
+// asks the client to signal once it took replies, before looking for room again
+void ring_block(ring_t *r)
+{
+  atomic_store(&r->shm->blocked, 1);
+}
+
+// tells the client replies are there
+void ring_signal(const ring_t *r)
+{
+  if (eventfd_write(r->rfd, 1) < 0) perror("(ring) eventfd_write");
+}
+
+// makes the worker serving the ring look at it again. the duplicate is written, efd
+// may be closed already once the client slot let go
+void ring_wake(const ring_t *r)
+{
+  if (eventfd_write(r->wake, 1) < 0) perror("(ring) eventfd_write");
+}
+
+// takes the pending wakeups of the request eventfd
+void ring_ack(const ring_t *r)
+{
+  eventfd_t v;
+  eventfd_read(r->efd, &v);
+}
+
+// the client slot lets go of the ring. the setup connection is shut down so the ring
+// thread sees it and lets go too, the last one frees the ring
+void ring_close(ring_t *r)
+{
+  if (r->cfd >= 0) shutdown(r->cfd, SHUT_RDWR);
+  ring_release(r);
+}
+
+// drops a reference, the last one unmaps the ring and closes everything but the
+// request eventfd, which goes with the client slot
+void ring_release(ring_t *r)
+{
+  if (atomic_fetch_sub_explicit(&r->refs, 1, memory_order_acq_rel) != 1) return;
+  munmap(r->shm, r->lmap);
+  close(r->wake);
+  close(r->rfd);
+  if (r->cfd >= 0) close(r->cfd);
+  free(r);
+}
+
+// listens at path for clients handing rings over, their requests are signalled to
+// the workers of wfd
+int ring_setup(const char *path, const int wfd)
+{
+  struct sockaddr_un addr;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "(ring) path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  rings.wfd = wfd;
+
+  if ((rings.lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("(ring) socket");
+    return -1;
+  }
+  if (socket_unlink_stale(path) < 0) goto ring_setup_error;
+  if (bind(rings.lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    perror("(ring) bind");
+    goto ring_setup_error;
+  }
+  if (listen(rings.lfd, SOMAXCONN) < 0)
+  {
+    perror("(ring) listen");
+    goto ring_setup_error;
+  }
+  if ((rings.pfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || epoll_ctl(rings.pfd, EPOLL_CTL_ADD, rings.lfd, &ev) < 0)
+  {
+    perror("(ring) epoll");
+    goto ring_setup_error;
+  }
+  if (pthread_create(&rings.thread, NULL, ring_thread_fn, NULL) != 0)
+  {
+    perror("(ring) pthread_create");
+    goto ring_setup_error;
+  }
+  return 0;
+
+  ring_setup_error:
+  close(rings.lfd);
+  rings.lfd = -1;
+  return -1;
+}
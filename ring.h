@@ -0,0 +1,80 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// a co-located client can talk to the server through shared memory instead of a
+// socket. it creates a memfd laid out as
+//   ring_shared_t (RING_HEADER) | requests (size) | replies (size)
+// sealed with F_SEAL_SHRINK and F_SEAL_GROW, and two eventfds, connects to the ring path and sends one byte with the memfd,
+// the request eventfd and the reply eventfd (SCM_RIGHTS), and gets one byte back,
+// 0 once the ring is served. both rings carry the usual frames as a byte stream,
+// each with one producer and one consumer. the client writes requests, advances
+// rhead and signals the request eventfd; the server writes replies, advances whead
+// and signals the reply eventfd. closing the setup connection ends the ring.
+#define RING_MAGIC 0x676e6972 // "ring"
+#define RING_HEADER 4096
+#define RING_MINSIZE (64ul * 1024) // of each ring, a power of two
+#define RING_MAXSIZE (64ul << 20)
+
+typedef struct ring_shared
+{
+  unsigned int magic;
+  unsigned int size;
+  // positions are bytes since setup, a ring holds head - tail bytes
+  _Alignas(64) atomic_ulong rhead; // requests written by the client
+  _Alignas(64) atomic_ulong rtail; // requests taken by the server
+  _Alignas(64) atomic_ulong whead; // replies written by the server
+  _Alignas(64) atomic_ulong wtail; // replies taken by the client
+  // the server has replies waiting for room, the client signals the request
+  // eventfd once it took some
+  _Alignas(64) atomic_uint blocked;
+} ring_shared_t;
+
+typedef struct ring
+{
+  ring_shared_t *shm;
+  char *requests, *replies;
+  unsigned long size, lmap;
+  int efd; // request eventfd, the client slot of the ring is keyed by it
+  int wake; // efd duplicated, stays open as long as the ring
+  int rfd; // reply eventfd
+  int cfd; // setup connection
+  atomic_bool closed;
+  atomic_uint refs; // the ring thread watching cfd and the client slot, see ring_release
+} ring_t;
+
+int ring_setup(const char*, int);
+size_t ring_read(ring_t*, char*, size_t);
+size_t ring_pending(const ring_t*);
+size_t ring_write(ring_t*, const char*, size_t);
+void ring_block(ring_t*);
+void ring_signal(const ring_t*);
+void ring_wake(const ring_t*);
+void ring_ack(const ring_t*);
+void ring_close(ring_t*);
+void ring_release(ring_t*);
+
+#endif //RING_H
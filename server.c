@@ -23,6 +23,12 @@
 #include "socket.h"
 #include "client.h"
 #include "processor.h"
+#include "config.h"
+#include "topology.h"
+#include "ufkvs.h"
+#include "handover.h"
+#include "ring.h"
+#include "stats.h"
 
 #if defined (__linux__)
 #include "epoll.h"
@@ -30,55 +36,73 @@
 // TODO
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 static server_t server = {
-  .port = 8080
+  .port = 8080,
+  .ufd  = -1
 };
 
-static void server_connection_handler(void)
+static void server_accept(const int lfd)
 {
   int fd;
-  if ((fd = socket_accept(server.lfd)) < 0)
-  {
-    perror("(server) socket_accept");
-    return;
-  }
 
-  printf("(server) sock on: %d\n", fd);
-#if defined (__linux__)
-  if (epoll_inadd(server.wfd, fd, true) < 0)
+  // the listener is edge triggered, take the whole backlog
+  while ((fd = socket_accept(lfd)) >= 0)
   {
-    perror("(server) epoll_inadd");
-    close(fd);
-    return;
+    printf("(server) sock on: %d\n", fd);
+    // the client must exist before a worker can see its first bytes
+    if(client_set(fd) < 0)
+    {
+      perror("(server) client_set");
+      close(fd);
+      continue;
+    }
+#if defined (__linux__)
+    if (epoll_inadd(server.wfd, fd, true) < 0)
+    {
+      perror("(server) epoll_inadd");
+      if (client_clear(fd) < 0) perror("(server) client_clear");
+      close(fd);
+    }
+#elif defined(__APPLE__)
+#endif
   }
+}
 
-  if (socket_set_nblocking(fd) < 0)
+static void server_connection_handler(void)
+{
+  server_accept(server.lfd);
+}
+
+// a successor takes the listener over, new connections wait for it in the backlog.
+// without stop, it did not make it and the listeners are taken back
+static void server_stop_accepting(const bool stop)
+{
+  if (!stop)
   {
-    if (epoll_delete(server.wfd, fd) < 0) perror("(server) epoll_delete");
-    close(fd);
-    if (client_clear(fd) < 0) perror("(server) client_clear");
+    if (epoll_inadd(server.sfd, server.lfd, false) < 0) perror("(server) epoll_inadd");
+    if (server.ufd >= 0 && epoll_inadd(server.sfd, server.ufd, false) < 0) perror("(server) epoll_inadd");
     return;
   }
-#elif defined(__APPLE__)
-#endif
-  if(client_set(fd) < 0)
-  {
-    perror("(server) client_set");
-    close(fd);
-  }
+  if (epoll_delete(server.sfd, server.lfd) < 0) perror("(server) epoll_delete");
+  if (server.ufd >= 0 && epoll_delete(server.sfd, server.ufd) < 0) perror("(server) epoll_delete");
 }
 
-static void server_output_handler(void)
+static void server_output_handler(int fd)
 {
+  (void)fd;
 }
 
+// the unix listener is the one other descriptor in the set
 static void server_input_handler(int fd)
 {
+  if (fd == server.ufd) server_accept(server.ufd);
 }
 
 static int server_setup_inet(void)
@@ -110,14 +134,106 @@ static int server_setup_inet(void)
   return -1;
 }
 
+// for clients on the same host, next to the tcp listener
+static int server_setup_unix(const char *path)
+{
+  struct sockaddr_un addrs;
+
+  memset(&addrs, 0, sizeof(addrs));
+  addrs.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addrs.sun_path))
+  {
+    fprintf(stderr, "(server) unix socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addrs.sun_path, path);
+
+  if ((server.ufd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+  {
+    perror("(server) socket");
+    return -1;
+  }
+  if (socket_unlink_stale(path) < 0) goto server_lunix_error;
+  if (bind(server.ufd, (struct sockaddr*)&addrs, sizeof(addrs)) < 0)
+  {
+    perror("(server) bind");
+    goto server_lunix_error;
+  }
+  if (listen(server.ufd, SOMAXCONN) < 0)
+  {
+    perror("(server) listen");
+    goto server_lunix_error;
+  }
+
+  return 0;
+
+  server_lunix_error:
+  close(server.ufd);
+  server.ufd = -1;
+  return -1;
+}
+
+// fills the store before anything is served, from --import and then from what a
+// predecessor hands over with its listeners
+static int server_load(const config_t *config)
+{
+  if (config->import != NULL)
+  {
+    unsigned long count = 0;
+    const unsigned long start = stats_now();
+    const int ret = ufkvs_import(server.store, 0, config->import, config->processors, &count);
+    if (ret != 0)
+    {
+      fprintf(stderr, "(server) import of %s failed after %lu keys%s\n", config->import, count,
+        ret == UFKVS_EINVAL ? ", not an import file" : "");
+      return -1;
+    }
+    printf("(server) imported %lu keys from %s in %lu ms\n", count, config->import, (stats_now() - start) / 1000000);
+  }
+  return handover_restore(config->processors, &server.lfd, &server.ufd);
+}
+
 int server_start(void)
 {
+  const config_t *config = config_get();
 
-  if (server_setup_inet() < 0)
+  const ufkvs_options_t options = {
+    .namespaces  = config->namespaces,
+    .ordered     = config->ordered,
+    .compressmin = config->compressmin,
+    .tierfile    = config->tierfile,
+    .tiermemory  = config->tiermemory,
+    .hugepages   = config->hugepages,
+    .prefault    = config->prefault,
+    .defrag      = config->defrag,
+    .affinity    = config->affinity,
+    .cpus        = config->cpus,
+    .workers     = config->workers,
+    .processors  = config->processors
+  };
+  // taken over first, the store goes on with the tier file of the predecessor then
+  int took = 0;
+  if (config->handover != NULL && (took = handover_take(config->handover)) < 0)
+  {
+    perror("(server) handover_take");
+    return -1;
+  }
+  if ((server.store = ufkvs_open(&options)) == NULL)
+  {
+    perror("(server) ufkvs_open");
+    return -1;
+  }
+  if (server_load(config) < 0) return -1;
+  if (took == 0 && server_setup_inet() < 0)
   {
     perror("(server) server_setup_inet");
     return -1;
   }
+  if (config->unixpath != NULL && server.ufd < 0 && server_setup_unix(config->unixpath) < 0)
+  {
+    perror("(server) server_setup_unix");
+    return -1;
+  }
 #if defined (__linux__)
   if ((server.sfd = epoll_new()) < 0)
   {
@@ -131,6 +247,13 @@ int server_start(void)
     close(server.lfd);
     return -1;
   }
+  if (server.ufd >= 0 && epoll_inadd(server.sfd, server.ufd, false) < 0)
+  {
+    perror("(server) sfd epoll_inadd");
+    close(server.sfd);
+    close(server.lfd);
+    return -1;
+  }
 
   if ((server.wfd = epoll_new()) < 0)
   {
@@ -149,7 +272,7 @@ int server_start(void)
     return -1;
   }
 
-  if (processor_setup_workers() < 0)
+  if (processor_setup_workers(config->processors) < 0)
   {
     close(server.wfd);
     close(server.sfd);
@@ -157,12 +280,42 @@ int server_start(void)
     return -1;
   }
 
+  if ((server.workers = calloc(config->workers, sizeof(pthread_t))) == NULL)
+  {
+    perror("(server) calloc");
+    close(server.wfd);
+    close(server.sfd);
+    close(server.lfd);
+    return -1;
+  }
+
   // here is not sfd but a new one we will create
-  if (worker_setup(server.wfd, &server.workers) < 0)
+  if (worker_setup(server.wfd, server.workers, config->workers) < 0)
   {
     // TODO: handle threads must clean and die
   }
 
+  if (config->ring != NULL && ring_setup(config->ring, server.wfd) < 0)
+  {
+    perror("(server) ring_setup");
+    close(server.wfd);
+    close(server.sfd);
+    close(server.lfd);
+    return -1;
+  }
+
+  if (config->handover != NULL &&
+      handover_listen(config->handover, server.lfd, server.ufd, server_stop_accepting) < 0)
+  {
+    perror("(server) handover_listen");
+    close(server.wfd);
+    close(server.sfd);
+    close(server.lfd);
+    return -1;
+  }
+
+  topology_report();
+
   printf("(server) starting mainloop\n");
   if (epoll_loop(
       server.lfd,
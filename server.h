@@ -22,6 +22,7 @@
 #define SERVER_H
 
 #include "worker.h"
+#include "ufkvs.h"
 #include <pthread.h>
 #include <sys/epoll.h>
 #include <stdbool.h>
@@ -29,11 +30,13 @@
 typedef struct server
 {
   int lfd;
+  int ufd; // unix listener, -1 without one
   int sfd;
   int wfd;
   unsigned short port;
   bool die;
-  pthread_t workers[WORKERS];
+  pthread_t *workers;
+  ufkvs_t *store; // the tables requests are served from
 
 } server_t;
 
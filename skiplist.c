@@ -0,0 +1,138 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "skiplist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned char level(skiplist *sl)
+{
+  unsigned char lv = 1;
+
+  // xorshift, callers already serialize writers
+  sl->seed ^= sl->seed << 13;
+  sl->seed ^= sl->seed >> 7;
+  sl->seed ^= sl->seed << 17;
+
+  unsigned long r = sl->seed;
+  while (lv < SKIPLIST_MAXLEVEL && (r & 3) == 0)
+  {
+    lv++;
+    r >>= 2;
+  }
+
+  return lv;
+}
+
+static skiplist_n *node_new(const char *key, const unsigned char lv)
+{
+  skiplist_n *n = malloc(sizeof(skiplist_n) + lv * sizeof(skiplist_n*));
+  if (n == NULL) return NULL;
+
+  n->key = key;
+  n->level = lv;
+  memset(n->next, 0, lv * sizeof(skiplist_n*));
+  return n;
+}
+
+// fills update with the last node before key on every level
+static skiplist_n *find(const skiplist *sl, const char *key, skiplist_n **update)
+{
+  skiplist_n *x = sl->head;
+
+  for (int il = (int)sl->level - 1; il >= 0; --il)
+  {
+    while (x->next[il] != NULL && strcmp(x->next[il]->key, key) < 0) x = x->next[il];
+    if (update != NULL) update[il] = x;
+  }
+
+  return x->next[0];
+}
+
+skiplist *skiplist_new(void)
+{
+  skiplist *sl = malloc(sizeof(skiplist));
+  if (sl == NULL) return NULL;
+
+  if ((sl->head = node_new(NULL, SKIPLIST_MAXLEVEL)) == NULL)
+  {
+    free(sl);
+    return NULL;
+  }
+
+  sl->level = 1;
+  sl->count = 0;
+  sl->bytes = sizeof(skiplist_n) + SKIPLIST_MAXLEVEL * sizeof(skiplist_n*);
+  sl->seed = 0x9e3779b97f4a7c15ul;
+  return sl;
+}
+
+int skiplist_insert(skiplist *sl, const char *key)
+{
+  skiplist_n *update[SKIPLIST_MAXLEVEL];
+  skiplist_n *x = find(sl, key, update);
+
+  if (x != NULL && strcmp(x->key, key) == 0)
+  {
+    x->key = key;
+    return 0;
+  }
+
+  const unsigned char lv = level(sl);
+  if ((x = node_new(key, lv)) == NULL) return -1;
+
+  for (unsigned int il = sl->level; il < lv; ++il) update[il] = sl->head;
+  if (lv > sl->level) sl->level = lv;
+
+  for (unsigned int il = 0; il < lv; ++il)
+  {
+    x->next[il] = update[il]->next[il];
+    update[il]->next[il] = x;
+  }
+
+  sl->count++;
+  sl->bytes += sizeof(skiplist_n) + lv * sizeof(skiplist_n*);
+  return 0;
+}
+
+int skiplist_remove(skiplist *sl, const char *key)
+{
+  skiplist_n *update[SKIPLIST_MAXLEVEL];
+  skiplist_n *x = find(sl, key, update);
+
+  if (x == NULL || strcmp(x->key, key) != 0) return -1;
+
+  for (unsigned int il = 0; il < x->level; ++il)
+    if (update[il]->next[il] == x) update[il]->next[il] = x->next[il];
+  while (sl->level > 1 && sl->head->next[sl->level - 1] == NULL) sl->level--;
+
+  sl->count--;
+  sl->bytes -= sizeof(skiplist_n) + x->level * sizeof(skiplist_n*);
+  free(x);
+  return 0;
+}
+
+// first node whose key is >= key
+const skiplist_n *skiplist_seek(const skiplist *sl, const char *key)
+{
+  if (key == NULL) return sl->head->next[0];
+  return find(sl, key, NULL);
+}
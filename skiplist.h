@@ -0,0 +1,49 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#define SKIPLIST_MAXLEVEL 24
+
+// nodes borrow the key of the table entry they index, so a node costs
+// one pointer plus ~1.33 forward pointers on average (p = 1/4).
+typedef struct skiplist_n
+{
+  const char *key;
+  unsigned char level;
+  struct skiplist_n *next[];
+} skiplist_n;
+
+typedef struct skiplist
+{
+  unsigned int level;
+  unsigned long count;
+  unsigned long bytes;
+  unsigned long seed;
+  skiplist_n *head;
+} skiplist;
+
+skiplist *skiplist_new(void);
+int skiplist_insert(skiplist*, const char*);
+int skiplist_remove(skiplist*, const char*);
+const skiplist_n *skiplist_seek(const skiplist*, const char*);
+
+#endif //SKIPLIST_H
@@ -0,0 +1,128 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "slowlog.h"
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+typedef struct slowlog
+{
+  pthread_mutex_t mtx;
+  unsigned long threshold; // ns, 0 logs no requests
+  unsigned long serial; // entries ever logged, the newest is at serial - 1
+  slowlog_entry_t entries[SLOWLOG_ENTRIES];
+} slowlog_t;
+
+static slowlog_t slowlog = {
+  .mtx = PTHREAD_MUTEX_INITIALIZER,
+  .threshold = 0,
+  .serial = 0
+};
+
+// requests from threshold ns on are logged, 0 logs none
+void slowlog_setup(const unsigned long threshold)
+{
+  slowlog.threshold = threshold;
+}
+
+unsigned long slowlog_threshold(void)
+{
+  return slowlog.threshold;
+}
+
+static unsigned long slowlog_clock(void)
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME, &ts) < 0) return 0;
+  return (unsigned long)ts.tv_sec * 1000000ul + (unsigned long)ts.tv_nsec / 1000ul;
+}
+
+static void slowlog_add(const slowlog_entry_t *e)
+{
+  pthread_mutex_lock(&slowlog.mtx);
+  slowlog_entry_t *slot = &slowlog.entries[slowlog.serial % SLOWLOG_ENTRIES];
+  *slot = *e;
+  slot->serial = slowlog.serial++;
+  pthread_mutex_unlock(&slowlog.mtx);
+}
+
+// a request of cmd on namespace ns that took wait + lock + exec ns, key may be NULL
+void slowlog_request(const unsigned short cmd, const unsigned int ns, const char *key, const unsigned int lkey,
+  const unsigned long size, const unsigned long wait, const unsigned long lock, const unsigned long exec)
+{
+  slowlog_entry_t e = {.when = slowlog_clock(), .kind = SLOWLOG_REQUEST, .cmd = cmd, .ns = ns, .size = size,
+    .wait = wait, .lock = lock, .exec = exec, .lkey = key != NULL ? lkey : 0};
+  if (key != NULL) memcpy(e.key, key, lkey < SLOWLOG_KEY ? lkey : SLOWLOG_KEY);
+  slowlog_add(&e);
+}
+
+// the table of namespace ns grew from buckets to nbuckets holding entries, in took ns
+void slowlog_resize(const unsigned int ns, const unsigned long entries, const unsigned long buckets,
+  const unsigned long nbuckets, const unsigned long took)
+{
+  const slowlog_entry_t e = {.when = slowlog_clock(), .kind = SLOWLOG_RESIZE, .ns = ns, .size = entries,
+    .wait = buckets, .lock = nbuckets, .exec = took};
+  slowlog_add(&e);
+}
+
+static void slowlog_key(FILE *f, const slowlog_entry_t *e)
+{
+  const unsigned int n = e->lkey < SLOWLOG_KEY ? e->lkey : SLOWLOG_KEY;
+  for (unsigned int ic = 0; ic < n; ++ic)
+  {
+    const unsigned char c = (unsigned char)e->key[ic];
+    if (c > ' ' && c < 0x7f && c != '\\') fputc(c, f);
+    else fprintf(f, "\\x%02x", c);
+  }
+  if (e->lkey > SLOWLOG_KEY) fputs("...", f);
+}
+
+// one line per entry, newest first, at most count of them, 0 for all
+void slowlog_report(FILE *f, const unsigned int count)
+{
+  pthread_mutex_lock(&slowlog.mtx);
+  const unsigned long kept = slowlog.serial < SLOWLOG_ENTRIES ? slowlog.serial : SLOWLOG_ENTRIES;
+  const unsigned long n = count > 0 && count < kept ? count : kept;
+
+  for (unsigned long ie = 0; ie < n; ++ie)
+  {
+    const slowlog_entry_t *e = &slowlog.entries[(slowlog.serial - 1 - ie) % SLOWLOG_ENTRIES];
+    fprintf(f, "id:%lu time:%lu ", e->serial, e->when);
+    if (e->kind == SLOWLOG_RESIZE)
+    {
+      fprintf(f, "resize ns:%u entries:%lu buckets:%lu->%lu took_ns:%lu\n", e->ns, e->size, e->wait, e->lock,
+        e->exec);
+      continue;
+    }
+    fprintf(f, "request cmd:%u ns:%u key:", e->cmd, e->ns);
+    slowlog_key(f, e);
+    fprintf(f, " lkey:%u size:%lu wait_ns:%lu lock_ns:%lu exec_ns:%lu\n", e->lkey, e->size, e->wait, e->lock,
+      e->exec);
+  }
+  pthread_mutex_unlock(&slowlog.mtx);
+}
+
+void slowlog_reset(void)
+{
+  pthread_mutex_lock(&slowlog.mtx);
+  slowlog.serial = 0;
+  pthread_mutex_unlock(&slowlog.mtx);
+}
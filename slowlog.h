@@ -0,0 +1,61 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdio.h>
+
+// the newest requests that took longer than a threshold, queue wait included, and
+// every table resize, as the stalls those cause are what slow requests often wait on
+#define SLOWLOG_ENTRIES 1024 // kept, the oldest go first
+#define SLOWLOG_KEY 32 // bytes of the key kept
+
+#define SLOWLOG_REQUEST 0
+#define SLOWLOG_RESIZE 1
+
+// SLOWLOG request payload: op (1) | count (4), count only for GET and optional
+#define SLOWLOG_GET 0
+#define SLOWLOG_RESET 1
+
+typedef struct slowlog_entry
+{
+  unsigned long serial;
+  unsigned long when; // us since the epoch
+  unsigned char kind;
+  unsigned short cmd;
+  unsigned int ns; // namespace
+  unsigned int lkey; // of the whole key, SLOWLOG_KEY bytes of it are in key
+  char key[SLOWLOG_KEY];
+  unsigned long size; // of the request, or entries of a resized table
+  unsigned long wait; // ns queued, or buckets before a resize
+  unsigned long lock; // ns waiting for table locks, or buckets after a resize
+  unsigned long exec; // ns running besides, or spent resizing
+} slowlog_entry_t;
+
+void slowlog_setup(unsigned long);
+unsigned long slowlog_threshold(void);
+void slowlog_request(unsigned short, unsigned int, const char*, unsigned int, unsigned long, unsigned long,
+  unsigned long, unsigned long);
+void slowlog_resize(unsigned int, unsigned long, unsigned long, unsigned long, unsigned long);
+void slowlog_report(FILE*, unsigned int);
+void slowlog_reset(void);
+
+#endif //SLOWLOG_H
@@ -22,9 +22,13 @@
 #define SOCKET_H
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 static inline int socket_set_nblocking(const int fd)
 {
@@ -40,6 +44,32 @@ static inline int socket_set_nblocking(const int fd)
   return -1;
 }
 
+// clears path for a unix socket to be bound there. only a socket left by an earlier
+// server is removed, anything else stays and is refused so a mistyped path costs no file
+static inline int socket_unlink_stale(const char *path)
+{
+  struct stat st;
+
+  if (lstat(path, &st) < 0)
+  {
+    if (errno == ENOENT) return 0;
+    perror("(socket) lstat");
+    return -1;
+  }
+  if (!S_ISSOCK(st.st_mode))
+  {
+    fprintf(stderr, "(socket) %s exists and is not a socket, not replacing it\n", path);
+    errno = EEXIST;
+    return -1;
+  }
+  if (unlink(path) < 0)
+  {
+    perror("(socket) unlink");
+    return -1;
+  }
+  return 0;
+}
+
 static inline int socket_new()
 {
   int listenfd, flags;
@@ -67,6 +97,7 @@ static inline int socket_accept(const int fd)
 
   if ((confd = accept(fd, (struct sockaddr*)&addr, &laddr)) < 0)
   {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
     perror("(socket) accept");
     close(confd); //??
     return -1;
@@ -81,6 +112,14 @@ static inline int socket_accept(const int fd)
     return -1;
   }
 
+  // queued replies go out gathered in one sendmsg already, nagle would hold the tail of
+  // a pipelined batch back until the client's delayed ack
+  if (addr.sa_family == AF_INET)
+  {
+    const int one = 1;
+    if (setsockopt(confd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) perror("(socket) setsockopt");
+  }
+
   return confd;
 }
 
@@ -0,0 +1,107 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "stats.h"
+#include <stdatomic.h>
+#include <time.h>
+
+static atomic_ulong counters[STATS_COUNTERS];
+
+static const char *names[STATS_COUNTERS] = {
+  [STATS_COMPRESS_VALUES]   = "compress_values",
+  [STATS_COMPRESS_SKIPPED]  = "compress_skipped",
+  [STATS_COMPRESS_IN]       = "compress_in_bytes",
+  [STATS_COMPRESS_OUT]      = "compress_out_bytes",
+  [STATS_COMPRESS_NS]       = "compress_cpu_ns",
+  [STATS_DECOMPRESS_VALUES] = "decompress_values",
+  [STATS_DECOMPRESS_NS]     = "decompress_cpu_ns",
+  [STATS_BUSY]              = "busy_replies",
+  [STATS_PAUSED]            = "paused_reads",
+  [STATS_WAIT_HIGH_COUNT]   = "wait_high_requests",
+  [STATS_WAIT_HIGH_NS]      = "wait_high_ns",
+  [STATS_WAIT_HIGH_MAX]     = "wait_high_max_ns",
+  [STATS_WAIT_NORMAL_COUNT] = "wait_normal_requests",
+  [STATS_WAIT_NORMAL_NS]    = "wait_normal_ns",
+  [STATS_WAIT_NORMAL_MAX]   = "wait_normal_max_ns",
+  [STATS_CACHE_HITS]        = "read_cache_hits",
+  [STATS_CACHE_MISSES]      = "read_cache_misses",
+  [STATS_TIER_EVICTED]      = "tier_evicted",
+  [STATS_TIER_READS]        = "tier_reads",
+  [STATS_TIER_LOADS]        = "tier_loads",
+  [STATS_TIER_COMPACTIONS]  = "tier_compactions",
+  [STATS_DEFRAG_PASSES]     = "defrag_passes",
+  [STATS_DEFRAG_MOVED]      = "defrag_moved",
+  [STATS_DEFRAG_NS]         = "defrag_cpu_ns",
+  [STATS_WATCH_EVENTS]      = "watch_events",
+  [STATS_WATCH_COALESCED]   = "watch_coalesced",
+  [STATS_WATCH_PUSHED]      = "watch_pushed",
+  [STATS_WATCH_DROPPED]     = "watch_dropped",
+  [STATS_SHED_REQUESTS]     = "shed_requests",
+  [STATS_SHED_BYTES]        = "shed_bytes",
+  [STATS_SHED_WAIT_NS]      = "shed_wait_ns"
+};
+
+void stats_add(const unsigned int counter, const unsigned long v)
+{
+  if (counter < STATS_COUNTERS) atomic_fetch_add_explicit(&counters[counter], v, memory_order_relaxed);
+}
+
+void stats_max(const unsigned int counter, const unsigned long v)
+{
+  if (counter >= STATS_COUNTERS) return;
+
+  unsigned long cur = atomic_load_explicit(&counters[counter], memory_order_relaxed);
+  while (cur < v && !atomic_compare_exchange_weak_explicit(&counters[counter], &cur, v, memory_order_relaxed,
+    memory_order_relaxed));
+}
+
+unsigned long stats_get(const unsigned int counter)
+{
+  if (counter >= STATS_COUNTERS) return 0;
+  return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+// cpu time of the calling thread in ns, for charging work to a counter
+unsigned long stats_cputime(void)
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+  return (unsigned long)ts.tv_sec * 1000000000ul + (unsigned long)ts.tv_nsec;
+}
+
+unsigned long stats_now(void)
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+  return (unsigned long)ts.tv_sec * 1000000000ul + (unsigned long)ts.tv_nsec;
+}
+
+// one "name:value" line per counter
+void stats_report(FILE *f)
+{
+  for (unsigned int ic = 0; ic < STATS_COUNTERS; ++ic) fprintf(f, "%s:%lu\n", names[ic], stats_get(ic));
+
+  const unsigned long in = stats_get(STATS_COMPRESS_IN), out = stats_get(STATS_COMPRESS_OUT);
+  fprintf(f, "compress_ratio:%.2f\n", out > 0 ? (double)in / (double)out : 0.0);
+
+  const unsigned long nh = stats_get(STATS_WAIT_HIGH_COUNT), nn = stats_get(STATS_WAIT_NORMAL_COUNT);
+  fprintf(f, "wait_high_avg_ns:%lu\n", nh > 0 ? stats_get(STATS_WAIT_HIGH_NS) / nh : 0);
+  fprintf(f, "wait_normal_avg_ns:%lu\n", nn > 0 ? stats_get(STATS_WAIT_NORMAL_NS) / nn : 0);
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#define STATS_COMPRESS_VALUES 0
+#define STATS_COMPRESS_SKIPPED 1
+#define STATS_COMPRESS_IN 2
+#define STATS_COMPRESS_OUT 3
+#define STATS_COMPRESS_NS 4
+#define STATS_DECOMPRESS_VALUES 5
+#define STATS_DECOMPRESS_NS 6
+#define STATS_BUSY 7
+#define STATS_PAUSED 8
+// count, total ns and max ns per class, in this order
+#define STATS_WAIT_HIGH_COUNT 9
+#define STATS_WAIT_HIGH_NS 10
+#define STATS_WAIT_HIGH_MAX 11
+#define STATS_WAIT_NORMAL_COUNT 12
+#define STATS_WAIT_NORMAL_NS 13
+#define STATS_WAIT_NORMAL_MAX 14
+#define STATS_CACHE_HITS 15
+#define STATS_CACHE_MISSES 16
+#define STATS_TIER_EVICTED 17
+#define STATS_TIER_READS 18
+#define STATS_TIER_LOADS 19
+#define STATS_TIER_COMPACTIONS 20
+#define STATS_DEFRAG_PASSES 21
+#define STATS_DEFRAG_MOVED 22
+#define STATS_DEFRAG_NS 23
+#define STATS_WATCH_EVENTS 24
+#define STATS_WATCH_COALESCED 25
+#define STATS_WATCH_PUSHED 26
+#define STATS_WATCH_DROPPED 27
+#define STATS_SHED_REQUESTS 28 // dropped past their deadline
+#define STATS_SHED_BYTES 29
+#define STATS_SHED_WAIT_NS 30 // they spent queued
+#define STATS_COUNTERS 31
+
+void stats_add(unsigned int, unsigned long);
+unsigned long stats_get(unsigned int);
+void stats_max(unsigned int, unsigned long);
+unsigned long stats_cputime(void);
+unsigned long stats_now(void);
+void stats_report(FILE*);
+
+#endif //STATS_H
@@ -20,26 +20,70 @@
 // OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "table.h"
+#include "topology.h"
+#include "compress.h"
+#include "stats.h"
+#include "tier.h"
+#include "arena.h"
+#include "import.h"
+#include "slowlog.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 #define INIT_TABLE_SIZE 4096
-#define F_INCR 3
+#define F_GROW 2 // ltable stays a power of two, ITERATE's cursor relies on it
 #define F_THRS 0.65
 
-static table table_default = {
-  .ltable = 0,
-  .ctable = 0,
-  .thrs = 0
-};
+static table *namespaces[TABLE_NAMESPACES];
+static unsigned int nnamespaces = 0;
+static _Thread_local unsigned long lockwait; // ns in all, see table_lockwait
 
 static unsigned int hash(unsigned int, const char*);
-static int resize();
-static table_s *colision(unsigned int);
-static int colision_add(table_s*, unsigned int, unsigned long, const char*, const char*);
-static int add(bool, unsigned int, unsigned long, char*, char*);
+static int resize(table*);
+static table_s *colision(table*, unsigned int, const char*);
+static int colision_add(table*, table_s*, unsigned long, const char*);
+static int add(table*, unsigned int, unsigned long, const char*, const char*);
+
+// the lock of t, contended waits are clocked into the calling thread's lockwait
+static int rdlock(table *t)
+{
+  if (pthread_rwlock_tryrdlock(&t->rwl) == 0) return 0;
+
+  const unsigned long start = stats_now();
+  const int ret = pthread_rwlock_rdlock(&t->rwl);
+  lockwait += stats_now() - start;
+  return ret;
+}
+
+// a frozen table is not written any more, the lock is given back and -1 returned
+static int wrlock(table *t)
+{
+  int ret = 0;
+
+  if (pthread_rwlock_trywrlock(&t->rwl) != 0)
+  {
+    const unsigned long start = stats_now();
+    ret = pthread_rwlock_wrlock(&t->rwl);
+    lockwait += stats_now() - start;
+  }
+  if (ret == 0 && t->frozen)
+  {
+    pthread_rwlock_unlock(&t->rwl);
+    return -1;
+  }
+  return ret;
+}
+
+// ns the calling thread ever waited for table locks, callers take differences
+unsigned long table_lockwait(void)
+{
+  return lockwait;
+}
 
 static unsigned int hash(const unsigned int ltable, const char* key)
 {
@@ -50,131 +94,453 @@ static unsigned int hash(const unsigned int ltable, const char* key)
     h *= 16777619u;
   }
 
-  return h % ltable;
+  return h & (ltable - 1);
 }
 
-static int resize()
+// moves the entries to an array of ltable buckets, the write lock must be held
+static int rehash(table *t, const unsigned long ltable)
 {
-  if (!table_default.init) return -1;
-  unsigned long oltable = table_default.ltable;
-  table_s **os = table_default.s;
+  if (!t->init || ltable > TABLE_MAXBUCKETS) return -1;
+  const unsigned long start = stats_now();
+  unsigned long oltable = t->ltable;
+  table_s **os = t->s;
 
-  table_default.ltable += F_INCR;
-  table_default.thrs = table_default.ltable * F_THRS;
-  table_default.s = calloc(table_default.ltable, sizeof(table_s*));
-  table_default.ctable = 0;
+  table_s **ns = topology_alloc(ltable * sizeof(table_s*), TOPOLOGY_ROLE_PROCESSOR);
+  if (ns == NULL) return -1;
 
-  for (unsigned int i = 0; i < oltable; i++)
+  t->ltable = ltable;
+  t->thrs = t->ltable * F_THRS;
+  t->s = ns;
+
+  // entries are relinked rather than copied, the ordered index points at their keys
+  for (unsigned long i = 0; i < oltable; i++)
   {
     table_s *s = os[i];
     while (s != NULL)
     {
-      if (add(true, s->lkey, s->lvalue, s->key, s->value) != 0) return -1;
       table_s *tso = s->next;
-      free(s);
+      const unsigned int h = hash(t->ltable, s->key);
+      s->next = ns[h];
+      ns[h] = s;
       s = tso;
     }
   }
+  topology_free(os, oltable * sizeof(table_s*));
+  const unsigned long took = stats_now() - start;
+  atomic_fetch_add_explicit(&t->resizes, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&t->resize_ns, took, memory_order_relaxed);
+  slowlog_resize(t->id, t->ctable, oltable, ltable, took);
   return 0;
 }
 
-static table_s *colision(const unsigned int h)
+static int resize(table *t)
+{
+  return rehash(t, t->ltable * F_GROW);
+}
+
+static table_s *colision(table *t, const unsigned int h, const char *key)
+{
+  if (!t->init) return NULL;
+  for (table_s *ts = t->s[h]; ts != NULL; ts = ts->next)
+    if (strcmp(ts->key, key) == 0) return ts;
+  return NULL;
+}
+
+// raw values live in refcounted blobs so readers can borrow them past the lock,
+// writers copy a blob that is still borrowed instead of editing it in place
+typedef struct table_blob
+{
+  atomic_uint refs;
+  unsigned long size; // counted in owner->resident
+  table *owner; // NULL until a table adopts it
+  char data[];
+} table_blob;
+
+#define BLOB(v) ((table_blob*)((char*)(v) - offsetof(table_blob, data)))
+#define HASBLOB(ts) ((ts)->enc == TABLE_ENC_RAW || (ts)->enc == TABLE_ENC_LZ4)
+
+static char *blob_new(table *t, const unsigned long size)
+{
+  table_blob *b = arena_alloc(sizeof(table_blob) + size);
+  if (b == NULL) return NULL;
+  atomic_init(&b->refs, 1);
+  b->size = size;
+  b->owner = t;
+  if (t != NULL) atomic_fetch_add_explicit(&t->resident, size, memory_order_relaxed);
+  return b->data;
+}
+
+static void blob_unref(const char *v)
 {
-  if (!table_default.init) return NULL;
-  return table_default.s[h];
+  table_blob *b = BLOB(v);
+  if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1) return;
+  if (b->owner != NULL) atomic_fetch_sub_explicit(&b->owner->resident, b->size, memory_order_relaxed);
+  arena_free(b, sizeof(table_blob) + b->size);
 }
 
-static int colision_add(table_s *ts, const unsigned int lkey, const unsigned long lvalue, const char *key, const char *value)
+// counts a blob from table_alloc against the table taking it over
+static void blob_own(table *t, const char *v)
 {
-  if (!table_default.init || ts == NULL) return -1;
-  while(ts != NULL)
+  table_blob *b = BLOB(v);
+  if (b->owner != NULL) return;
+  b->owner = t;
+  atomic_fetch_add_explicit(&t->resident, b->size, memory_order_relaxed);
+}
+
+// lets go of the value of ts, in memory or in the tier
+static void drop(table_s *ts)
+{
+  if (HASBLOB(ts)) blob_unref(ts->value);
+  else if (ts->enc == TABLE_ENC_TIER) tier_forget(ts->lkey, ts->cvalue);
+}
+
+// brings a value back from the tier for a writer, the write lock must be held
+static int fetch(table *t, table_s *ts)
+{
+  unsigned char enc;
+  char *nv;
+
+  if (ts->enc != TABLE_ENC_TIER) return 0;
+  if ((nv = blob_new(t, ts->cvalue > 0 ? ts->cvalue : 1)) == NULL) return -1;
+  if (tier_read(ts->loc, ts->key, ts->lkey, ts->cvalue, nv, &enc) != 0)
   {
-    if (strcmp(ts->key, key) == 0)
-    {
-      char *ov = ts->value;
-      ts->value = malloc(lvalue);
-      if (ts->value == NULL)
-      {
-        ts->value = ov;
-        return -1;
-      }
-      free(ov);
-      ts->lvalue = lvalue;
-      ts->value = strdup(value);
-      return 0;
-    }
+    blob_unref(nv);
+    return -1;
+  }
+
+  tier_forget(ts->lkey, ts->cvalue);
+  ts->enc = enc;
+  ts->value = nv;
+  return 0;
+}
 
-    if (ts->next == NULL) break;
-    ts = ts->next;
+static bool blob_shared(const char *v)
+{
+  return atomic_load_explicit(&BLOB(v)->refs, memory_order_acquire) > 1;
+}
+
+// canonical decimal int64s ("12", "-7", not "012" or "+1") get the native encoding
+static bool toint(const unsigned long lvalue, const char *value, long long *out)
+{
+  char in[TABLE_INTLEN], buf[TABLE_INTLEN], *end;
+
+  if (lvalue == 0 || lvalue >= TABLE_INTLEN) return false;
+  memcpy(in, value, lvalue);
+  in[lvalue] = '\0';
+
+  errno = 0;
+  const long long v = strtoll(in, &end, 10);
+  if (errno != 0 || end != in + lvalue) return false;
+  if ((unsigned long)snprintf(buf, sizeof(buf), "%lld", v) != lvalue || memcmp(buf, in, lvalue) != 0) return false;
+
+  *out = v;
+  return true;
+}
+
+// stores value into ts, only replacing the previous value once the new one is in place
+static int store(table *t, table_s *ts, const unsigned long lvalue, const char *value)
+{
+  long long iv;
+
+  if (toint(lvalue, value, &iv))
+  {
+    drop(ts);
+    ts->enc = TABLE_ENC_INT;
+    ts->ival = iv;
+    ts->lvalue = lvalue;
+    ts->cvalue = 0;
+    return 0;
   }
 
-  table_s *tsn = malloc(sizeof(table_s));
-  tsn->key = strdup(key);
-  tsn->value = strdup(value);
-  tsn->lkey = lkey;
-  tsn->lvalue = lvalue;
-  tsn->next = NULL;
-  if (ts == NULL)
+  // overwrite in place when the current buffer fits without wasting half of it
+  if (ts->enc == TABLE_ENC_RAW && lvalue <= ts->cvalue && ts->cvalue <= lvalue * 2 + TABLE_MINCAP &&
+      !blob_shared(ts->value))
   {
-    free(tsn);
-    return -1;
+    memcpy(ts->value, value, lvalue);
+    ts->lvalue = lvalue;
+    return 0;
   }
-  ts->next = tsn;
 
+  const unsigned long cvalue = lvalue > 0 ? lvalue : 1;
+  char *nv = blob_new(t, cvalue);
+  if (nv == NULL) return -1;
+  memcpy(nv, value, lvalue);
+
+  drop(ts);
+  ts->enc = TABLE_ENC_RAW;
+  ts->value = nv;
+  ts->lvalue = lvalue;
+  ts->cvalue = cvalue;
   return 0;
 }
 
-static int add(const bool slock, const unsigned int lkey, const unsigned long lvalue, char *key, char *value)
+// lz4 values are stored as the raw length (4) followed by the block
+static int decode(const char *stored, const unsigned long lstored, char *dst, const unsigned long lvalue)
 {
-  table_s *ts;
-  int ret = -1;
+  const unsigned long t = stats_cputime();
+  const long ret = decompress_lz4(stored + 4, lstored - 4, dst, lvalue);
+
+  stats_add(STATS_DECOMPRESS_VALUES, 1);
+  stats_add(STATS_DECOMPRESS_NS, stats_cputime() - t);
+  if (ret < 0)
+  {
+    fprintf(stderr, "(table) corrupt lz4 value\n");
+    return -1;
+  }
+  return 0;
+}
+
+// a compressed blob for value when compression is on, it is large enough and it
+// saves at least an eighth, NULL to store it as is
+static char *encode(table *t, const char *value, const unsigned long lvalue, unsigned long *lstored)
+{
+  if (t->compressmin == 0 || lvalue < t->compressmin || lvalue < TABLE_MINCOMPRESS) return NULL;
+
+  const unsigned long cap = lvalue - lvalue / 8;
+  char *tmp = malloc(cap);
+  if (tmp == NULL) return NULL;
+
+  const unsigned long start = stats_cputime();
+  const size_t z = compress_lz4(value, lvalue, tmp, cap - 4);
+  stats_add(STATS_COMPRESS_NS, stats_cputime() - start);
+  if (z == 0)
+  {
+    stats_add(STATS_COMPRESS_SKIPPED, 1);
+    free(tmp);
+    return NULL;
+  }
+
+  char *blob = blob_new(t, 4 + z);
+  if (blob != NULL)
+  {
+    const unsigned int l32 = lvalue;
+    memcpy(blob, &l32, 4);
+    memcpy(blob + 4, tmp, z);
+    *lstored = 4 + z;
+    stats_add(STATS_COMPRESS_VALUES, 1);
+    stats_add(STATS_COMPRESS_IN, lvalue);
+    stats_add(STATS_COMPRESS_OUT, 4 + z);
+  }
+  free(tmp);
+  return blob;
+}
+
+// turns an integer or compressed entry back into plain bytes so it can be edited
+static int toraw(table *t, table_s *ts)
+{
+  char buf[TABLE_INTLEN], *nv;
+
+  if (fetch(t, ts) != 0) return -1;
+  if (ts->enc == TABLE_ENC_RAW) return 0;
 
-  if (!table_default.init) return ret;
-  if (table_default.ctable >= table_default.thrs)
+  if (ts->enc == TABLE_ENC_LZ4)
   {
-    if (pthread_rwlock_rdlock(&table_default.rwl) != 0) return ret;
-    if (resize() != 0)
+    if ((nv = blob_new(t, ts->lvalue)) == NULL) return -1;
+    if (decode(ts->value, ts->cvalue, nv, ts->lvalue) != 0)
     {
-      perror("add resize table");
-      exit(1);
+      blob_unref(nv);
+      return -1;
     }
-    if (pthread_rwlock_unlock(&table_default.rwl) != 0)
+    blob_unref(ts->value);
+    ts->enc = TABLE_ENC_RAW;
+    ts->value = nv;
+    ts->cvalue = ts->lvalue;
+    return 0;
+  }
+
+  const int lvalue = snprintf(buf, sizeof(buf), "%lld", ts->ival);
+  if ((nv = blob_new(t, lvalue)) == NULL) return -1;
+  memcpy(nv, buf, lvalue);
+
+  ts->enc = TABLE_ENC_RAW;
+  ts->value = nv;
+  ts->lvalue = lvalue;
+  ts->cvalue = lvalue;
+  return 0;
+}
+
+// grows the value buffer to hold size bytes, doubling the capacity so a run of
+// appends costs amortized O(1) allocations
+static int reserve(table_s *ts, const unsigned long size)
+{
+  if (size <= ts->cvalue) return 0;
+
+  unsigned long cvalue = ts->cvalue > TABLE_MINCAP ? ts->cvalue : TABLE_MINCAP;
+  while (cvalue < size) cvalue *= 2;
+
+  if (blob_shared(ts->value))
+  {
+    char *nv = blob_new(BLOB(ts->value)->owner, cvalue);
+    if (nv == NULL) return -1;
+    memcpy(nv, ts->value, ts->lvalue);
+    blob_unref(ts->value);
+    ts->value = nv;
+    ts->cvalue = cvalue;
+    return 0;
+  }
+
+  table_blob *ob = BLOB(ts->value);
+  table_blob *nb = arena_realloc(ob, sizeof(table_blob) + ob->size, sizeof(table_blob) + cvalue);
+  if (nb == NULL) return -1;
+  atomic_fetch_add_explicit(&nb->owner->resident, cvalue - nb->size, memory_order_relaxed);
+  nb->size = cvalue;
+  ts->value = nb->data;
+  ts->cvalue = cvalue;
+  return 0;
+}
+
+// gives ts a private copy of its value when a reader still holds the current one
+static int unshare(table *t, table_s *ts)
+{
+  if (!blob_shared(ts->value)) return 0;
+
+  char *nv = blob_new(t, ts->cvalue);
+  if (nv == NULL) return -1;
+  memcpy(nv, ts->value, ts->lvalue);
+  blob_unref(ts->value);
+  ts->value = nv;
+  return 0;
+}
+
+// writes ldata bytes at offset, zero filling any gap past the current end
+static int splice(table *t, table_s *ts, const unsigned long offset, const unsigned long ldata, const char *data)
+{
+  if (offset > TABLE_MAXVALUE || ldata > TABLE_MAXVALUE - offset) return TABLE_EINVAL;
+  if (toraw(t, ts) != 0) return -1;
+
+  const unsigned long end = offset + ldata;
+  if (reserve(ts, end) != 0 || unshare(t, ts) != 0) return -1;
+
+  if (offset > ts->lvalue) memset(ts->value + ts->lvalue, 0, offset - ts->lvalue);
+  memcpy(ts->value + offset, data, ldata);
+  if (end > ts->lvalue) ts->lvalue = end;
+  return 0;
+}
+
+static int colision_add(table *t, table_s *ts, const unsigned long lvalue, const char *value)
+{
+  if (!t->init || ts == NULL) return -1;
+  return store(t, ts, lvalue, value);
+}
+
+// an entry without a value for a key of lkey bytes, entries and keys live in the arena
+static table_s *entry_new(const unsigned int lkey)
+{
+  table_s *ts;
+
+  if ((ts = arena_alloc(sizeof(table_s))) == NULL) return NULL;
+  if ((ts->key = arena_alloc(lkey + 1)) == NULL)
+  {
+    arena_free(ts, sizeof(table_s));
+    return NULL;
+  }
+  ts->lkey = lkey;
+  ts->enc = TABLE_ENC_INT; // nothing to free yet
+  ts->cvalue = 0;
+  ts->version = 0;
+  ts->next = NULL;
+  atomic_init(&ts->ref, 0);
+  return ts;
+}
+
+// frees an entry and its key, the value must be dropped already
+static void entry_free(table_s *ts)
+{
+  arena_free(ts->key, ts->lkey + 1);
+  arena_free(ts, sizeof(table_s));
+}
+
+// keeps a copy of key for table_tracked, the write lock must be held
+static void track(table *t, const char *key, const unsigned int lkey)
+{
+  char *copy;
+
+  if (t->ltracked == t->ctracked)
+  {
+    const unsigned long cap = t->ctracked > 0 ? t->ctracked * 2 : 1024;
+    char **ntracked = realloc(t->tracked, cap * sizeof(char*));
+    if (ntracked == NULL)
     {
-      perror("add resize table unlock");
-      exit(1);
+      t->lost = true;
+      return;
     }
+    t->tracked = ntracked;
+    t->ctracked = cap;
+  }
+  if ((copy = malloc(lkey + 1)) == NULL)
+  {
+    t->lost = true;
+    return;
   }
+  memcpy(copy, key, lkey + 1);
+  t->tracked[t->ltracked++] = copy;
+}
+
+// hands ts the next version for a write. while tracking, an entry not written since
+// it began has its key kept, later writes find it kept already. the write lock must be held
+static void bump(table *t, table_s *ts)
+{
+  if (t->tracking && ts->version <= t->mark) track(t, ts->key, ts->lkey);
+  ts->version = ++t->version;
+}
+
+// links a new entry into bucket h, the write lock must be held
+static table_s *insert(table *t, const unsigned int h, const unsigned int lkey, const unsigned long lvalue,
+  const char *key, const char *value)
+{
+  table_s *ts;
 
-  if (!slock && pthread_rwlock_wrlock(&table_default.rwl) != 0) return ret;
-  const unsigned int h = hash(table_default.ltable, key);
-  if ((ts = colision(h)) != NULL)
+  if ((ts = entry_new(lkey)) == NULL) return NULL;
+  if (store(t, ts, lvalue, value) != 0)
   {
-    if (colision_add(ts, lkey, lvalue, key, value) != 0) goto add_end;
+    entry_free(ts);
+    return NULL;
   }
+  memcpy(ts->key, key, lkey + 1);
 
-  if ((ts = malloc(sizeof(table_s))) == NULL) goto add_end;
-  ts->next = NULL;
-  if ((ts->key = malloc(lkey)) == NULL)
+  if (t->index != NULL && skiplist_insert(t->index, ts->key) != 0)
   {
-    free(ts);
-    goto add_end;
+    drop(ts);
+    entry_free(ts);
+    return NULL;
   }
-  if ((ts->value = malloc(lvalue)) == NULL)
+
+  bump(t, ts);
+  ts->next = t->s[h];
+  t->s[h] = ts;
+  t->ctable++;
+  return ts;
+}
+
+// marks a write to key for readers that keep copies, see table_stamp. the write
+// lock must be held
+static void stamp(table *t, const char *key)
+{
+  atomic_fetch_add_explicit(&t->stamps[hash(TABLE_STAMPS, key)], 1, memory_order_release);
+}
+
+static int add(table *t, const unsigned int lkey, const unsigned long lvalue, const char *key, const char *value)
+{
+  table_s *ts;
+  int ret = -1;
+
+  if (!t->init) return ret;
+  if (wrlock(t) != 0) return ret;
+  if (t->ctable >= t->thrs && resize(t) != 0)
+    perror("add resize table"); // keep going on the current size
+  stamp(t, key);
+
+  const unsigned int h = hash(t->ltable, key);
+  if ((ts = colision(t, h, key)) != NULL)
   {
-    free(ts->key);
-    free(ts);
+    if ((ret = colision_add(t, ts, lvalue, value)) == 0) bump(t, ts);
     goto add_end;
   }
-  strncpy(ts->key, key, lkey);
-  strncpy(ts->value, value, lvalue);
-  ts->lkey = lkey;
-  ts->lvalue = lvalue;
-  table_default.s[h] = ts;
-  table_default.ctable++;
-  ret = 0;
+
+  if (insert(t, h, lkey, lvalue, key, value) != NULL) ret = 0;
 
   add_end:
-  if (!slock && pthread_rwlock_unlock(&table_default.rwl) != 0)
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
   {
     perror("add end table unlock");
     exit(1);
@@ -183,22 +549,23 @@ static int add(const bool slock, const unsigned int lkey, const unsigned long lv
   return ret;
 }
 
-int table_del(const char *key)
+int table_del(table *t, const char *key)
 {
   table_s *s, *p = NULL;
   int rt = -1;
 
   if (strlen(key) > UINT32_MAX) return -1;
-  if (!table_default.init) return rt;
-  if (pthread_rwlock_rdlock(&table_default.rwl) != 0) return rt;
-  const unsigned int h = hash(table_default.ltable, key);
-  if ((s = table_default.s[h]) == NULL) goto table_del_final;
+  if (!t->init) return rt;
+  if (wrlock(t) != 0) return rt;
+  stamp(t, key);
+  const unsigned int h = hash(t->ltable, key);
+  if ((s = t->s[h]) == NULL) goto table_del_final;
 
   while (s != NULL)
   {
     if (strcmp(s->key, key) == 0)
     {
-      if (p == NULL) table_default.s[h] = s->next;
+      if (p == NULL) t->s[h] = s->next;
       else p->next = s->next;
       goto table_del_found;
     }
@@ -208,13 +575,15 @@ int table_del(const char *key)
   goto table_del_final;
 
   table_del_found:
-  free(s->key);
-  free(s->value);
-  free(s);
+  if (t->tracking && s->version <= t->mark) track(t, s->key, s->lkey);
+  if (t->index != NULL) skiplist_remove(t->index, s->key);
+  t->ctable--;
+  drop(s);
+  entry_free(s);
   rt = 0;
 
   table_del_final:
-  if (pthread_rwlock_unlock(&table_default.rwl) != 0)
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
   {
     perror("table del unlock");
     exit(EXIT_FAILURE);
@@ -223,44 +592,1111 @@ int table_del(const char *key)
   return rt;
 }
 
-int table_add(const unsigned int lkey, const unsigned long lvalue, char *key, char *value)
+// replaces the value of ts by value, stored as enc in lstored bytes. the write lock must be held
+static void take(table *t, table_s *ts, char *value, const unsigned long lvalue, const unsigned char enc,
+  const unsigned long lstored)
+{
+  drop(ts);
+  ts->enc = enc;
+  ts->value = value;
+  ts->lvalue = lvalue;
+  ts->cvalue = lstored;
+  bump(t, ts);
+}
+
+// takes over value, stored as enc in lstored bytes, for key
+static int adopt(table *t, const unsigned int lkey, const char *key, const unsigned long lvalue, char *value,
+  const unsigned char enc, const unsigned long lstored)
+{
+  table_s *ts;
+  int ret = -1;
+
+  if (!t->init) return ret;
+  if (wrlock(t) != 0) return ret;
+  if (t->ctable >= t->thrs && resize(t) != 0)
+    perror("adopt resize table");
+  stamp(t, key);
+
+  const unsigned int h = hash(t->ltable, key);
+  if ((ts = colision(t, h, key)) == NULL && (ts = insert(t, h, lkey, 0, key, "")) == NULL) goto adopt_final;
+
+  take(t, ts, value, lvalue, enc, lstored);
+  ret = 0;
+
+  adopt_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table adopt unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+int table_add(table *t, const unsigned int lkey, const unsigned long lvalue, const char *key, const char *value)
 {
+  unsigned long lstored;
+  char *encoded;
+
   if (strlen(key) != lkey) return -1;
-  if (strlen(value) != lvalue) return -1;
-  return add(false, lkey, lvalue, key, value);
+  if (lvalue > TABLE_MAXVALUE) return -1;
+
+  // compression runs before the lock is taken
+  if ((encoded = encode(t, value, lvalue, &lstored)) != NULL)
+  {
+    if (adopt(t, lkey, key, lvalue, encoded, TABLE_ENC_LZ4, lstored) == 0) return 0;
+    blob_unref(encoded);
+    return -1;
+  }
+  return add(t, lkey, lvalue, key, value);
+}
+
+// stores a value built with table_alloc without copying it, the table owns it afterwards
+int table_adopt(table *t, const unsigned int lkey, const char *key, const unsigned long lvalue, char *value)
+{
+  unsigned long lstored;
+  char *encoded;
+
+  if (strlen(key) != lkey || lvalue > TABLE_MAXVALUE) return -1;
+  if ((encoded = encode(t, value, lvalue, &lstored)) != NULL)
+  {
+    if (adopt(t, lkey, key, lvalue, encoded, TABLE_ENC_LZ4, lstored) != 0)
+    {
+      blob_unref(encoded);
+      return -1;
+    }
+    blob_unref(value);
+    return 0;
+  }
+  blob_own(t, value);
+  return adopt(t, lkey, key, lvalue, value, TABLE_ENC_RAW, lvalue);
 }
 
-table_s *table_getbk(const char *key)
+// stores value for key only if the entry is at version expected, 0 meaning the key
+// must not exist. *version gets the new version, or the current one (0 when missing)
+// with TABLE_ECONFLICT.
+int table_cas(table *t, const unsigned int lkey, const unsigned long lvalue, const char *key, const char *value,
+  const unsigned long long expected, unsigned long long *version)
 {
-  table_s *s = NULL;
+  unsigned long lstored;
+  table_s *ts;
+  int ret = -1;
 
-  if (strlen(key) > UINT32_MAX) return NULL;
-  if (!table_default.init) return NULL;
-  const unsigned int h = hash(table_default.ltable, key);
-  if ((s = table_default.s[h]) == NULL) return NULL;
+  if (strlen(key) != lkey || lvalue > TABLE_MAXVALUE) return -1;
+  if (!t->init) return -1;
 
-  while (s != NULL)
+  char *encoded = encode(t, value, lvalue, &lstored);
+  if (wrlock(t) != 0) goto table_cas_error;
+  if (t->ctable >= t->thrs && resize(t) != 0)
+    perror("cas resize table");
+
+  const unsigned int h = hash(t->ltable, key);
+  ts = colision(t, h, key);
+  *version = ts != NULL ? ts->version : 0;
+  if (*version != expected)
   {
-    if (strcmp(s->key, key) == 0) return s;
-    s = s->next;
+    ret = TABLE_ECONFLICT;
+    goto table_cas_final;
   }
 
-  return NULL;
+  stamp(t, key);
+  if (encoded != NULL)
+  {
+    if (ts == NULL && (ts = insert(t, h, lkey, 0, key, "")) == NULL) goto table_cas_final;
+    take(t, ts, encoded, lvalue, TABLE_ENC_LZ4, lstored);
+    encoded = NULL;
+  }
+  else if (ts == NULL)
+  {
+    if ((ts = insert(t, h, lkey, lvalue, key, value)) == NULL) goto table_cas_final;
+  }
+  else
+  {
+    if (colision_add(t, ts, lvalue, value) != 0) goto table_cas_final;
+    bump(t, ts);
+  }
+  *version = ts->version;
+  ret = 0;
+
+  table_cas_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table cas unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  table_cas_error:
+  if (encoded != NULL) blob_unref(encoded);
+  return ret;
+}
+
+// hands the entry of key to fn while the read lock is held
+int table_get(table *t, const char *key, table_get_fn fn, void *args)
+{
+  const table_s *s;
+  int ret;
+
+  if (!t->init) return -1;
+  if (rdlock(t) != 0) return -1;
+  s = colision(t, hash(t->ltable, key), key);
+  ret = fn(s, args);
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table get unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
 }
 
-table *table_setup(void)
+// reads a value from the tier without bringing it back, the lock must be held
+static int readcold(const table_s *s, char *dst)
 {
-  if (table_default.init) return &table_default;
-  if (pthread_rwlock_init(&table_default.rwl, NULL) != 0) goto table_setup_error;
-  if ((table_default.s = calloc(INIT_TABLE_SIZE, sizeof(table_s*))) == NULL) goto table_setup_error;
+  unsigned char enc;
+  int ret = -1;
 
-  table_default.ltable = INIT_TABLE_SIZE;
-  table_default.ctable = 0;
-  table_default.thrs = table_default.ltable * F_THRS;
-  table_default.init = true;
+  char *stored = malloc(s->cvalue > 0 ? s->cvalue : 1);
+  if (stored == NULL) return -1;
+  if (tier_read(s->loc, s->key, s->lkey, s->cvalue, stored, &enc) != 0) goto readcold_final;
 
-  return &table_default;
-  table_setup_error:
-  if (table_default.s != NULL) free(table_default.s);
-  return NULL;
-}
\ No newline at end of file
+  if (enc == TABLE_ENC_LZ4) ret = decode(stored, s->cvalue, dst, s->lvalue);
+  else
+  {
+    memcpy(dst, stored, s->lvalue);
+    ret = 0;
+  }
+
+  readcold_final:
+  free(stored);
+  return ret;
+}
+
+// copies the s->lvalue bytes of an entry's value to dst, decoding it as needed
+int table_read(const table_s *s, char *dst)
+{
+  char buf[TABLE_INTLEN];
+
+  switch (s->enc)
+  {
+  case TABLE_ENC_RAW:
+    memcpy(dst, s->value, s->lvalue);
+    return 0;
+  case TABLE_ENC_LZ4:
+    return decode(s->value, s->cvalue, dst, s->lvalue);
+  case TABLE_ENC_TIER:
+    return readcold(s, dst);
+  default:
+    snprintf(buf, sizeof(buf), "%lld", s->ival);
+    memcpy(dst, buf, s->lvalue);
+    return 0;
+  }
+}
+
+// changes whenever key is written. a copy taken after reading the stamp is current
+// for as long as the stamp stays the same
+unsigned long table_stamp(const table *t, const char *key)
+{
+  return atomic_load_explicit(&t->stamps[hash(TABLE_STAMPS, key)], memory_order_acquire);
+}
+
+// a buffer of size bytes the caller fills and then hands to table_adopt or table_release
+char *table_alloc(const unsigned long size)
+{
+  return blob_new(NULL, size > 0 ? size : 1);
+}
+
+void table_release(const char *value)
+{
+  if (value != NULL) blob_unref(value);
+}
+
+// references the stored value of key without copying it, it stays valid and
+// unchanged until table_release, whatever writers do to the entry meanwhile.
+// *enc tells how the *lstored bytes encode the *lvalue bytes of the value,
+// integers are handed out rendered as TABLE_ENC_RAW. version may be NULL.
+int table_borrow_encoded(table *t, const char *key, const char **value, unsigned long *lstored, unsigned long *lvalue,
+  unsigned char *enc, unsigned long long *version)
+{
+  table_s *s;
+  int ret = TABLE_ENOENT;
+
+  if (!t->init) return -1;
+  if (rdlock(t) != 0) return -1;
+  if ((s = colision(t, hash(t->ltable, key), key)) == NULL) goto table_borrow_final;
+  if (version != NULL) *version = s->version;
+
+  // the tier skips values read since it last looked
+  if (tier_enabled() && !atomic_load_explicit(&s->ref, memory_order_relaxed))
+    atomic_store_explicit(&s->ref, 1, memory_order_relaxed);
+  if (s->enc == TABLE_ENC_TIER)
+  {
+    ret = TABLE_ECOLD;
+    goto table_borrow_final;
+  }
+
+  if (HASBLOB(s))
+  {
+    atomic_fetch_add_explicit(&BLOB(s->value)->refs, 1, memory_order_relaxed);
+    *value = s->value;
+    *lstored = s->enc == TABLE_ENC_RAW ? s->lvalue : s->cvalue;
+    *lvalue = s->lvalue;
+    *enc = s->enc;
+    ret = 0;
+    goto table_borrow_final;
+  }
+
+  char buf[TABLE_INTLEN], *nv;
+  const int len = snprintf(buf, sizeof(buf), "%lld", s->ival);
+  if ((nv = blob_new(t, len)) == NULL)
+  {
+    ret = -1;
+    goto table_borrow_final;
+  }
+  memcpy(nv, buf, len);
+  *value = nv;
+  *lstored = *lvalue = len;
+  *enc = TABLE_ENC_RAW;
+  ret = 0;
+
+  table_borrow_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table borrow unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+// like table_borrow_encoded, compressed values are decoded into a private copy
+// once the lock is released
+int table_borrow(table *t, const char *key, const char **value, unsigned long *lvalue, unsigned long long *version)
+{
+  const char *stored;
+  unsigned long lstored;
+  unsigned char enc;
+  char *nv;
+
+  const int ret = table_borrow_encoded(t, key, &stored, &lstored, lvalue, &enc, version);
+  if (ret != 0 || enc == TABLE_ENC_RAW)
+  {
+    if (ret == 0) *value = stored;
+    return ret;
+  }
+
+  if ((nv = blob_new(t, *lvalue > 0 ? *lvalue : 1)) == NULL || decode(stored, lstored, nv, *lvalue) != 0)
+  {
+    if (nv != NULL) blob_unref(nv);
+    blob_unref(stored);
+    return -1;
+  }
+  blob_unref(stored);
+  *value = nv;
+  return 0;
+}
+
+// adds delta to the integer stored at key in place, a missing key counts as 0.
+// TABLE_EINVAL when the value is not an integer or the result would overflow.
+int table_incr(table *t, const unsigned int lkey, const char *key, const long long delta, long long *result)
+{
+  table_s *ts;
+  long long iv;
+  int ret = -1;
+
+  if (!t->init) return ret;
+  if (wrlock(t) != 0) return ret;
+  if (t->ctable >= t->thrs && resize(t) != 0)
+    perror("incr resize table");
+  stamp(t, key);
+
+  const unsigned int h = hash(t->ltable, key);
+  if ((ts = colision(t, h, key)) == NULL)
+  {
+    char buf[TABLE_INTLEN];
+    const int lvalue = snprintf(buf, sizeof(buf), "%lld", delta);
+    if (insert(t, h, lkey, lvalue, key, buf) == NULL) goto table_incr_final;
+    *result = delta;
+    ret = 0;
+    goto table_incr_final;
+  }
+
+  // values edited by APPEND or SETRANGE may have become integers since
+  if (fetch(t, ts) != 0) goto table_incr_final;
+  if (ts->enc == TABLE_ENC_RAW && toint(ts->lvalue, ts->value, &iv))
+  {
+    blob_unref(ts->value);
+    ts->enc = TABLE_ENC_INT;
+    ts->ival = iv;
+    ts->cvalue = 0;
+  }
+
+  if (ts->enc != TABLE_ENC_INT || __builtin_add_overflow(ts->ival, delta, &iv))
+  {
+    ret = TABLE_EINVAL;
+    goto table_incr_final;
+  }
+
+  char buf[TABLE_INTLEN];
+  ts->ival = iv;
+  ts->lvalue = (unsigned long)snprintf(buf, sizeof(buf), "%lld", iv);
+  bump(t, ts);
+  *result = iv;
+  ret = 0;
+
+  table_incr_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table incr unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+// writes ldata bytes at offset into the value of key, creating an empty value
+// first when the key is missing. offset ULONG_MAX appends. *lvalue gets the new length.
+int table_setrange(table *t, const unsigned int lkey, const char *key, unsigned long offset, const unsigned long ldata,
+  const char *data, unsigned long *lvalue)
+{
+  table_s *ts;
+  bool created = false;
+  int ret = -1;
+
+  if (!t->init) return ret;
+  if (offset != TABLE_APPEND && (offset > TABLE_MAXVALUE || ldata > TABLE_MAXVALUE - offset)) return TABLE_EINVAL;
+  if (wrlock(t) != 0) return ret;
+  if (t->ctable >= t->thrs && resize(t) != 0)
+    perror("setrange resize table");
+  stamp(t, key);
+
+  const unsigned int h = hash(t->ltable, key);
+  if ((ts = colision(t, h, key)) == NULL)
+  {
+    if ((ts = insert(t, h, lkey, 0, key, "")) == NULL) goto table_setrange_final;
+    created = true;
+  }
+
+  if (offset == TABLE_APPEND) offset = ts->lvalue;
+  if ((ret = splice(t, ts, offset, ldata, data)) == 0)
+  {
+    bump(t, ts);
+    *lvalue = ts->lvalue;
+  }
+  else if (created)
+  {
+    // a failed write leaves no key behind, insert linked ts at the head of h
+    t->s[h] = ts->next;
+    if (t->index != NULL) skiplist_remove(t->index, ts->key);
+    t->ctable--;
+    drop(ts);
+    entry_free(ts);
+  }
+
+  table_setrange_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table setrange unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+int table_append(table *t, const unsigned int lkey, const char *key, const unsigned long ldata, const char *data,
+  unsigned long *lvalue)
+{
+  return table_setrange(t, lkey, key, TABLE_APPEND, ldata, data, lvalue);
+}
+
+// sizes the table for keys entries at once, so loading them does not resize on the
+// way. TABLE_EINVAL past what TABLE_MAXBUCKETS holds.
+int table_reserve(table *t, const unsigned long keys)
+{
+  int ret = 0;
+
+  if (!t->init) return -1;
+  if (keys >= (unsigned long)(TABLE_MAXBUCKETS * F_THRS)) return TABLE_EINVAL;
+  if (wrlock(t) != 0) return -1;
+
+  unsigned long ltable = t->ltable;
+  while ((unsigned long)(ltable * F_THRS) <= keys) ltable *= F_GROW;
+  if (ltable > t->ltable) ret = rehash(t, ltable);
+
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table reserve unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+// an entry for table_insert, built without the lock. key need not be terminated,
+// the value is copied and encoded as table_add would store it.
+table_s *table_entry(table *t, const unsigned int lkey, const char *key, const unsigned long lvalue,
+  const char *value)
+{
+  unsigned long lstored;
+  char *encoded;
+  table_s *ts;
+
+  if (lvalue > TABLE_MAXVALUE) return NULL;
+  if ((ts = entry_new(lkey)) == NULL) return NULL;
+  memcpy(ts->key, key, lkey);
+  ts->key[lkey] = '\0';
+
+  if ((encoded = encode(t, value, lvalue, &lstored)) != NULL)
+  {
+    ts->enc = TABLE_ENC_LZ4;
+    ts->value = encoded;
+    ts->lvalue = lvalue;
+    ts->cvalue = lstored;
+    return ts;
+  }
+  if (store(t, ts, lvalue, value) != 0)
+  {
+    entry_free(ts);
+    return NULL;
+  }
+  return ts;
+}
+
+// an entry for table_insert whose value is already stored as enc in lstored bytes, as
+// the tier keeps it. they are copied, not encoded again
+table_s *table_entry_stored(table *t, const unsigned int lkey, const char *key, const unsigned long lvalue,
+  const char *stored, const unsigned long lstored, const unsigned char enc)
+{
+  table_s *ts;
+  char *nv;
+
+  if (enc != TABLE_ENC_RAW && enc != TABLE_ENC_LZ4) return NULL;
+  if ((ts = entry_new(lkey)) == NULL) return NULL;
+  if ((nv = blob_new(t, lstored > 0 ? lstored : 1)) == NULL)
+  {
+    entry_free(ts);
+    return NULL;
+  }
+  memcpy(ts->key, key, lkey);
+  ts->key[lkey] = '\0';
+  memcpy(nv, stored, lstored);
+
+  ts->enc = enc;
+  ts->value = nv;
+  ts->lvalue = lvalue;
+  ts->cvalue = enc == TABLE_ENC_RAW && lstored == 0 ? 1 : lstored;
+  return ts;
+}
+
+// an entry for table_insert whose value stays in the tier record at loc, lstored bytes
+// long. the tier counts the record as live from here on
+table_s *table_entry_tier(const unsigned int lkey, const char *key, const unsigned long lvalue,
+  const unsigned long loc, const unsigned long lstored)
+{
+  table_s *ts;
+
+  if ((ts = entry_new(lkey)) == NULL) return NULL;
+  memcpy(ts->key, key, lkey);
+  ts->key[lkey] = '\0';
+
+  ts->enc = TABLE_ENC_TIER;
+  ts->loc = loc;
+  ts->lvalue = lvalue;
+  ts->cvalue = lstored;
+  tier_keep(lkey, lstored);
+  return ts;
+}
+
+void table_entry_free(table_s *ts)
+{
+  drop(ts);
+  entry_free(ts);
+}
+
+// links n entries from table_entry under one write lock, a key already present gets
+// the value of its entry. the table takes over every entry and returns how many of
+// them it dropped for want of memory for the index, -1 leaves all of them with the
+// caller.
+int table_insert(table *t, table_s **entries, const unsigned int n)
+{
+  table_s *ts;
+  int dropped = 0;
+
+  if (!t->init) return -1;
+  if (wrlock(t) != 0) return -1;
+
+  for (unsigned int ie = 0; ie < n; ++ie)
+  {
+    table_s *e = entries[ie];
+
+    if (t->ctable >= t->thrs && resize(t) != 0)
+      perror("insert resize table");
+    stamp(t, e->key);
+
+    const unsigned int h = hash(t->ltable, e->key);
+    if ((ts = colision(t, h, e->key)) != NULL)
+    {
+      drop(ts);
+      ts->enc = e->enc;
+      ts->value = e->value;
+      ts->lvalue = e->lvalue;
+      ts->cvalue = e->cvalue;
+      bump(t, ts);
+      entry_free(e);
+      continue;
+    }
+
+    if (t->index != NULL && skiplist_insert(t->index, e->key) != 0)
+    {
+      table_entry_free(e);
+      dropped++;
+      continue;
+    }
+    bump(t, e);
+    e->next = t->s[h];
+    t->s[h] = e;
+    t->ctable++;
+  }
+
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table insert unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return dropped;
+}
+
+static bool scan_match(const char *key, const char *prefix, const size_t lprefix, const char *end)
+{
+  if (prefix != NULL && strncmp(key, prefix, lprefix) != 0) return false;
+  if (end != NULL && strcmp(key, end) >= 0) return false;
+  return true;
+}
+
+// walks the ordered index from max(prefix, start), exclusive of after, calling fn
+// for up to limit keys that carry prefix and sort before end. more tells whether
+// another matching key follows the last one handed out.
+int table_scan(table *t, const char *prefix, const char *start, const char *end, const char *after,
+  const unsigned int limit, table_scan_fn fn, void *args, bool *more)
+{
+  const skiplist_n *n;
+  const char *from = start;
+  int count = 0;
+
+  *more = false;
+  if (!t->init || t->index == NULL) return -1;
+
+  const size_t lprefix = prefix != NULL ? strlen(prefix) : 0;
+  if (prefix != NULL && (from == NULL || strcmp(prefix, from) > 0)) from = prefix;
+  if (after != NULL && (from == NULL || strcmp(after, from) >= 0)) from = after;
+
+  if (rdlock(t) != 0) return -1;
+
+  n = skiplist_seek(t->index, from);
+  if (n != NULL && after != NULL && strcmp(n->key, after) == 0) n = n->next[0];
+
+  for (; n != NULL && scan_match(n->key, prefix, lprefix, end); n = n->next[0])
+  {
+    if ((unsigned int)count == limit)
+    {
+      *more = true;
+      break;
+    }
+    if (fn(n->key, args) < 0)
+    {
+      count = -1;
+      break;
+    }
+    count++;
+  }
+
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table scan unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return count;
+}
+
+static unsigned long rev(unsigned long v)
+{
+  unsigned long r = 0;
+  for (unsigned int ib = 0; ib < sizeof(v) * 8; ++ib)
+  {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+// visits up to count buckets starting at *cursor and hands every entry in them to
+// fn. the cursor advances by incrementing its reversed bits, so buckets are walked
+// in an order that survives resizes: keys present for the whole iteration are
+// returned at least once, possibly more. *cursor is 0 once the table is covered.
+// fn returning 1 ends the call once the current bucket is done, so a bucket is
+// never split across calls.
+int table_iterate(table *t, unsigned long *cursor, unsigned int count, table_iterate_fn fn, void *args)
+{
+  unsigned long v = *cursor;
+  bool full = false;
+  int ret = 0;
+
+  if (!t->init) return -1;
+  if (count == 0) count = 1;
+  if (rdlock(t) != 0) return -1;
+
+  const unsigned long m = t->ltable - 1;
+  do
+  {
+    for (const table_s *s = t->s[v & m]; s != NULL; s = s->next)
+    {
+      const int r = fn(s, args);
+      if (r < 0)
+      {
+        ret = -1;
+        goto table_iterate_final;
+      }
+      if (r > 0) full = true;
+    }
+
+    v |= ~m;
+    v = rev(v);
+    v++;
+    v = rev(v);
+  } while (v != 0 && --count > 0 && !full);
+  *cursor = v;
+
+  table_iterate_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table iterate unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+// moves the entries, keys and values of up to count buckets from *cursor on out of
+// arena chunks being evacuated, see arena_defrag_begin. values borrowed past the lock
+// stay where they are. *cursor is 0 once the table is covered, returns how many
+// allocations moved.
+int table_defrag(table *t, unsigned long *cursor, unsigned int count)
+{
+  unsigned long h = *cursor;
+  int moved = 0;
+
+  if (!t->init) return -1;
+  if (wrlock(t) != 0) return -1;
+
+  for (; h < t->ltable && count > 0; ++h, --count)
+    for (table_s **link = &t->s[h]; *link != NULL; link = &(*link)->next)
+    {
+      table_s *ts = *link;
+
+      if (arena_sparse(ts, sizeof(table_s)))
+      {
+        table_s *nts = arena_alloc(sizeof(table_s));
+        if (nts == NULL) goto table_defrag_final;
+        memcpy(nts, ts, sizeof(table_s));
+        arena_free(ts, sizeof(table_s));
+        *link = ts = nts;
+        moved++;
+      }
+
+      if (arena_sparse(ts->key, ts->lkey + 1))
+      {
+        char *nkey = arena_alloc(ts->lkey + 1);
+        if (nkey == NULL) goto table_defrag_final;
+        memcpy(nkey, ts->key, ts->lkey + 1);
+        // the index points at the key of the entry, inserting it again repoints it
+        if (t->index != NULL && skiplist_insert(t->index, nkey) != 0)
+        {
+          arena_free(nkey, ts->lkey + 1);
+          goto table_defrag_final;
+        }
+        arena_free(ts->key, ts->lkey + 1);
+        ts->key = nkey;
+        moved++;
+      }
+
+      if (HASBLOB(ts) && !blob_shared(ts->value))
+      {
+        table_blob *b = BLOB(ts->value);
+        const size_t lblob = sizeof(table_blob) + b->size;
+        if (!arena_sparse(b, lblob)) continue;
+
+        table_blob *nb = arena_alloc(lblob);
+        if (nb == NULL) goto table_defrag_final;
+        memcpy(nb, b, lblob);
+        atomic_init(&nb->refs, 1);
+        arena_free(b, lblob);
+        ts->value = nb->data;
+        moved++;
+      }
+    }
+
+  table_defrag_final:
+  *cursor = h < t->ltable ? h : 0;
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table defrag unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return moved;
+}
+
+// turns writers of t away from now on, the ones running are waited for. readers go on,
+// the process hands its data over and exits unless table_thaw has them back
+void table_freeze(table *t)
+{
+  if (!t->init || wrlock(t) != 0) return;
+  t->frozen = true;
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table freeze unlock");
+    exit(EXIT_FAILURE);
+  }
+}
+
+bool table_frozen(const table *t)
+{
+  return t->frozen;
+}
+
+// has writers of a frozen t back, a handover that did not go through
+void table_thaw(table *t)
+{
+  if (!t->init) return;
+  if (pthread_rwlock_wrlock(&t->rwl) != 0)
+  {
+    perror("table thaw lock");
+    exit(EXIT_FAILURE);
+  }
+  t->frozen = false;
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table thaw unlock");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// with on, every key written or deleted from now on is kept for table_tracked, so a
+// copy of t taken meanwhile can be brought up to date. off lets go of the keys.
+int table_track(table *t, const bool on)
+{
+  if (!t->init) return -1;
+  if (pthread_rwlock_wrlock(&t->rwl) != 0) return -1;
+  t->tracking = on;
+  t->mark = t->version;
+  for (unsigned long ik = 0; ik < t->ltracked; ++ik) free(t->tracked[ik]);
+  free(t->tracked);
+  t->tracked = NULL;
+  t->ltracked = t->ctracked = 0;
+  t->lost = false;
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table track unlock");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+
+// hands up to count of the keys kept since table_track, from *next on, to fn with
+// their entry now, NULL once deleted. a key may come more than once. fn returning 1
+// ends the call early. returns 1 once every key was handed, 0 when some are left and
+// -1 on errors, TABLE_ELOST when keys were lost.
+int table_tracked(table *t, unsigned long *next, unsigned int count, const table_tracked_fn fn, void *args)
+{
+  unsigned long ik = *next;
+  int ret = 0;
+
+  if (!t->init || !t->tracking) return -1;
+  if (rdlock(t) != 0) return -1;
+  if (t->lost)
+  {
+    ret = TABLE_ELOST;
+    goto table_tracked_final;
+  }
+
+  for (; ik < t->ltracked && count > 0; ++ik, --count)
+  {
+    const char *key = t->tracked[ik];
+    const int r = fn(key, colision(t, hash(t->ltable, key), key), args);
+    if (r < 0)
+    {
+      ret = -1;
+      goto table_tracked_final;
+    }
+    if (r > 0)
+    {
+      ++ik;
+      break;
+    }
+  }
+  *next = ik;
+  if (ik == t->ltracked) ret = 1;
+
+  table_tracked_final:
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table tracked unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  return ret;
+}
+
+unsigned long table_resident(const table *t)
+{
+  return atomic_load_explicit(&t->resident, memory_order_relaxed);
+}
+
+typedef struct table_cold
+{
+  char *key;
+  const char *value; // borrowed while it is written out
+  unsigned int lkey;
+  unsigned long lstored, lvalue, loc;
+  unsigned long long version;
+  unsigned char enc;
+  bool written;
+} table_cold;
+
+// one step of the clock over the buckets: values read since the last step get a
+// second chance, the others are written to the tier outside the lock and then
+// dropped from memory unless a writer got to them first. returns how many went.
+int table_evict(table *t)
+{
+  table_cold cold[TIER_BATCH];
+  unsigned int n = 0, evicted = 0;
+
+  if (!t->init) return -1;
+  if (rdlock(t) != 0) return -1;
+  for (unsigned int ib = 0; ib < TIER_BATCH * 4 && n < TIER_BATCH; ++ib)
+  {
+    const unsigned long h = t->hand++ & (t->ltable - 1);
+    for (table_s *ts = t->s[h]; ts != NULL && n < TIER_BATCH; ts = ts->next)
+    {
+      const unsigned long lstored = ts->enc == TABLE_ENC_RAW ? ts->lvalue : ts->cvalue;
+      if (!HASBLOB(ts) || lstored < TIER_MINVALUE) continue;
+      if (atomic_load_explicit(&ts->ref, memory_order_relaxed))
+      {
+        atomic_store_explicit(&ts->ref, 0, memory_order_relaxed);
+        continue;
+      }
+      if ((cold[n].key = strdup(ts->key)) == NULL) break;
+
+      atomic_fetch_add_explicit(&BLOB(ts->value)->refs, 1, memory_order_relaxed);
+      cold[n].value = ts->value;
+      cold[n].lkey = ts->lkey;
+      cold[n].lstored = lstored;
+      cold[n].lvalue = ts->lvalue;
+      cold[n].version = ts->version;
+      cold[n].enc = ts->enc;
+      n++;
+    }
+  }
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table evict unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  for (unsigned int ic = 0; ic < n; ++ic)
+    cold[ic].written = tier_append(t->id, cold[ic].key, cold[ic].lkey, cold[ic].value, cold[ic].lstored,
+      cold[ic].lvalue, cold[ic].version, cold[ic].enc, &cold[ic].loc) == 0;
+
+  if (wrlock(t) != 0) goto table_evict_final;
+  for (unsigned int ic = 0; ic < n; ++ic)
+  {
+    if (!cold[ic].written) continue;
+
+    table_s *ts = colision(t, hash(t->ltable, cold[ic].key), cold[ic].key);
+    if (ts == NULL || !HASBLOB(ts) || ts->value != cold[ic].value || ts->version != cold[ic].version)
+    {
+      tier_forget(cold[ic].lkey, cold[ic].lstored);
+      continue;
+    }
+
+    blob_unref(ts->value);
+    ts->enc = TABLE_ENC_TIER;
+    ts->loc = cold[ic].loc;
+    ts->cvalue = cold[ic].lstored;
+    evicted++;
+  }
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table evict unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  table_evict_final:
+  for (unsigned int ic = 0; ic < n; ++ic)
+  {
+    blob_unref(cold[ic].value);
+    free(cold[ic].key);
+  }
+  stats_add(STATS_TIER_EVICTED, evicted);
+  return evicted;
+}
+
+// brings the value of key back from the tier. the disk is read without the lock, the
+// value only goes in if the entry still points at what was read. 0 also when the
+// value was not cold (anymore).
+int table_load(table *t, const char *key)
+{
+  unsigned long loc, lstored;
+  unsigned int lkey;
+  unsigned char enc;
+  table_s *ts;
+  char *nv;
+  int ret;
+
+  if (!t->init) return -1;
+
+  do
+  {
+    if (rdlock(t) != 0) return -1;
+    ts = colision(t, hash(t->ltable, key), key);
+    ret = ts == NULL ? TABLE_ENOENT : ts->enc != TABLE_ENC_TIER ? 0 : 1;
+    if (ret == 1)
+    {
+      loc = ts->loc;
+      lstored = ts->cvalue;
+      lkey = ts->lkey;
+    }
+    if (pthread_rwlock_unlock(&t->rwl) != 0)
+    {
+      perror("table load unlock");
+      exit(EXIT_FAILURE);
+    }
+    if (ret != 1) return ret;
+
+    if ((nv = blob_new(t, lstored > 0 ? lstored : 1)) == NULL) return -1;
+    if ((ret = tier_read(loc, key, lkey, lstored, nv, &enc)) != 0) blob_unref(nv);
+  } while (ret == TIER_EMOVED); // compaction moved it meanwhile
+  if (ret != 0) return -1;
+
+  if (wrlock(t) != 0)
+  {
+    blob_unref(nv);
+    return -1;
+  }
+  ts = colision(t, hash(t->ltable, key), key);
+  if (ts != NULL && ts->enc == TABLE_ENC_TIER && ts->loc == loc)
+  {
+    // the value is unchanged, so is its version
+    tier_forget(lkey, lstored);
+    ts->enc = enc;
+    ts->value = nv;
+    atomic_store_explicit(&ts->ref, 1, memory_order_relaxed);
+    nv = NULL;
+  }
+  if (pthread_rwlock_unlock(&t->rwl) != 0)
+  {
+    perror("table load unlock");
+    exit(EXIT_FAILURE);
+  }
+
+  if (nv != NULL) blob_unref(nv);
+  stats_add(STATS_TIER_LOADS, 1);
+  return 0;
+}
+
+// whether the tier record at loc is still the value of key
+bool table_tier_live(table *t, const char *key, const unsigned long loc)
+{
+  bool live;
+
+  if (!t->init || rdlock(t) != 0) return false;
+  const table_s *ts = colision(t, hash(t->ltable, key), key);
+  live = ts != NULL && ts->enc == TABLE_ENC_TIER && ts->loc == loc;
+  pthread_rwlock_unlock(&t->rwl);
+  return live;
+}
+
+// points key at the copy compaction made of its record, -1 if it moved on meanwhile
+int table_tier_move(table *t, const char *key, const unsigned long from, const unsigned long to)
+{
+  int ret = -1;
+
+  if (!t->init || wrlock(t) != 0) return -1;
+  table_s *ts = colision(t, hash(t->ltable, key), key);
+  if (ts != NULL && ts->enc == TABLE_ENC_TIER && ts->loc == from)
+  {
+    ts->loc = to;
+    ret = 0;
+  }
+  pthread_rwlock_unlock(&t->rwl);
+  return ret;
+}
+
+// a keyspace of its own: sizing, locking and versions are not shared with any other
+table *table_new(const unsigned int id, const bool ordered, const unsigned long compressmin)
+{
+  table *t = calloc(1, sizeof(table));
+  if (t == NULL) return NULL;
+
+  if (pthread_rwlock_init(&t->rwl, NULL) != 0) goto table_new_error;
+  if ((t->s = topology_alloc(INIT_TABLE_SIZE * sizeof(table_s*), TOPOLOGY_ROLE_PROCESSOR)) == NULL)
+    goto table_new_error;
+  if (ordered && (t->index = skiplist_new()) == NULL)
+  {
+    topology_free(t->s, INIT_TABLE_SIZE * sizeof(table_s*));
+    goto table_new_error;
+  }
+
+  t->id = id;
+  t->ltable = INIT_TABLE_SIZE;
+  t->ctable = 0;
+  t->compressmin = compressmin;
+  t->thrs = t->ltable * F_THRS;
+  t->init = true;
+
+  return t;
+  table_new_error:
+  free(t);
+  return NULL;
+}
+
+// the keyspace requests select with PROTOCOL_FLAG_NAMESPACE, NULL past the configured ones
+table *table_namespace(const unsigned int id)
+{
+  return id < nnamespaces ? namespaces[id] : NULL;
+}
+
+unsigned int table_namespaces(void)
+{
+  return nnamespaces;
+}
+
+// "ns<id>_name:value" lines for every namespace
+void table_report(FILE *f)
+{
+  for (unsigned int in = 0; in < nnamespaces; ++in)
+  {
+    table *t = namespaces[in];
+    if (rdlock(t) != 0) continue;
+    const unsigned long keys = t->ctable, buckets = t->ltable;
+    pthread_rwlock_unlock(&t->rwl);
+
+    fprintf(f, "ns%u_keys:%lu\n", in, keys);
+    fprintf(f, "ns%u_buckets:%lu\n", in, buckets);
+    fprintf(f, "ns%u_resident_bytes:%lu\n", in, table_resident(t));
+    fprintf(f, "ns%u_resizes:%lu\n", in, atomic_load_explicit(&t->resizes, memory_order_relaxed));
+    fprintf(f, "ns%u_resize_ns:%lu\n", in, atomic_load_explicit(&t->resize_ns, memory_order_relaxed));
+  }
+}
+
+// creates count namespaces, 0 being the one requests without PROTOCOL_FLAG_NAMESPACE use
+int table_setup(const unsigned int count, const bool ordered, const unsigned long compressmin)
+{
+  if (nnamespaces > 0) return 0;
+  if (count == 0 || count > TABLE_NAMESPACES) return -1;
+  for (unsigned int in = 0; in < count; ++in)
+    if ((namespaces[in] = table_new(in, ordered, compressmin)) == NULL) return -1;
+  nnamespaces = count;
+  return 0;
+}
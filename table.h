@@ -22,32 +22,122 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include "skiplist.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define TABLE_ENC_RAW 0
+#define TABLE_ENC_INT 1
+#define TABLE_ENC_LZ4 2
+#define TABLE_ENC_TIER 3 // the stored value is in the tier file at loc
+
+#define TABLE_INTLEN 21 // "-9223372036854775808" plus the terminator
+#define TABLE_EINVAL -2
+#define TABLE_ENOENT -3
+#define TABLE_ECONFLICT -4 // CAS found another version
+#define TABLE_ECOLD -5 // the value is in the tier, table_load brings it back
+#define TABLE_ELOST -6 // a key written while tracking could not be kept, see table_track
+
+#define TABLE_MINCAP 16
+#define TABLE_MAXVALUE (512ul << 20)
+#define TABLE_MINCOMPRESS 16 // smallest compressmin, below it the saving cannot cover the length header
+#define TABLE_APPEND ULONG_MAX
+#define TABLE_STAMPS 4096 // write stamps, keys share them by hash
+#define TABLE_NAMESPACES 1024 // at most, see table_setup
+#define TABLE_MAXBUCKETS (1ul << 31) // hash() is 32 bits
 
 typedef struct table_s
 {
-  unsigned long lvalue;
+  unsigned long lvalue; // for TABLE_ENC_INT, the length of the decimal form
+  unsigned long cvalue; // bytes allocated for value when TABLE_ENC_RAW, compressed size when TABLE_ENC_LZ4
+  unsigned long long version; // from table.version, raised by every write
   unsigned int lkey;
+  unsigned char enc;
+  atomic_uchar ref; // read since the tier last looked, keeps the value in memory
 
-  char *key, *value;
+  char *key;
+  union
+  {
+    char *value;
+    long long ival;
+    unsigned long loc; // TABLE_ENC_TIER, cvalue holds the stored size
+  };
   struct table_s *next;
 } table_s;
 
 typedef struct table
 {
+  unsigned int id; // namespace number
   unsigned long ltable;
   unsigned long ctable;
   unsigned int thrs;
+  unsigned long compressmin; // values from this size on are compressed, 0 never
+  unsigned long long version; // last entry version handed out, under the write lock
   bool init;
+  bool frozen; // handed over, writers are turned away, see table_freeze
+  bool tracking; // writes keep their keys in tracked, see table_track
+  bool lost; // a written key could not be kept, tracked is incomplete
+  unsigned long long mark; // version when tracking began, later ones are in tracked already
+  char **tracked;
+  unsigned long ltracked, ctracked;
   pthread_rwlock_t rwl;
 
   struct table_s **s;
+  skiplist *index; // ordered view of the keys, NULL unless enabled
+  atomic_ulong stamps[TABLE_STAMPS]; // bumped by every write to a key of the slot
+  atomic_ulong resident; // bytes of values in memory
+  unsigned long hand; // next bucket the tier looks at for cold values
+  atomic_ulong resizes, resize_ns; // how often and how long writers stalled growing s
 } table;
 
-table *table_setup(void);
-int table_del(const char*);
-int table_add(unsigned int, unsigned long, char*, char*);
-table_s *table_getbk(const char*);
+typedef int (*table_scan_fn)(const char*, void*);
+typedef int (*table_iterate_fn)(const table_s*, void*);
+typedef int (*table_get_fn)(const table_s*, void*);
+typedef int (*table_tracked_fn)(const char*, const table_s*, void*);
+
+int table_setup(unsigned int, bool, unsigned long);
+table *table_new(unsigned int, bool, unsigned long);
+table *table_namespace(unsigned int);
+unsigned int table_namespaces(void);
+void table_report(FILE*);
+int table_del(table*, const char*);
+int table_add(table*, unsigned int, unsigned long, const char*, const char*);
+int table_adopt(table*, unsigned int, const char*, unsigned long, char*);
+int table_cas(table*, unsigned int, unsigned long, const char*, const char*, unsigned long long, unsigned long long*);
+int table_get(table*, const char*, table_get_fn, void*);
+int table_read(const table_s*, char*);
+unsigned long table_stamp(const table*, const char*);
+char *table_alloc(unsigned long);
+void table_release(const char*);
+int table_borrow(table*, const char*, const char**, unsigned long*, unsigned long long*);
+int table_borrow_encoded(table*, const char*, const char**, unsigned long*, unsigned long*, unsigned char*,
+  unsigned long long*);
+int table_incr(table*, unsigned int, const char*, long long, long long*);
+int table_setrange(table*, unsigned int, const char*, unsigned long, unsigned long, const char*, unsigned long*);
+int table_append(table*, unsigned int, const char*, unsigned long, const char*, unsigned long*);
+int table_reserve(table*, unsigned long);
+table_s *table_entry(table*, unsigned int, const char*, unsigned long, const char*);
+table_s *table_entry_stored(table*, unsigned int, const char*, unsigned long, const char*, unsigned long,
+  unsigned char);
+table_s *table_entry_tier(unsigned int, const char*, unsigned long, unsigned long, unsigned long);
+void table_entry_free(table_s*);
+int table_insert(table*, table_s**, unsigned int);
+int table_scan(table*, const char*, const char*, const char*, const char*, unsigned int, table_scan_fn, void*, bool*);
+int table_iterate(table*, unsigned long*, unsigned int, table_iterate_fn, void*);
+int table_defrag(table*, unsigned long*, unsigned int);
+void table_freeze(table*);
+void table_thaw(table*);
+bool table_frozen(const table*);
+int table_track(table*, bool);
+int table_tracked(table*, unsigned long*, unsigned int, table_tracked_fn, void*);
+unsigned long table_resident(const table*);
+unsigned long table_lockwait(void);
+int table_evict(table*);
+int table_load(table*, const char*);
+bool table_tier_live(table*, const char*, unsigned long);
+int table_tier_move(table*, const char*, unsigned long, unsigned long);
 
 #endif //TABLE_H
\ No newline at end of file
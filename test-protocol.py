@@ -0,0 +1,303 @@
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# scripted protocol checks against a server it starts itself, run from the repo root:
+#   python3 test-protocol.py [path to ugkv]
+# clients talk over a unix socket, so no tcp connection lingers on port 8080 between
+# the servers of the handover checks. exits 1 on the first failed check.
+
+OK, NOTFOUND, ERROR, UNSUPPORTED, INVALID, BUSY, CONFLICT, EVENT, TIMEOUT = range(9)
+SET, GET, DEL, SCAN, ITERATE, INCRBY, DECRBY, APPEND, GETRANGE, SETRANGE, STATS = range(1, 12)
+CAS, WATCH, UNWATCH = 13, 16, 17
+FLAG_VERSION, FLAG_DEADLINE = 0x4000, 0x1000
+HEADER = 10
+
+
+class Client:
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.id = 0
+        self.buf = bytearray()
+
+    def close(self):
+        self.sock.close()
+
+    def frame(self, cmd, payload):
+        self.id += 1
+        return struct.pack('<IHI', len(payload), cmd, self.id) + payload
+
+    def send(self, cmd, payload):
+        self.sock.sendall(self.frame(cmd, payload))
+
+    def fill(self, size):
+        while len(self.buf) < size:
+            data = self.sock.recv(65536)
+            if not data:
+                raise EOFError("server closed the connection")
+            self.buf += data
+
+    # returns (status, id, payload) of the next frame
+    def recv(self):
+        self.fill(HEADER)
+        size, status, rid = struct.unpack('<IHI', self.buf[:HEADER])
+        self.fill(HEADER + size)
+        payload = bytes(self.buf[HEADER:HEADER + size])
+        del self.buf[:HEADER + size]
+        return status, rid, payload
+
+    def call(self, cmd, payload):
+        self.send(cmd, payload)
+        return self.recv()
+
+    def set(self, key, value):
+        return self.call(SET, struct.pack('<II', len(key), len(value)) + key + value)[0]
+
+    def get(self, key):
+        status, _, payload = self.call(GET, struct.pack('<I', len(key)) + key)
+        return status, payload
+
+    def delete(self, key):
+        return self.call(DEL, struct.pack('<I', len(key)) + key)[0]
+
+    def version(self, key):
+        status, _, payload = self.call(GET | FLAG_VERSION, struct.pack('<I', len(key)) + key)
+        return struct.unpack('<Q', payload[:8])[0] if status == OK else 0
+
+    def cas(self, key, value, expected):
+        status, _, payload = self.call(CAS, struct.pack('<IIQ', len(key), len(value), expected) + key + value)
+        return status, struct.unpack('<Q', payload)[0] if len(payload) == 8 else None
+
+    def incr(self, key, delta, cmd=INCRBY):
+        status, _, payload = self.call(cmd, struct.pack('<Iq', len(key), delta) + key)
+        return status, struct.unpack('<q', payload)[0] if status == OK else None
+
+    def setrange(self, key, offset, data):
+        status, _, payload = self.call(SETRANGE, struct.pack('<IIQ', len(key), len(data), offset) + key + data)
+        return status, struct.unpack('<Q', payload)[0] if status == OK else None
+
+    def iterate(self, cursor, count):
+        status, _, payload = self.call(ITERATE, struct.pack('<QI', cursor, count))
+        cursor, n = struct.unpack('<QI', payload[:12])
+        keys, offset = [], 12
+        for _ in range(n):
+            lkey, lvalue = struct.unpack('<II', payload[offset:offset + 8])
+            keys.append(payload[offset + 8:offset + 8 + lkey])
+            offset += 8 + lkey + lvalue
+        return cursor, keys
+
+    def stats(self):
+        text = self.call(STATS, b'')[2].decode()
+        return dict(line.split(':', 1) for line in text.splitlines() if ':' in line)
+
+
+def check(cond, what):
+    if not cond:
+        raise AssertionError(what)
+    print(f"ok   {what}")
+
+
+def start(binary, sock, args):
+    proc = subprocess.Popen([binary, '-u', sock] + args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        if proc.poll() is not None:
+            raise AssertionError(f"server exited with {proc.returncode}: {' '.join(args)}")
+        try:
+            return proc, Client(sock)
+        except OSError:
+            time.sleep(0.05)
+    raise AssertionError("server did not come up")
+
+
+# starts a successor on the same handover socket and waits for the old server to leave.
+# with live, SETs go to the old server on it until it ends the connection and are
+# appended to answered with their status
+def handover(binary, sock, old, args, live=None, answered=None):
+    new = subprocess.Popen([binary, '-u', sock] + args, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    while live is not None:
+        key = b'live:%d' % len(answered)
+        try:
+            answered.append((key, live.set(key, key)))
+        except (EOFError, OSError):
+            live.close()
+            live = None
+    old.wait(timeout=30)
+    check(old.returncode == 0, f"predecessor exited cleanly after handing over to {' '.join(args)}")
+    for _ in range(100):
+        try:
+            client = Client(sock)
+            if client.set(b'handover:probe', b'1') == OK:
+                return new, client
+            client.close()
+        except OSError:
+            pass
+        time.sleep(0.05)
+    raise AssertionError("successor did not take over")
+
+
+def test_cas(c):
+    status, version = c.cas(b'cas', b'first', 0)
+    check(status == OK and version > 0, "CAS with version 0 creates a missing key")
+    status, current = c.cas(b'cas', b'again', 0)
+    check(status == CONFLICT and current == version, "CAS with version 0 on an existing key conflicts")
+    status, _ = c.cas(b'cas', b'stale', version + 1)
+    check(status == CONFLICT and c.get(b'cas')[1] == b'first', "CAS with another version leaves the value")
+    status, newer = c.cas(b'cas', b'second', version)
+    check(status == OK and newer > version and c.get(b'cas')[1] == b'second', "CAS with the version writes")
+    check(c.version(b'cas') == newer, "GET with the version flag reports the version CAS returned")
+
+
+def test_incr(c):
+    check(c.incr(b'ctr', 5) == (OK, 5), "INCRBY on a missing key starts from 0")
+    check(c.incr(b'ctr', 7, DECRBY) == (OK, -2), "DECRBY goes below zero")
+    check(c.set(b'ctr:max', b'%d' % (2 ** 63 - 1)) == OK, "SET the largest integer")
+    check(c.incr(b'ctr:max', 1) == (INVALID, None), "INCRBY past the largest integer is INVALID")
+    check(c.get(b'ctr:max')[1] == b'%d' % (2 ** 63 - 1), "an overflowing INCRBY leaves the value")
+    check(c.set(b'ctr:min', b'%d' % -2 ** 63) == OK, "SET the smallest integer")
+    check(c.incr(b'ctr:min', 1, DECRBY) == (INVALID, None), "DECRBY past the smallest integer is INVALID")
+    check(c.set(b'ctr:text', b'12abc') == OK, "SET a value that is no integer")
+    check(c.incr(b'ctr:text', 1) == (INVALID, None), "INCRBY on a value that is no integer is INVALID")
+    check(c.get(b'ctr:text')[1] == b'12abc', "a refused INCRBY leaves the value")
+
+
+def test_setrange(c):
+    check(c.set(b'range', b'abc') == OK, "SET a value to patch")
+    check(c.setrange(b'range', 1, b'XY') == (OK, 3), "SETRANGE inside the value")
+    check(c.setrange(b'range', 6, b'!') == (OK, 7), "SETRANGE past the end")
+    check(c.get(b'range')[1] == b'aXY\x00\x00\x00!', "SETRANGE fills the gap with zero bytes")
+    check(c.setrange(b'range:new', 2, b'z') == (OK, 3), "SETRANGE creates a missing key")
+    check(c.get(b'range:new')[1] == b'\x00\x00z', "a created key is zero filled up to the offset")
+    check(c.setrange(b'range', 2 ** 64 - 1, b'x')[0] == INVALID, "SETRANGE at the append offset is INVALID")
+    check(c.setrange(b'range:bad', 1 << 40, b'x')[0] == INVALID, "SETRANGE past the value size limit is INVALID")
+    check(c.get(b'range:bad')[0] == NOTFOUND, "an invalid SETRANGE leaves no key behind")
+    check(c.get(b'range')[1] == b'aXY\x00\x00\x00!', "an invalid SETRANGE leaves the value")
+
+
+def test_iterate(c):
+    keys = {b'it:%d' % i for i in range(2000)}
+    for key in keys:
+        c.send(SET, struct.pack('<II', len(key), 1) + key + b'v')
+    check(all(c.recv()[0] == OK for _ in keys), "SET the keys to iterate")
+    resizes = int(c.stats()['ns0_resizes'])
+    seen = set()
+    cursor, batch = c.iterate(0, 100)
+    seen.update(batch)
+    check(cursor != 0, "ITERATE stops after count entries with a cursor")
+    for i in range(200000):
+        key = b'grow:%d' % i
+        c.send(SET, struct.pack('<II', len(key), 1) + key + b'g')
+        if i % 1000 == 999:
+            for _ in range(1000):
+                c.recv()
+    check(int(c.stats()['ns0_resizes']) > resizes, "the table resized during the iteration")
+    while cursor != 0:
+        cursor, batch = c.iterate(cursor, 1000)
+        seen.update(batch)
+    check(keys <= seen, "ITERATE across a resize returns every key present throughout")
+
+
+def test_watch(c, sock):
+    w = Client(sock)
+    status = w.call(WATCH, struct.pack('<I', 5) + b'watch')[0]
+    check(status == OK, "WATCH a key")
+    check(c.set(b'watch', b'1') == OK, "SET the watched key from another connection")
+    status, rid, payload = w.recv()
+    check(status == EVENT and rid == 0 and payload == b'\x01\x00\x00watch', "a SET event is pushed")
+    check(c.delete(b'watch') == OK, "DEL the watched key")
+    status, rid, payload = w.recv()
+    check(status == EVENT and rid == 0 and payload == b'\x02\x00\x00watch', "a DEL event is pushed")
+    check(w.call(UNWATCH, struct.pack('<I', 5) + b'watch')[0] == OK, "UNWATCH the key")
+    check(w.call(UNWATCH, struct.pack('<I', 5) + b'watch')[0] == NOTFOUND, "UNWATCH a key not watched")
+    c.set(b'watch', b'2')
+    w.sock.settimeout(0.5)
+    try:
+        w.recv()
+        pushed = True
+    except socket.timeout:
+        pushed = False
+    check(not pushed, "no event after UNWATCH")
+    w.close()
+
+
+def test_deadline(c):
+    check(c.set(b'dl', b'1') == OK, "SET a key to read with deadlines")
+    status, _, payload = c.call(GET | FLAG_DEADLINE, struct.pack('<I', 1000000) + struct.pack('<I', 2) + b'dl')
+    check(status == OK and payload == b'1', "a request within its deadline runs")
+    shed = int(c.stats().get('shed_requests', 0))
+    # far more than a connection may have in flight, reading pauses and the queue stays full
+    n = 20000
+    request = struct.pack('<I', 1) + struct.pack('<I', 2) + b'dl'
+    frames = b''.join(c.frame(GET | FLAG_DEADLINE, request) for _ in range(n))
+    c.sock.sendall(frames)
+    counts = {}
+    for _ in range(n):
+        status = c.recv()[0]
+        counts[status] = counts.get(status, 0) + 1
+    check(set(counts) <= {OK, TIMEOUT} and counts.get(TIMEOUT, 0) > 0, f"queued past their deadline: {counts}")
+    check(int(c.stats()['shed_requests']) - shed == counts[TIMEOUT], "every TIMEOUT is counted as shed")
+
+
+def test_handover(binary, sock, proc, c, base):
+    values = {b'ho:%d' % i: (b'%05d' % i) * 120 for i in range(2000)}
+    check(c.incr(b'ho:ctr', 42) == (OK, 42), "INCRBY a counter to hand over")
+    c.close()
+
+    proc, c = handover(binary, sock, proc, base)
+    check(c.get(b'ho:ctr')[1] == b'42' and c.get(b'cas')[1] == b'second', "handover without -t keeps the data")
+    check(c.incr(b'ho:ctr', 1) == (OK, 43), "a handed over counter is still an integer")
+    c.close()
+
+    tier = base + ['-t', os.path.join(os.path.dirname(sock), 'tier'), '-m', '100000']
+    proc, c = handover(binary, sock, proc, tier)
+    for key, value in values.items():
+        c.set(key, value)
+    time.sleep(1.5)
+    check(int(c.stats().get('tier_evicted', 0)) > 0, "values moved to the tier file")
+    c.close()
+
+    proc, c = handover(binary, sock, proc, tier)
+    check(all(c.get(key)[1] == value for key, value in values.items()), "handover with -t keeps hot and cold values")
+    check(c.get(b'ho:ctr')[1] == b'43', "handover with -t keeps the counter")
+    c.close()
+
+    answered = []
+    proc, c = handover(binary, sock, proc, base, Client(sock), answered)
+    check(all(c.get(key)[1] == value for key, value in values.items()), "handover from -t to a server without it")
+    check(len(answered) > 0 and all(status == OK for _, status in answered),
+          f"the predecessor answered {len(answered)} SETs while the successor loaded")
+    check(all(c.get(key) == (OK, key) for key, _ in answered), "the successor has the SETs answered meanwhile")
+    c.close()
+    return proc
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './build/ugkv'
+    with tempfile.TemporaryDirectory() as tmp:
+        sock = os.path.join(tmp, 'ugkv.sock')
+        base = ['-R', os.path.join(tmp, 'handover.sock')]
+        proc, c = start(binary, sock, base)
+        try:
+            test_cas(c)
+            test_incr(c)
+            test_setrange(c)
+            test_iterate(c)
+            test_watch(c, sock)
+            test_deadline(c)
+            proc = test_handover(binary, sock, proc, c, base)
+        except (AssertionError, OSError, EOFError) as err:
+            print(f"FAIL {err}")
+            return 1
+        finally:
+            proc.terminate()
+            proc.wait()
+    print("all protocol checks passed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,502 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "tier.h"
+#include "table.h"
+#include "topology.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+// one generation of the value file. compaction copies the live records of the
+// current file into the next generation and retires it, the file goes away with
+// the last reader.
+typedef struct tier_file
+{
+  int fd;
+  unsigned int gen;
+  unsigned long size;
+  atomic_uint refs;
+  bool retired;
+  char *path;
+} tier_file_t;
+
+typedef struct tier_job
+{
+  tier_job_fn fn;
+  void *arg;
+  struct tier_job *nxt;
+} tier_job_t;
+
+typedef struct tier
+{
+  pthread_mutex_t mtx;
+  pthread_cond_t cnd;
+  pthread_mutex_t pass; // held by the tier thread while it evicts or compacts
+  int inherit; // file of a predecessor to go on with, -1 for none, see tier_inherit
+  unsigned int igen;
+  bool inherited;
+  char *path;
+  unsigned long budget; // bytes of values kept in memory
+  tier_file_t *cur, *old;
+  atomic_ulong live; // bytes of records still referenced by the table
+  tier_job_t *head, *tail;
+  pthread_t thread, loaders[TIER_LOADERS];
+  bool init;
+} tier_t;
+
+static tier_t tier = {
+  .mtx  = PTHREAD_MUTEX_INITIALIZER,
+  .cnd  = PTHREAD_COND_INITIALIZER,
+  .pass = PTHREAD_MUTEX_INITIALIZER,
+  .inherit = -1,
+  .inherited = false,
+  .cur  = NULL,
+  .old  = NULL,
+  .head = NULL,
+  .tail = NULL,
+  .init = false
+};
+
+static tier_file_t *tier_open(const unsigned int gen)
+{
+  tier_file_t *f = calloc(1, sizeof(tier_file_t));
+  if (f == NULL) return NULL;
+
+  const size_t lpath = strlen(tier.path) + 8;
+  if ((f->path = malloc(lpath)) == NULL) goto tier_open_error;
+  snprintf(f->path, lpath, "%s.%u", tier.path, gen & 0xffff);
+  if ((f->fd = open(f->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+  {
+    perror("(tier) open");
+    goto tier_open_error;
+  }
+
+  f->gen = gen & 0xffff;
+  f->size = 0;
+  f->retired = false;
+  atomic_init(&f->refs, 1); // the tier's own reference
+  return f;
+
+  tier_open_error:
+  free(f->path);
+  free(f);
+  return NULL;
+}
+
+// the file of generation gen a predecessor handed over, appended to where it ends. its
+// path comes from the descriptor, the predecessor may have used another --tier-file
+static tier_file_t *tier_adopt(const int fd, const unsigned int gen)
+{
+  char link[32];
+  struct stat st;
+  ssize_t n;
+
+  tier_file_t *f = calloc(1, sizeof(tier_file_t));
+  if (f == NULL) return NULL;
+  if (fstat(fd, &st) < 0 || (f->path = malloc(PATH_MAX)) == NULL) goto tier_adopt_error;
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  if ((n = readlink(link, f->path, PATH_MAX - 1)) < 0)
+  {
+    perror("(tier) readlink");
+    goto tier_adopt_error;
+  }
+  f->path[n] = '\0';
+
+  f->fd = fd;
+  f->gen = gen & 0xffff;
+  f->size = (unsigned long)st.st_size;
+  f->retired = false;
+  atomic_init(&f->refs, 1);
+  return f;
+
+  tier_adopt_error:
+  free(f->path);
+  free(f);
+  return NULL;
+}
+
+static void tier_unref(tier_file_t *f)
+{
+  if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) != 1) return;
+  close(f->fd);
+  if (f->retired) unlink(f->path);
+  free(f->path);
+  free(f);
+}
+
+// the file holding loc with a reference taken, NULL once compaction retired it
+static tier_file_t *tier_file(const unsigned long loc)
+{
+  tier_file_t *f = NULL;
+
+  pthread_mutex_lock(&tier.mtx);
+  if (tier.cur != NULL && tier.cur->gen == TIER_GEN(loc)) f = tier.cur;
+  else if (tier.old != NULL && tier.old->gen == TIER_GEN(loc)) f = tier.old;
+  if (f != NULL) atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&tier.mtx);
+  return f;
+}
+
+// lkey (4) | lstored (4) | lvalue (8) | version (8) | enc (1) | pad (1) | namespace (2) | pad (4)
+static void tier_header(char *header, const unsigned short ns, const unsigned int lkey, const unsigned long lstored,
+  const unsigned long lvalue, const unsigned long long version, const unsigned char enc)
+{
+  const unsigned int lstored32 = lstored;
+
+  memset(header, 0, TIER_HEADER);
+  memcpy(header, &lkey, 4);
+  memcpy(header + 4, &lstored32, 4);
+  memcpy(header + 8, &lvalue, 8);
+  memcpy(header + 16, &version, 8);
+  header[24] = enc;
+  memcpy(header + 26, &ns, 2);
+}
+
+// appends a record for key of namespace ns, *loc gets where it went. only the tier
+// thread appends.
+int tier_append(const unsigned short ns, const char *key, const unsigned int lkey, const char *stored,
+  const unsigned long lstored, const unsigned long lvalue, const unsigned long long version, const unsigned char enc,
+  unsigned long *loc)
+{
+  static const char pad[8] = {0};
+  char header[TIER_HEADER];
+  const unsigned long lrecord = TIER_RECORD(lkey, lstored);
+  tier_file_t *f;
+  unsigned long off;
+
+  tier_header(header, ns, lkey, lstored, lvalue, version, enc);
+
+  pthread_mutex_lock(&tier.mtx);
+  f = tier.cur;
+  off = f->size;
+  f->size += lrecord;
+  atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&tier.mtx);
+
+  struct iovec iov[4] = {
+    {.iov_base = header, .iov_len = TIER_HEADER},
+    {.iov_base = (char*)key, .iov_len = lkey},
+    {.iov_base = (char*)stored, .iov_len = lstored},
+    {.iov_base = (char*)pad, .iov_len = lrecord - TIER_HEADER - lkey - lstored}
+  };
+  const ssize_t n = pwritev(f->fd, iov, 4, off);
+  const unsigned int gen = f->gen;
+  tier_unref(f);
+  if (n < 0 || (unsigned long)n != lrecord)
+  {
+    if (n < 0) perror("(tier) pwritev");
+    return -1;
+  }
+
+  atomic_fetch_add_explicit(&tier.live, lrecord, memory_order_relaxed);
+  *loc = TIER_LOC(gen, off);
+  return 0;
+}
+
+// reads the lstored bytes of the value kept at loc for key into dst, *enc gets the
+// encoding they had in memory. TIER_EMOVED when compaction moved the record since
+// the caller looked up loc.
+int tier_read(const unsigned long loc, const char *key, const unsigned int lkey, const unsigned long lstored,
+  char *dst, unsigned char *enc)
+{
+  char header[TIER_HEADER];
+  unsigned int hkey, hstored;
+  int ret = -1;
+  tier_file_t *f;
+  char *kbuf;
+
+  if ((f = tier_file(loc)) == NULL) return TIER_EMOVED;
+  if ((kbuf = malloc(lkey > 0 ? lkey : 1)) == NULL) goto tier_read_final;
+
+  struct iovec iov[3] = {
+    {.iov_base = header, .iov_len = TIER_HEADER},
+    {.iov_base = kbuf, .iov_len = lkey},
+    {.iov_base = dst, .iov_len = lstored}
+  };
+  const ssize_t n = preadv(f->fd, iov, 3, TIER_OFF(loc));
+  if (n < 0)
+  {
+    perror("(tier) preadv");
+    goto tier_read_final;
+  }
+
+  memcpy(&hkey, header, 4);
+  memcpy(&hstored, header + 4, 4);
+  if ((unsigned long)n != TIER_HEADER + lkey + lstored || hkey != lkey || hstored != lstored ||
+      memcmp(kbuf, key, lkey) != 0)
+  {
+    fprintf(stderr, "(tier) corrupt record at %lu\n", TIER_OFF(loc));
+    goto tier_read_final;
+  }
+  *enc = header[24];
+  stats_add(STATS_TIER_READS, 1);
+  ret = 0;
+
+  tier_read_final:
+  free(kbuf);
+  tier_unref(f);
+  return ret;
+}
+
+// the record of a value that left the tier is dead weight until compaction
+void tier_forget(const unsigned int lkey, const unsigned long lstored)
+{
+  atomic_fetch_sub_explicit(&tier.live, TIER_RECORD(lkey, lstored), memory_order_relaxed);
+}
+
+// a record of an inherited file the table points at again
+void tier_keep(const unsigned int lkey, const unsigned long lstored)
+{
+  atomic_fetch_add_explicit(&tier.live, TIER_RECORD(lkey, lstored), memory_order_relaxed);
+}
+
+static unsigned long tier_size(void)
+{
+  pthread_mutex_lock(&tier.mtx);
+  const unsigned long size = tier.cur->size + (tier.old != NULL ? tier.old->size : 0);
+  pthread_mutex_unlock(&tier.mtx);
+  return size;
+}
+
+// copies the records the table still points at into a new generation, then drops
+// the old file. runs on the tier thread, so nothing is evicted meanwhile.
+static void tier_compact(void)
+{
+  char header[TIER_HEADER];
+  unsigned int lkey, lstored;
+  tier_file_t *next, *old;
+  unsigned long loc;
+
+  pthread_mutex_lock(&tier.mtx);
+  if ((next = tier_open(tier.cur->gen + 1)) == NULL)
+  {
+    pthread_mutex_unlock(&tier.mtx);
+    return;
+  }
+  old = tier.old = tier.cur;
+  tier.cur = next;
+  pthread_mutex_unlock(&tier.mtx);
+
+  for (unsigned long off = 0; off < old->size; off += TIER_RECORD(lkey, lstored))
+  {
+    if (pread(old->fd, header, TIER_HEADER, off) != TIER_HEADER) break;
+    memcpy(&lkey, header, 4);
+    memcpy(&lstored, header + 4, 4);
+
+    char *record = malloc(TIER_HEADER + lkey + 1 + lstored);
+    if (record == NULL) break;
+    if (pread(old->fd, record, TIER_HEADER + lkey + lstored, off) != (ssize_t)(TIER_HEADER + lkey + lstored))
+    {
+      free(record);
+      break;
+    }
+
+    // the key is terminated in place, the value is read from behind it first
+    char *key = record + TIER_HEADER, *stored = key + lkey;
+    memmove(stored + 1, stored, lstored);
+    stored[0] = '\0';
+    stored++;
+
+    unsigned long lvalue;
+    unsigned long long version;
+    unsigned short ns;
+    memcpy(&lvalue, header + 8, 8);
+    memcpy(&version, header + 16, 8);
+    memcpy(&ns, header + 26, 2);
+
+    const unsigned long from = TIER_LOC(old->gen, off);
+    table *t = table_namespace(ns);
+    if (t != NULL && table_tier_live(t, key, from) &&
+        tier_append(ns, key, lkey, stored, lstored, lvalue, version, header[24], &loc) == 0)
+    {
+      // either the old record or the copy is dead now
+      table_tier_move(t, key, from, loc);
+      tier_forget(lkey, lstored);
+    }
+    free(record);
+  }
+
+  pthread_mutex_lock(&tier.mtx);
+  old->retired = true;
+  tier.old = NULL;
+  pthread_mutex_unlock(&tier.mtx);
+  tier_unref(old);
+  stats_add(STATS_TIER_COMPACTIONS, 1);
+}
+
+// values in memory over all namespaces, *largest gets the namespace holding most
+static unsigned long tier_resident(table **largest)
+{
+  unsigned long total = 0, most = 0;
+
+  for (unsigned int in = 0; in < table_namespaces(); ++in)
+  {
+    table *t = table_namespace(in);
+    const unsigned long resident = table_resident(t);
+    total += resident;
+    if (largest != NULL && (in == 0 || resident > most))
+    {
+      most = resident;
+      *largest = t;
+    }
+  }
+  return total;
+}
+
+static void *tier_thread_fn(void *args)
+{
+  (void)args;
+  const struct timespec interval = {.tv_sec = 0, .tv_nsec = TIER_INTERVAL_MS * 1000000l};
+  table *t;
+
+  while (1)
+  {
+    nanosleep(&interval, NULL);
+    pthread_mutex_lock(&tier.pass);
+
+    // the budget is shared, the namespace using most of it gives values up first
+    for (unsigned int ip = 0; ip < TIER_PASSES && tier_resident(&t) > tier.budget; ++ip)
+      if (table_evict(t) < 0) break;
+
+    const unsigned long size = tier_size(), live = atomic_load_explicit(&tier.live, memory_order_relaxed);
+    if (size - live > TIER_COMPACT_MIN && size - live > live) tier_compact();
+    pthread_mutex_unlock(&tier.pass);
+  }
+  return NULL;
+}
+
+static void *tier_loader_fn(void *args)
+{
+  (void)args;
+  while (1)
+  {
+    pthread_mutex_lock(&tier.mtx);
+    while (tier.head == NULL) pthread_cond_wait(&tier.cnd, &tier.mtx);
+    tier_job_t *job = tier.head;
+    tier.head = job->nxt;
+    if (tier.head == NULL) tier.tail = NULL;
+    pthread_mutex_unlock(&tier.mtx);
+
+    job->fn(job->arg);
+    free(job);
+  }
+  return NULL;
+}
+
+// runs fn on a loader thread, for work that waits on the disk
+int tier_submit(const tier_job_fn fn, void *arg)
+{
+  tier_job_t *job = malloc(sizeof(tier_job_t));
+  if (job == NULL) return -1;
+  job->fn = fn;
+  job->arg = arg;
+  job->nxt = NULL;
+
+  pthread_mutex_lock(&tier.mtx);
+  if (tier.tail != NULL) tier.tail->nxt = job;
+  else tier.head = job;
+  tier.tail = job;
+  pthread_cond_signal(&tier.cnd);
+  pthread_mutex_unlock(&tier.mtx);
+  return 0;
+}
+
+bool tier_enabled(void)
+{
+  return tier.init;
+}
+
+void tier_report(FILE *f)
+{
+  if (!tier.init) return;
+  fprintf(f, "tier_resident_bytes:%lu\n", tier_resident(NULL));
+  fprintf(f, "tier_file_bytes:%lu\n", tier_size());
+  fprintf(f, "tier_live_bytes:%lu\n", atomic_load_explicit(&tier.live, memory_order_relaxed));
+}
+
+// stops evicting and compacting until tier_resume and returns the descriptor of the
+// one file left, *gen gets its generation. -1 without a tier. for a process handing its
+// data over, the records the tables point at stay where they are from here on
+int tier_handover(unsigned int *gen)
+{
+  if (!tier.init) return -1;
+  pthread_mutex_lock(&tier.pass);
+  *gen = tier.cur->gen;
+  return tier.cur->fd;
+}
+
+// a handover that did not go through, the tier goes on
+void tier_resume(void)
+{
+  if (tier.init) pthread_mutex_unlock(&tier.pass);
+}
+
+// has tier_setup go on with the file of generation gen at fd instead of starting an
+// empty one, the tier takes fd over then
+void tier_inherit(const int fd, const unsigned int gen)
+{
+  tier.inherit = fd;
+  tier.igen = gen;
+}
+
+// whether tier_setup took over the file of tier_inherit
+bool tier_inherited(void)
+{
+  return tier.inherited;
+}
+
+// values beyond budget bytes in memory spill to files named path.<generation>
+int tier_setup(const char *path, const unsigned long budget)
+{
+  if (tier.init) return 0;
+  if ((tier.path = strdup(path)) == NULL) return -1;
+  if (tier.inherit >= 0)
+  {
+    if ((tier.cur = tier_adopt(tier.inherit, tier.igen)) == NULL) return -1;
+    tier.inherited = true;
+  }
+  else if ((tier.cur = tier_open(0)) == NULL) return -1;
+  tier.budget = budget;
+  atomic_init(&tier.live, 0);
+  tier.init = true;
+
+  if (pthread_create(&tier.thread, NULL, tier_thread_fn, NULL) != 0)
+  {
+    perror("(tier) pthread_create");
+    return -1;
+  }
+  for (unsigned int il = 0; il < TIER_LOADERS; ++il)
+    if (topology_thread_create(&tier.loaders[il], TOPOLOGY_ROLE_PROCESSOR, il, tier_loader_fn, NULL) < 0)
+    {
+      perror("(tier) topology_thread_create");
+      return -1;
+    }
+  return 0;
+}
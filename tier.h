@@ -0,0 +1,59 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// cold values are appended to a file as records of header | key | stored value,
+// 8 byte aligned. a location is the file generation (16 bits) and the offset (48).
+#define TIER_HEADER 32
+#define TIER_LOC(gen, off) (((unsigned long)(gen) << 48) | (unsigned long)(off))
+#define TIER_GEN(loc) ((unsigned int)((loc) >> 48))
+#define TIER_OFF(loc) ((loc) & ((1ul << 48) - 1))
+#define TIER_RECORD(lkey, lstored) ((TIER_HEADER + (unsigned long)(lkey) + (lstored) + 7) & ~7ul)
+
+#define TIER_MINVALUE 256            // smaller values stay in memory
+#define TIER_BATCH 256               // values evicted per pass
+#define TIER_INTERVAL_MS 100         // between passes of the tier thread
+#define TIER_COMPACT_MIN (64ul << 20) // dead bytes before the file is compacted
+#define TIER_LOADERS 2               // threads loading cold values back
+#define TIER_PASSES 64               // eviction passes per interval at most
+#define TIER_EMOVED -2               // the location is in a file compaction retired
+
+typedef void (*tier_job_fn)(void*);
+
+int tier_setup(const char*, unsigned long);
+bool tier_enabled(void);
+int tier_append(unsigned short, const char*, unsigned int, const char*, unsigned long, unsigned long, unsigned long long,
+  unsigned char, unsigned long*);
+int tier_read(unsigned long, const char*, unsigned int, unsigned long, char*, unsigned char*);
+void tier_forget(unsigned int, unsigned long);
+void tier_keep(unsigned int, unsigned long);
+int tier_submit(tier_job_fn, void*);
+void tier_report(FILE*);
+int tier_handover(unsigned int*);
+void tier_resume(void);
+void tier_inherit(int, unsigned int);
+bool tier_inherited(void);
+
+#endif //TIER_H
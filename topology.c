@@ -0,0 +1,315 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#define _GNU_SOURCE
+#include "topology.h"
+#include "ufkvs.h"
+#include "arena.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TOPOLOGY_MAXTHREADS 2048
+#define TOPOLOGY_MPOL_PREFERRED 1
+#define TOPOLOGY_MPOL_INTERLEAVE 3
+
+typedef struct topology_thread
+{
+  int role;
+  unsigned int index;
+  int cpu;
+} topology_thread_t;
+
+typedef struct topology
+{
+  unsigned int ncpus, nnodes, nlist, nthreads;
+  bool init;
+  int affinity; // UFKVS_AFFINITY_*
+  unsigned int workers, processors; // threads placed per role, processors after the workers
+  int cpus[CPU_SETSIZE];        // allowed cpus ordered by node, then id
+  int cpunode[CPU_SETSIZE];     // numa node of each cpu id
+  int list[CPU_SETSIZE];        // the cpu list, in the given order
+  int nodes[TOPOLOGY_MAXNODES]; // nodes having at least one allowed cpu
+  unsigned int nodeoff[TOPOLOGY_MAXNODES], nodecnt[TOPOLOGY_MAXNODES];
+  topology_thread_t threads[TOPOLOGY_MAXTHREADS];
+} topology_t;
+
+static topology_t topo = {
+  .init = false
+};
+
+static const char *topology_policy_name(const int affinity)
+{
+  switch (affinity)
+  {
+  case UFKVS_AFFINITY_COMPACT: return "compact";
+  case UFKVS_AFFINITY_SPREAD: return "spread";
+  case UFKVS_AFFINITY_LIST: return "list";
+  default: return "none";
+  }
+}
+
+// parses the kernel cpulist format ("0-3,8,10-11")
+static int topology_parse_list(const char *str, int *out, const unsigned int max)
+{
+  unsigned int n = 0;
+  const char *p = str;
+
+  while (*p != '\0' && *p != '\n')
+  {
+    char *end;
+    long lo = strtol(p, &end, 10), hi;
+    if (end == p || lo < 0) return -1;
+    hi = lo;
+    p = end;
+    if (*p == '-')
+    {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1 || hi < lo) return -1;
+      p = end;
+    }
+    for (long c = lo; c <= hi; ++c)
+    {
+      if (n >= max || c >= CPU_SETSIZE) return -1;
+      out[n++] = (int)c;
+    }
+    if (*p == ',') p++;
+    else if (*p != '\0' && *p != '\n') return -1;
+  }
+
+  return (int)n;
+}
+
+static void topology_read_nodes(void)
+{
+  char path[64], line[4096];
+  int cpus[CPU_SETSIZE];
+
+  for (unsigned int ic = 0; ic < CPU_SETSIZE; ++ic) topo.cpunode[ic] = 0;
+
+  for (int in = 0; in < TOPOLOGY_MAXNODES; ++in)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", in);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) continue;
+    if (fgets(line, sizeof(line), f) != NULL)
+    {
+      int n = topology_parse_list(line, cpus, CPU_SETSIZE);
+      for (int ic = 0; ic < n; ++ic) topo.cpunode[cpus[ic]] = in;
+    }
+    fclose(f);
+  }
+}
+
+static int topology_slot(const int role, const unsigned int index)
+{
+  if (role == TOPOLOGY_ROLE_PROCESSOR) return (int)(topo.workers + index);
+  return (int)index;
+}
+
+static int topology_cpu(const int role, const unsigned int index)
+{
+  const unsigned int slot = topology_slot(role, index);
+
+  if (!topo.init || topo.ncpus == 0) return -1;
+  switch (topo.affinity)
+  {
+  case UFKVS_AFFINITY_COMPACT:
+    return topo.cpus[slot % topo.ncpus];
+  case UFKVS_AFFINITY_SPREAD:
+  {
+    const int node = topo.nodes[slot % topo.nnodes];
+    const unsigned int nth = slot / topo.nnodes;
+    return topo.cpus[topo.nodeoff[node] + nth % topo.nodecnt[node]];
+  }
+  case UFKVS_AFFINITY_LIST:
+    return topo.list[slot % topo.nlist];
+  default:
+    return -1;
+  }
+}
+
+static unsigned long topology_role_nodemask(const int role)
+{
+  unsigned long mask = 0;
+  const unsigned int count = role == TOPOLOGY_ROLE_PROCESSOR ? topo.processors : topo.workers;
+
+  for (unsigned int it = 0; it < count; ++it)
+  {
+    const int cpu = topology_cpu(role, it);
+    if (cpu < 0) return 0;
+    mask |= 1ul << topo.cpunode[cpu];
+  }
+
+  return mask;
+}
+
+// reads the cpus and nodes the process may use. workers and processors threads are
+// placed by affinity, cpus lists the cpus for UFKVS_AFFINITY_LIST
+int topology_setup(const int affinity, const char *cpus, const unsigned int workers, const unsigned int processors)
+{
+  cpu_set_t allowed;
+
+  if (topo.init) return 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+  {
+    perror("(topology) sched_getaffinity");
+    return -1;
+  }
+
+  topology_read_nodes();
+
+  topo.ncpus = 0;
+  topo.nnodes = 0;
+  for (int in = 0; in < TOPOLOGY_MAXNODES; ++in)
+  {
+    topo.nodeoff[in] = topo.ncpus;
+    topo.nodecnt[in] = 0;
+    for (int ic = 0; ic < CPU_SETSIZE; ++ic)
+    {
+      if (!CPU_ISSET(ic, &allowed) || topo.cpunode[ic] != in) continue;
+      topo.cpus[topo.ncpus++] = ic;
+      topo.nodecnt[in]++;
+    }
+    if (topo.nodecnt[in] > 0) topo.nodes[topo.nnodes++] = in;
+  }
+
+  if (affinity == UFKVS_AFFINITY_LIST)
+  {
+    int n = cpus != NULL ? topology_parse_list(cpus, topo.list, CPU_SETSIZE) : -1;
+    if (n <= 0)
+    {
+      fprintf(stderr, "(topology) invalid cpu list: %s\n", cpus != NULL ? cpus : "(none)");
+      return -1;
+    }
+    for (int ic = 0; ic < n; ++ic)
+      if (!CPU_ISSET(topo.list[ic], &allowed))
+      {
+        fprintf(stderr, "(topology) cpu %d is not available\n", topo.list[ic]);
+        return -1;
+      }
+    topo.nlist = (unsigned int)n;
+  }
+
+  topo.affinity = affinity;
+  topo.workers = workers;
+  topo.processors = processors;
+  topo.nthreads = 0;
+  topo.init = true;
+  return 0;
+}
+
+int topology_thread_create(pthread_t *thread, const int role, const unsigned int index, void *(*fn)(void*), void *args)
+{
+  pthread_attr_t attr;
+  cpu_set_t set;
+  const int cpu = topology_cpu(role, index);
+
+  if (pthread_attr_init(&attr) != 0)
+  {
+    perror("(topology) pthread_attr_init");
+    return -1;
+  }
+
+  // pin before the thread runs so everything it first-touches lands on its node
+  if (cpu >= 0)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0)
+      perror("(topology) pthread_attr_setaffinity_np");
+  }
+
+  if (pthread_create(thread, &attr, fn, args) != 0)
+  {
+    perror("(topology) pthread_create");
+    pthread_attr_destroy(&attr);
+    return -1;
+  }
+  pthread_attr_destroy(&attr);
+
+  if (topo.nthreads < TOPOLOGY_MAXTHREADS)
+  {
+    topo.threads[topo.nthreads].role = role;
+    topo.threads[topo.nthreads].index = index;
+    topo.threads[topo.nthreads].cpu = cpu;
+    topo.nthreads++;
+  }
+
+  return 0;
+}
+
+// anonymous memory placed on the node(s) of the threads of a role, on huge pages
+// when it is large enough. mmap'd memory is zeroed, so this stands in for calloc.
+void *topology_alloc(const size_t size, const int role)
+{
+  static bool warned = false;
+  void *mem;
+
+  if ((mem = arena_map(size)) == NULL) return NULL;
+
+  const unsigned long mask = topology_role_nodemask(role);
+  if (mask == 0) return mem;
+
+  const int mode = __builtin_popcountl(mask) > 1 ? TOPOLOGY_MPOL_INTERLEAVE : TOPOLOGY_MPOL_PREFERRED;
+  if (syscall(SYS_mbind, mem, size, mode, &mask, TOPOLOGY_MAXNODES + 1, 0) < 0 && !warned)
+  {
+    // placement is an optimization, keep the memory anyway
+    perror("(topology) mbind");
+    warned = true;
+  }
+
+  return mem;
+}
+
+void topology_free(void *mem, const size_t size)
+{
+  arena_unmap(mem, size);
+}
+
+void topology_report(void)
+{
+  printf("(topology) %u node(s), %u cpu(s), affinity: %s\n",
+    topo.nnodes, topo.ncpus, topology_policy_name(topo.affinity));
+  printf("(topology) %u worker(s), %u processor(s)\n", topo.workers, topo.processors);
+
+  for (unsigned int it = 0; it < topo.nthreads; ++it)
+  {
+    const topology_thread_t *t = &topo.threads[it];
+    const char *name = t->role == TOPOLOGY_ROLE_PROCESSOR ? "processor" : "worker";
+    if (t->cpu < 0) printf("(topology) %s %u -> unpinned\n", name, t->index);
+    else printf("(topology) %s %u -> cpu %d (node %d)\n", name, t->index, t->cpu, topo.cpunode[t->cpu]);
+  }
+
+  const unsigned long mask = topology_role_nodemask(TOPOLOGY_ROLE_PROCESSOR);
+  if (mask == 0)
+  {
+    printf("(topology) table memory -> first touch\n");
+    return;
+  }
+  printf("(topology) table memory -> %s node(s):", __builtin_popcountl(mask) > 1 ? "interleaved on" : "preferred");
+  for (int in = 0; in < TOPOLOGY_MAXNODES; ++in)
+    if (mask & (1ul << in)) printf(" %d", in);
+  printf("\n");
+}
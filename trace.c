@@ -0,0 +1,234 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "trace.h"
+#include "stats.h"
+#include "table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+typedef struct trace_slot
+{
+  atomic_ulong seq; // position + 1 once the span is whole, 0 while it is written
+  trace_span_t span;
+} trace_slot_t;
+
+// written by its thread alone, read by the dump without stopping it
+typedef struct trace_ring
+{
+  atomic_ulong head; // spans committed so far
+  struct trace_ring *nxt;
+  trace_slot_t slots[TRACE_RING];
+} trace_ring_t;
+
+typedef struct trace
+{
+  unsigned int every; // 1 in every requests is traced, 0 for none
+  atomic_ulong serial;
+  pthread_mutex_t mtx; // the list of rings
+  trace_ring_t *rings;
+} trace_t;
+
+static trace_t trace = {
+  .every = 0,
+  .mtx = PTHREAD_MUTEX_INITIALIZER,
+  .rings = NULL
+};
+
+static const char *stages[TRACE_STAGES - 1] = {"epoll", "parse", "queue", "exec", "write"};
+
+static _Thread_local int tid;
+static _Thread_local unsigned int tick;
+static _Thread_local unsigned long woke, locked; // ns, of this worker's last wake up and read
+static _Thread_local trace_span_t *current; // of the request this processor thread runs
+static _Thread_local unsigned long lockbase; // table_lockwait() when current was set
+static _Thread_local trace_ring_t *ring;
+
+static int trace_tid(void)
+{
+  if (tid == 0) tid = (int)syscall(SYS_gettid);
+  return tid;
+}
+
+void trace_setup(const unsigned int every)
+{
+  trace.every = every;
+}
+
+bool trace_enabled(void)
+{
+  return trace.every > 0;
+}
+
+// the epoll loop of a worker returned with events
+void trace_woke(void)
+{
+  if (trace.every > 0) woke = stats_now();
+}
+
+// a worker took the mutex of the connection it reads
+void trace_locked(void)
+{
+  if (trace.every > 0) locked = stats_now();
+}
+
+// a span for the request about to be queued, NULL unless it is sampled
+trace_span_t *trace_sample(const int fd, const unsigned int id, const unsigned short cmd)
+{
+  trace_span_t *span;
+
+  if (trace.every == 0 || ++tick % trace.every != 0) return NULL;
+  if ((span = calloc(1, sizeof(trace_span_t))) == NULL) return NULL;
+
+  span->fd = fd;
+  span->id = id;
+  span->cmd = cmd;
+  span->serial = atomic_fetch_add_explicit(&trace.serial, 1, memory_order_relaxed) + 1;
+  if (woke > 0)
+  {
+    span->t[TRACE_WAKE] = woke;
+    span->tid[TRACE_WAKE] = trace_tid();
+  }
+  if (locked > 0)
+  {
+    span->t[TRACE_READ] = locked;
+    span->tid[TRACE_READ] = trace_tid();
+  }
+  return span;
+}
+
+void trace_stamp(trace_span_t *span, const unsigned int stage)
+{
+  if (span == NULL || stage >= TRACE_STAGES) return;
+  span->t[stage] = stats_now();
+  span->tid[stage] = trace_tid();
+}
+
+// the next reply the calling thread queues takes span along
+void trace_set_current(trace_span_t *span)
+{
+  current = span;
+  if (span != NULL) lockbase = table_lockwait();
+}
+
+// the span of the reply being queued, stamped done, or NULL
+trace_span_t *trace_claim(void)
+{
+  trace_span_t *span = current;
+
+  if (span == NULL) return NULL;
+  current = NULL;
+  trace_stamp(span, TRACE_DONE);
+  span->lockwait = table_lockwait() - lockbase;
+  return span;
+}
+
+static trace_ring_t *trace_ring_new(void)
+{
+  trace_ring_t *r = calloc(1, sizeof(trace_ring_t));
+  if (r == NULL) return NULL;
+
+  pthread_mutex_lock(&trace.mtx);
+  r->nxt = trace.rings;
+  trace.rings = r;
+  pthread_mutex_unlock(&trace.mtx);
+  return r;
+}
+
+// keeps a finished span in the calling thread's ring, overwriting its oldest
+void trace_commit(trace_span_t *span)
+{
+  if (span == NULL) return;
+  if (ring == NULL && (ring = trace_ring_new()) == NULL)
+  {
+    free(span);
+    return;
+  }
+
+  const unsigned long pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  trace_slot_t *slot = &ring->slots[pos & (TRACE_RING - 1)];
+  atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  slot->span = *span;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  atomic_store_explicit(&ring->head, pos + 1, memory_order_release);
+  free(span);
+}
+
+// a span as one async track: the request, with a slice per stage it went through
+static void trace_events(FILE *f, const trace_span_t *span, bool *first)
+{
+  unsigned long begin = 0, end = 0;
+
+  for (unsigned int is = 0; is < TRACE_STAGES; ++is)
+  {
+    if (span->t[is] == 0) continue;
+    if (begin == 0) begin = span->t[is];
+    end = span->t[is];
+  }
+  if (begin == 0) return;
+
+  fprintf(f, "%s{\"name\":\"request\",\"cat\":\"ugkv\",\"ph\":\"b\",\"id\":%lu,\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+    "\"args\":{\"cmd\":%u,\"id\":%u,\"fd\":%d,\"lockwait_ns\":%lu}}", *first ? "" : ",\n", span->serial,
+    span->tid[TRACE_DONE], begin / 1000.0, span->cmd, span->id, span->fd, span->lockwait);
+  *first = false;
+
+  for (unsigned int is = 0; is + 1 < TRACE_STAGES; ++is)
+  {
+    if (span->t[is] == 0 || span->t[is + 1] < span->t[is]) continue;
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"ugkv\",\"ph\":\"b\",\"id\":%lu,\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+      "\"args\":{\"thread\":%d}}", stages[is], span->serial, span->tid[is + 1], span->t[is] / 1000.0,
+      span->tid[is + 1]);
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"ugkv\",\"ph\":\"e\",\"id\":%lu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+      stages[is], span->serial, span->tid[is + 1], span->t[is + 1] / 1000.0);
+  }
+
+  fprintf(f, ",\n{\"name\":\"request\",\"cat\":\"ugkv\",\"ph\":\"e\",\"id\":%lu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+    span->serial, span->tid[TRACE_DONE], end / 1000.0);
+}
+
+// every span in the rings, as chrome trace event json perfetto loads too
+void trace_dump(FILE *f)
+{
+  bool first = true;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  pthread_mutex_lock(&trace.mtx);
+  for (const trace_ring_t *r = trace.rings; r != NULL; r = r->nxt)
+  {
+    const unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+    for (unsigned long pos = head > TRACE_RING ? head - TRACE_RING : 0; pos < head; ++pos)
+    {
+      const trace_slot_t *slot = &r->slots[pos & (TRACE_RING - 1)];
+      if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) continue;
+      const trace_span_t span = slot->span;
+      atomic_thread_fence(memory_order_acquire);
+      // overwritten while copied
+      if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != pos + 1) continue;
+      trace_events(f, &span, &first);
+    }
+  }
+  pthread_mutex_unlock(&trace.mtx);
+  fprintf(f, "\n]}\n");
+}
@@ -0,0 +1,62 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// one request in config.trace is followed through the server. its span collects a
+// timestamp per stage on the way and is kept, once the reply is written, in a ring
+// of the thread that wrote it. TRACE dumps the rings as chrome trace events.
+#define TRACE_RING 4096 // spans kept per thread, power of two
+
+#define TRACE_WAKE 0   // epoll_wait returned to the worker
+#define TRACE_READ 1   // the worker holds the connection's mutex
+#define TRACE_QUEUED 2 // handed to the processor
+#define TRACE_START 3  // a processor thread took it
+#define TRACE_DONE 4   // the reply is queued
+#define TRACE_SENT 5   // its last byte is written
+#define TRACE_STAGES 6
+
+typedef struct trace_span
+{
+  unsigned long t[TRACE_STAGES]; // ns, 0 for stages not reached
+  int tid[TRACE_STAGES]; // thread of each stage
+  unsigned long lockwait; // ns of the run spent waiting on table locks
+  unsigned long serial; // tells the spans apart in the dump
+  unsigned int id;
+  unsigned short cmd;
+  int fd;
+} trace_span_t;
+
+void trace_setup(unsigned int);
+bool trace_enabled(void);
+void trace_woke(void);
+void trace_locked(void);
+trace_span_t *trace_sample(int, unsigned int, unsigned short);
+void trace_stamp(trace_span_t*, unsigned int);
+void trace_set_current(trace_span_t*);
+trace_span_t *trace_claim(void);
+void trace_commit(trace_span_t*);
+void trace_dump(FILE*);
+
+#endif //TRACE_H
@@ -0,0 +1,199 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "ufkvs.h"
+#include "table.h"
+#include "topology.h"
+#include "arena.h"
+#include "tier.h"
+#include "defrag.h"
+#include "import.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct ufkvs
+{
+  bool open; // handed out by ufkvs_open and not closed since
+  bool ready; // set up, which happens once per process
+};
+
+static ufkvs_t store = {
+  .open  = false,
+  .ready = false
+};
+
+typedef struct ufkvs_iteration
+{
+  ufkvs_iterate_fn fn;
+  void *args;
+  char *buf;
+  unsigned long lbuf;
+} ufkvs_iteration_t;
+
+static table *ufkvs_table(const ufkvs_t *s, const unsigned int ns)
+{
+  if (s == NULL || !s->open) return NULL;
+  return table_namespace(ns);
+}
+
+// opens the store, NULL takes the defaults. a second open fails with EBUSY until the
+// first handle is closed. opening it again then finds the data as it was left, the
+// options of the first open stay in effect.
+ufkvs_t *ufkvs_open(const ufkvs_options_t *options)
+{
+  const ufkvs_options_t defaults = {.namespaces = 1, .tiermemory = 1ul << 30};
+  const ufkvs_options_t *o = options != NULL ? options : &defaults;
+
+  if (store.open)
+  {
+    errno = EBUSY;
+    return NULL;
+  }
+  if (store.ready)
+  {
+    store.open = true;
+    return &store;
+  }
+
+  if (topology_setup(o->affinity, o->cpus, o->workers, o->processors) < 0)
+  {
+    perror("(ufkvs) topology_setup");
+    return NULL;
+  }
+  if (arena_setup(o->hugepages, o->prefault) < 0)
+  {
+    perror("(ufkvs) arena_setup");
+    return NULL;
+  }
+  if (table_setup(o->namespaces > 0 ? o->namespaces : 1, o->ordered, o->compressmin) < 0)
+  {
+    perror("(ufkvs) table_setup");
+    return NULL;
+  }
+  if (o->tierfile != NULL && tier_setup(o->tierfile, o->tiermemory) < 0)
+  {
+    perror("(ufkvs) tier_setup");
+    return NULL;
+  }
+  if (defrag_setup(o->defrag) < 0)
+  {
+    perror("(ufkvs) defrag_setup");
+    return NULL;
+  }
+
+  store.ready = true;
+  store.open = true;
+  return &store;
+}
+
+// lets go of the handle. the data and the background threads stay until the process
+// exits, the state they share is process wide.
+void ufkvs_close(ufkvs_t *s)
+{
+  if (s == NULL || !s->open) return;
+  arena_flush();
+  s->open = false;
+}
+
+// stores a copy of the lvalue bytes at value under key
+int ufkvs_set(ufkvs_t *s, const unsigned int ns, const char *key, const char *value, const unsigned long lvalue)
+{
+  table *t = ufkvs_table(s, ns);
+  if (t == NULL) return UFKVS_EINVAL;
+  if (lvalue > TABLE_MAXVALUE) return UFKVS_EINVAL;
+  return table_add(t, strlen(key), lvalue, key, value) < 0 ? -1 : 0;
+}
+
+// borrows the value of key without copying it, *value stays valid and unchanged by
+// later writes until it is handed to ufkvs_release
+int ufkvs_get(ufkvs_t *s, const unsigned int ns, const char *key, const char **value, unsigned long *lvalue)
+{
+  table *t = ufkvs_table(s, ns);
+  int ret;
+
+  if (t == NULL) return UFKVS_EINVAL;
+
+  // a value in the tier is brought back right here, the caller asked to wait for it
+  while ((ret = table_borrow(t, key, value, lvalue, NULL)) == TABLE_ECOLD)
+    if (table_load(t, key) < 0) return -1;
+
+  if (ret == TABLE_ENOENT) return UFKVS_ENOENT;
+  return ret < 0 ? -1 : 0;
+}
+
+void ufkvs_release(const char *value)
+{
+  table_release(value);
+}
+
+int ufkvs_del(ufkvs_t *s, const unsigned int ns, const char *key)
+{
+  table *t = ufkvs_table(s, ns);
+  if (t == NULL) return UFKVS_EINVAL;
+
+  return table_del(t, key) == 0 ? 0 : UFKVS_ENOENT;
+}
+
+static int ufkvs_iterate_one(const table_s *e, void *args)
+{
+  ufkvs_iteration_t *it = args;
+
+  if (e->lvalue > it->lbuf)
+  {
+    char *nbuf = realloc(it->buf, e->lvalue);
+    if (nbuf == NULL) return -1;
+    it->buf = nbuf;
+    it->lbuf = e->lvalue;
+  }
+  if (table_read(e, it->buf) != 0) return -1;
+  return it->fn(e->key, e->lkey, it->buf, e->lvalue, it->args);
+}
+
+// hands the keys and values of up to count buckets from *cursor on to fn, which
+// must not call back into the namespace. fn returning 1 ends the call after the
+// current bucket. *cursor is 0 once all were visited, see table_iterate for what
+// the walk guarantees.
+int ufkvs_iterate(ufkvs_t *s, const unsigned int ns, unsigned long *cursor, const unsigned int count,
+  const ufkvs_iterate_fn fn, void *args)
+{
+  ufkvs_iteration_t it = {.fn = fn, .args = args, .buf = NULL, .lbuf = 0};
+  table *t = ufkvs_table(s, ns);
+
+  if (t == NULL) return UFKVS_EINVAL;
+  const int ret = table_iterate(t, cursor, count, ufkvs_iterate_one, &it);
+  free(it.buf);
+  return ret;
+}
+
+// loads the records of the import file at path into ns on up to threads threads,
+// *count tells how many keys were stored even on failure. UFKVS_EINVAL when path is
+// not an import file, see import.h for the layout
+int ufkvs_import(ufkvs_t *s, const unsigned int ns, const char *path, const unsigned int threads,
+  unsigned long *count)
+{
+  table *t = ufkvs_table(s, ns);
+  if (t == NULL) return UFKVS_EINVAL;
+
+  const int ret = import_file(t, path, threads, count);
+  if (ret == IMPORT_EINVAL) return UFKVS_EINVAL;
+  return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef UFKVS_H
+#define UFKVS_H
+
+#include <stdbool.h>
+
+// the store as a library, for processes that embed it instead of talking to ugkv.
+// keys are c strings, values any bytes. the store is process wide: it is opened
+// once and lives until the process exits.
+#define UFKVS_EINVAL -2 // no such namespace, or a value over the size limit
+#define UFKVS_ENOENT -3
+#define UFKVS_API __attribute__((visibility("default"))) // the library exports nothing else
+
+// how threads are pinned to the cpus the process may use
+#define UFKVS_AFFINITY_NONE 0
+#define UFKVS_AFFINITY_COMPACT 1 // in cpu order, node by node
+#define UFKVS_AFFINITY_SPREAD 2 // round robin over the nodes
+#define UFKVS_AFFINITY_LIST 3 // in the order of ufkvs_options.cpus
+
+typedef struct ufkvs_options
+{
+  unsigned int namespaces; // keyspaces, 0 for one
+  bool ordered; // keep the ordered key index
+  unsigned long compressmin; // lz4 compress values from this size on, 0 never
+  const char *tierfile; // spill cold values to this file, NULL keeps everything in memory
+  unsigned long tiermemory; // bytes of values kept in memory with a tier file
+  bool hugepages; // arena on huge pages
+  unsigned long prefault; // bytes of arena touched at open
+  unsigned int defrag; // percent of a cpu the defragmenter may use, 0 disables it
+  int affinity; // UFKVS_AFFINITY_*
+  const char *cpus; // cpu list for UFKVS_AFFINITY_LIST, e.g. "0-3,8"
+  unsigned int workers; // threads of the embedder placed on the first cpus of the policy
+  unsigned int processors; // threads working on the store placed after them, its own loaders among them
+} ufkvs_options_t;
+
+typedef struct ufkvs ufkvs_t;
+
+typedef int (*ufkvs_iterate_fn)(const char*, unsigned int, const char*, unsigned long, void*);
+
+UFKVS_API ufkvs_t *ufkvs_open(const ufkvs_options_t*);
+UFKVS_API void ufkvs_close(ufkvs_t*);
+UFKVS_API int ufkvs_set(ufkvs_t*, unsigned int, const char*, const char*, unsigned long);
+UFKVS_API int ufkvs_get(ufkvs_t*, unsigned int, const char*, const char**, unsigned long*);
+UFKVS_API void ufkvs_release(const char*);
+UFKVS_API int ufkvs_del(ufkvs_t*, unsigned int, const char*);
+UFKVS_API int ufkvs_iterate(ufkvs_t*, unsigned int, unsigned long*, unsigned int, ufkvs_iterate_fn, void*);
+UFKVS_API int ufkvs_import(ufkvs_t*, unsigned int, const char*, unsigned int, unsigned long*);
+
+#endif //UFKVS_H
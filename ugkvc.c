@@ -0,0 +1,636 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "ugkvc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+typedef struct ugkvc_slot
+{
+  unsigned int id;
+  bool used;
+  ugkvc_done_fn fn;
+  void *args;
+} ugkvc_slot_t;
+
+struct ugkvc_conn
+{
+  int fd;
+  bool closed;
+  unsigned int nid; // id of the last request
+  char *out;
+  size_t lout, cout, sent;
+  char *in;
+  size_t lin, cin;
+  ugkvc_slot_t *slots; // by id, a power of two of them
+  unsigned int cslots, npending;
+  unsigned int timeout; // us, sent with every request while not 0
+  ugkvc_done_fn efn; // WATCH events, pushed with id 0
+  void *eargs;
+  struct ugkvc_conn *nxt; // in the pool
+};
+
+struct ugkvc_pool
+{
+  pthread_mutex_t mtx;
+  pthread_cond_t cnd;
+  char *host;
+  unsigned short port;
+  ugkvc_conn_t *free;
+};
+
+typedef struct ugkvc_result
+{
+  int status;
+  char *data; // for GET, malloc'd
+  size_t size;
+  unsigned int *failed; // for MSET and MGET
+} ugkvc_result_t;
+
+static int ugkvc_reserve(char **buf, size_t *cap, const size_t size)
+{
+  if (size <= *cap) return 0;
+
+  size_t ncap = *cap > 0 ? *cap : UGKVC_BUFFER;
+  while (ncap < size) ncap *= 2;
+  char *nbuf = realloc(*buf, ncap);
+  if (nbuf == NULL) return -1;
+  *buf = nbuf;
+  *cap = ncap;
+  return 0;
+}
+
+static ugkvc_conn_t *ugkvc_new(const int fd)
+{
+  ugkvc_conn_t *c = calloc(1, sizeof(ugkvc_conn_t));
+  if (c == NULL) return NULL;
+  if ((c->slots = calloc(UGKVC_PENDING, sizeof(ugkvc_slot_t))) == NULL)
+  {
+    free(c);
+    return NULL;
+  }
+  c->cslots = UGKVC_PENDING;
+  c->fd = fd;
+  return c;
+}
+
+static int ugkvc_nblocking(const int fd)
+{
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+  return 0;
+}
+
+// host NULL is the local machine
+ugkvc_conn_t *ugkvc_connect(const char *host, const unsigned short port)
+{
+  struct addrinfo hints, *res, *ai;
+  char service[8];
+  const int one = 1;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host != NULL ? host : "127.0.0.1", service, &hints, &res) != 0) return NULL;
+
+  for (ai = res; ai != NULL; ai = ai->ai_next)
+  {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0) continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) return NULL;
+
+  // requests are batched by the library already
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  ugkvc_conn_t *c;
+  if (ugkvc_nblocking(fd) < 0 || (c = ugkvc_new(fd)) == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+  return c;
+}
+
+ugkvc_conn_t *ugkvc_connect_unix(const char *path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return NULL;
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return NULL;
+  ugkvc_conn_t *c;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || ugkvc_nblocking(fd) < 0 || (c = ugkvc_new(fd)) == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+  return c;
+}
+
+// fails whatever is still in flight with UGKVC_ECLOSED
+static void ugkvc_fail(ugkvc_conn_t *c)
+{
+  c->closed = true;
+  for (unsigned int is = 0; is < c->cslots && c->npending > 0; ++is)
+    if (c->slots[is].used)
+    {
+      c->slots[is].used = false;
+      c->npending--;
+      if (c->slots[is].fn != NULL) c->slots[is].fn(UGKVC_ECLOSED, NULL, 0, c->slots[is].args);
+    }
+}
+
+void ugkvc_close(ugkvc_conn_t *c)
+{
+  if (c == NULL) return;
+  ugkvc_fail(c);
+  close(c->fd);
+  free(c->out);
+  free(c->in);
+  free(c->slots);
+  free(c);
+}
+
+int ugkvc_fd(const ugkvc_conn_t *c)
+{
+  return c->fd;
+}
+
+// doubles the slots until id has one of its own
+static int ugkvc_grow(ugkvc_conn_t *c, const unsigned int id)
+{
+  unsigned int cslots = c->cslots;
+  ugkvc_slot_t *slots;
+
+  while (1)
+  {
+    cslots *= 2;
+    if ((slots = calloc(cslots, sizeof(ugkvc_slot_t))) == NULL) return -1;
+
+    bool clash = false;
+    for (unsigned int is = 0; is < c->cslots && !clash; ++is)
+    {
+      if (!c->slots[is].used) continue;
+      ugkvc_slot_t *s = &slots[c->slots[is].id & (cslots - 1)];
+      if (s->used) clash = true;
+      *s = c->slots[is];
+    }
+    if (!clash && !slots[id & (cslots - 1)].used) break;
+    free(slots);
+  }
+
+  free(c->slots);
+  c->slots = slots;
+  c->cslots = cslots;
+  return 0;
+}
+
+// queues the header of a request with size bytes of payload and returns where the
+// payload goes, NULL when out of memory
+static char *ugkvc_frame(ugkvc_conn_t *c, const unsigned short cmd, const size_t size, const ugkvc_done_fn fn,
+  void *args)
+{
+  // id 0 is for frames the server pushes
+  if (++c->nid == 0) c->nid = 1;
+  const unsigned int id = c->nid, lprefix = c->timeout > 0 ? 4 : 0, size32 = size + lprefix;
+  const unsigned short flags = c->timeout > 0 ? PROTOCOL_FLAG_DEADLINE : 0;
+
+  if (c->slots[id & (c->cslots - 1)].used && ugkvc_grow(c, id) < 0) return NULL;
+  if (ugkvc_reserve(&c->out, &c->cout, c->lout + PROTOCOL_HEADER + size32) < 0) return NULL;
+
+  ugkvc_slot_t *s = &c->slots[id & (c->cslots - 1)];
+  s->id = id;
+  s->used = true;
+  s->fn = fn;
+  s->args = args;
+  c->npending++;
+
+  char *frame = c->out + c->lout;
+  memcpy(frame, &size32, 4);
+  memcpy(frame + 4, &(unsigned short){cmd | flags}, 2);
+  memcpy(frame + 6, &id, 4);
+  if (lprefix > 0) memcpy(frame + PROTOCOL_HEADER, &c->timeout, 4);
+  c->lout += PROTOCOL_HEADER + size32;
+  return frame + PROTOCOL_HEADER + lprefix;
+}
+
+// queues a request, fn gets its reply. nothing is written until ugkvc_flush
+int ugkvc_send(ugkvc_conn_t *c, const unsigned short cmd, const char *payload, const size_t size,
+  const ugkvc_done_fn fn, void *args)
+{
+  char *p;
+
+  if (c->closed) return UGKVC_ECLOSED;
+  if ((p = ugkvc_frame(c, cmd, size, fn, args)) == NULL) return -1;
+  if (size > 0) memcpy(p, payload, size);
+  return 0;
+}
+
+int ugkvc_send_set(ugkvc_conn_t *c, const char *key, const size_t lkey, const char *value, const size_t lvalue,
+  const ugkvc_done_fn fn, void *args)
+{
+  const unsigned int lkey32 = lkey, lvalue32 = lvalue;
+  char *p;
+
+  if (c->closed) return UGKVC_ECLOSED;
+  if ((p = ugkvc_frame(c, PROTOCOL_CMD_SET, 8 + lkey + lvalue, fn, args)) == NULL) return -1;
+  memcpy(p, &lkey32, 4);
+  memcpy(p + 4, &lvalue32, 4);
+  memcpy(p + 8, key, lkey);
+  memcpy(p + 8 + lkey, value, lvalue);
+  return 0;
+}
+
+static int ugkvc_send_key(ugkvc_conn_t *c, const unsigned short cmd, const char *key, const size_t lkey,
+  const ugkvc_done_fn fn, void *args)
+{
+  const unsigned int lkey32 = lkey;
+  char *p;
+
+  if (c->closed) return UGKVC_ECLOSED;
+  if ((p = ugkvc_frame(c, cmd, 4 + lkey, fn, args)) == NULL) return -1;
+  memcpy(p, &lkey32, 4);
+  memcpy(p + 4, key, lkey);
+  return 0;
+}
+
+int ugkvc_send_get(ugkvc_conn_t *c, const char *key, const size_t lkey, const ugkvc_done_fn fn, void *args)
+{
+  return ugkvc_send_key(c, PROTOCOL_CMD_GET, key, lkey, fn, args);
+}
+
+int ugkvc_send_del(ugkvc_conn_t *c, const char *key, const size_t lkey, const ugkvc_done_fn fn, void *args)
+{
+  return ugkvc_send_key(c, PROTOCOL_CMD_DEL, key, lkey, fn, args);
+}
+
+// whether queued requests wait for the socket to take them
+bool ugkvc_want_write(const ugkvc_conn_t *c)
+{
+  return c->sent < c->lout;
+}
+
+unsigned int ugkvc_pending(const ugkvc_conn_t *c)
+{
+  return c->npending;
+}
+
+// writes queued requests until the socket is full
+int ugkvc_flush(ugkvc_conn_t *c)
+{
+  while (c->sent < c->lout)
+  {
+    const ssize_t n = send(c->fd, c->out + c->sent, c->lout - c->sent, MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+      if (errno == EINTR) continue;
+      ugkvc_fail(c);
+      return -1;
+    }
+    c->sent += n;
+  }
+  c->lout = c->sent = 0;
+  return 0;
+}
+
+// reads what the socket has and completes the requests answered, returns how many
+int ugkvc_process(ugkvc_conn_t *c)
+{
+  unsigned int size, id;
+  unsigned short status;
+  size_t off = 0;
+  int done = 0;
+
+  if (c->closed) return UGKVC_ECLOSED;
+  while (1)
+  {
+    if (ugkvc_reserve(&c->in, &c->cin, c->lin + UGKVC_BUFFER) < 0) return -1;
+    const ssize_t n = recv(c->fd, c->in + c->lin, c->cin - c->lin, 0);
+    if (n == 0)
+    {
+      ugkvc_fail(c);
+      return UGKVC_ECLOSED;
+    }
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EINTR) continue;
+      ugkvc_fail(c);
+      return -1;
+    }
+    c->lin += n;
+    if (c->lin < c->cin) break;
+  }
+
+  while (c->lin - off >= PROTOCOL_HEADER)
+  {
+    memcpy(&size, c->in + off, 4);
+    memcpy(&status, c->in + off + 4, 2);
+    memcpy(&id, c->in + off + 6, 4);
+    if (c->lin - off - PROTOCOL_HEADER < size)
+    {
+      // the rest of a large reply is read in one go next time
+      if (ugkvc_reserve(&c->in, &c->cin, PROTOCOL_HEADER + (size_t)size) < 0) return -1;
+      break;
+    }
+
+    if (id == 0 && status == PROTOCOL_STATUS_EVENT)
+    {
+      if (c->efn != NULL) c->efn(status, c->in + off + PROTOCOL_HEADER, size, c->eargs);
+      off += PROTOCOL_HEADER + size;
+      continue;
+    }
+
+    ugkvc_slot_t *s = &c->slots[id & (c->cslots - 1)];
+    if (!s->used || s->id != id)
+    {
+      ugkvc_fail(c);
+      return UGKVC_EINVAL;
+    }
+    s->used = false;
+    c->npending--;
+    if (s->fn != NULL) s->fn(status, c->in + off + PROTOCOL_HEADER, size, s->args);
+    off += PROTOCOL_HEADER + size;
+    done++;
+  }
+
+  if (off > 0)
+  {
+    memmove(c->in, c->in + off, c->lin - off);
+    c->lin -= off;
+  }
+  return done;
+}
+
+// blocks until every request in flight is answered
+int ugkvc_wait(ugkvc_conn_t *c)
+{
+  while (c->npending > 0)
+  {
+    struct pollfd pfd = {.fd = c->fd, .events = POLLIN};
+    int ret;
+
+    if (ugkvc_flush(c) < 0) return -1;
+    if (ugkvc_want_write(c)) pfd.events |= POLLOUT;
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+    if ((ret = ugkvc_process(c)) < 0) return ret;
+  }
+  return 0;
+}
+
+// requests queued from now on are dropped by the server with PROTOCOL_STATUS_TIMEOUT
+// when they could not start within us microseconds, 0 waits for ever
+void ugkvc_set_timeout(ugkvc_conn_t *c, const unsigned int us)
+{
+  c->timeout = us;
+}
+
+// fn gets the payload of every WATCH event pushed to the connection, see watch.h. it
+// runs from ugkvc_process like the completions do
+void ugkvc_on_event(ugkvc_conn_t *c, const ugkvc_done_fn fn, void *args)
+{
+  c->efn = fn;
+  c->eargs = args;
+}
+
+static void ugkvc_status_fn(const int status, const char *data, const size_t size, void *args)
+{
+  (void)data; (void)size;
+  ugkvc_result_t *r = args;
+  r->status = status;
+}
+
+static void ugkvc_get_fn(const int status, const char *data, const size_t size, void *args)
+{
+  ugkvc_result_t *r = args;
+  r->status = status;
+  if (status != PROTOCOL_STATUS_OK) return;
+  if ((r->data = malloc(size > 0 ? size : 1)) == NULL)
+  {
+    r->status = PROTOCOL_STATUS_ERROR;
+    return;
+  }
+  memcpy(r->data, data, size);
+  r->size = size;
+}
+
+// the blocking calls wait for everything in flight, returning the PROTOCOL_STATUS_*
+// of their own request or a negative error
+static int ugkvc_finish(ugkvc_conn_t *c, const int sent, const ugkvc_result_t *r)
+{
+  int ret;
+
+  if (sent < 0) return sent;
+  if ((ret = ugkvc_wait(c)) < 0) return ret;
+  return r->status;
+}
+
+int ugkvc_set(ugkvc_conn_t *c, const char *key, const size_t lkey, const char *value, const size_t lvalue)
+{
+  ugkvc_result_t r = {.status = PROTOCOL_STATUS_ERROR};
+  return ugkvc_finish(c, ugkvc_send_set(c, key, lkey, value, lvalue, ugkvc_status_fn, &r), &r);
+}
+
+// *value is malloc'd for the caller, with PROTOCOL_STATUS_OK only
+int ugkvc_get(ugkvc_conn_t *c, const char *key, const size_t lkey, char **value, size_t *lvalue)
+{
+  ugkvc_result_t r = {.status = PROTOCOL_STATUS_ERROR, .data = NULL, .size = 0};
+  const int ret = ugkvc_finish(c, ugkvc_send_get(c, key, lkey, ugkvc_get_fn, &r), &r);
+  *value = r.data;
+  *lvalue = r.size;
+  return ret;
+}
+
+int ugkvc_del(ugkvc_conn_t *c, const char *key, const size_t lkey)
+{
+  ugkvc_result_t r = {.status = PROTOCOL_STATUS_ERROR};
+  return ugkvc_finish(c, ugkvc_send_del(c, key, lkey, ugkvc_status_fn, &r), &r);
+}
+
+// WATCH, or UNWATCH with watch false, of key. events arrive through ugkvc_on_event
+int ugkvc_watch(ugkvc_conn_t *c, const char *key, const size_t lkey, const bool watch)
+{
+  ugkvc_result_t r = {.status = PROTOCOL_STATUS_ERROR};
+  return ugkvc_finish(c, ugkvc_send_key(c, watch ? PROTOCOL_CMD_WATCH : PROTOCOL_CMD_UNWATCH, key, lkey,
+    ugkvc_status_fn, &r), &r);
+}
+
+static void ugkvc_mset_fn(const int status, const char *data, const size_t size, void *args)
+{
+  (void)data; (void)size;
+  unsigned int *failed = args;
+  if (status != PROTOCOL_STATUS_OK) (*failed)++;
+}
+
+// n SETs in one round trip, returns how many failed
+int ugkvc_mset(ugkvc_conn_t *c, const unsigned int n, const char **keys, const size_t *lkeys, const char **values,
+  const size_t *lvalues)
+{
+  unsigned int failed = 0;
+  int ret;
+
+  for (unsigned int ik = 0; ik < n; ++ik)
+    if ((ret = ugkvc_send_set(c, keys[ik], lkeys[ik], values[ik], lvalues[ik], ugkvc_mset_fn, &failed)) < 0) return ret;
+  if ((ret = ugkvc_wait(c)) < 0) return ret;
+  return (int)failed;
+}
+
+typedef struct ugkvc_mget
+{
+  char **values;
+  size_t *lvalues;
+  unsigned int index;
+  unsigned int *failed;
+} ugkvc_mget_t;
+
+static void ugkvc_mget_fn(const int status, const char *data, const size_t size, void *args)
+{
+  ugkvc_mget_t *m = args;
+
+  m->values[m->index] = NULL;
+  m->lvalues[m->index] = 0;
+  if (status == PROTOCOL_STATUS_NOTFOUND) return;
+  if (status != PROTOCOL_STATUS_OK || (m->values[m->index] = malloc(size > 0 ? size : 1)) == NULL)
+  {
+    (*m->failed)++;
+    return;
+  }
+  memcpy(m->values[m->index], data, size);
+  m->lvalues[m->index] = size;
+}
+
+// n GETs in one round trip. values[i] is malloc'd for the caller, NULL for keys not
+// found; returns how many failed otherwise
+int ugkvc_mget(ugkvc_conn_t *c, const unsigned int n, const char **keys, const size_t *lkeys, char **values,
+  size_t *lvalues)
+{
+  unsigned int failed = 0;
+  int ret;
+
+  ugkvc_mget_t *m = malloc(n * sizeof(ugkvc_mget_t));
+  if (m == NULL) return -1;
+  for (unsigned int ik = 0; ik < n; ++ik)
+  {
+    values[ik] = NULL;
+    m[ik] = (ugkvc_mget_t){.values = values, .lvalues = lvalues, .index = ik, .failed = &failed};
+    if ((ret = ugkvc_send_get(c, keys[ik], lkeys[ik], ugkvc_mget_fn, &m[ik])) < 0) goto ugkvc_mget_final;
+  }
+  if ((ret = ugkvc_wait(c)) == 0) ret = (int)failed;
+
+  ugkvc_mget_final:
+  if (ret < 0) ugkvc_wait(c);
+  free(m);
+  return ret;
+}
+
+// size connections to host:port, host NULL for the local machine
+ugkvc_pool_t *ugkvc_pool_new(const char *host, const unsigned short port, const unsigned int size)
+{
+  ugkvc_pool_t *p = calloc(1, sizeof(ugkvc_pool_t));
+  if (p == NULL) return NULL;
+  if (host != NULL && (p->host = strdup(host)) == NULL) goto ugkvc_pool_new_error;
+  p->port = port;
+  if (pthread_mutex_init(&p->mtx, NULL) != 0 || pthread_cond_init(&p->cnd, NULL) != 0) goto ugkvc_pool_new_error;
+
+  for (unsigned int ic = 0; ic < size; ++ic)
+  {
+    ugkvc_conn_t *c = ugkvc_connect(host, port);
+    if (c == NULL) goto ugkvc_pool_new_error;
+    c->nxt = p->free;
+    p->free = c;
+  }
+  return p;
+
+  ugkvc_pool_new_error:
+  ugkvc_pool_free(p);
+  return NULL;
+}
+
+// waits for a free connection, one the server closed is replaced first
+ugkvc_conn_t *ugkvc_pool_get(ugkvc_pool_t *p)
+{
+  pthread_mutex_lock(&p->mtx);
+  while (p->free == NULL) pthread_cond_wait(&p->cnd, &p->mtx);
+  ugkvc_conn_t *c = p->free;
+  p->free = c->nxt;
+  pthread_mutex_unlock(&p->mtx);
+
+  if (c->closed)
+  {
+    ugkvc_conn_t *nc = ugkvc_connect(p->host, p->port);
+    if (nc == NULL)
+    {
+      ugkvc_pool_put(p, c);
+      return NULL;
+    }
+    ugkvc_close(c);
+    c = nc;
+  }
+  return c;
+}
+
+// gives a connection back, requests still in flight are waited for
+void ugkvc_pool_put(ugkvc_pool_t *p, ugkvc_conn_t *c)
+{
+  if (!c->closed) ugkvc_wait(c);
+
+  pthread_mutex_lock(&p->mtx);
+  c->nxt = p->free;
+  p->free = c;
+  pthread_cond_signal(&p->cnd);
+  pthread_mutex_unlock(&p->mtx);
+}
+
+// closes the pool, every connection must be back
+void ugkvc_pool_free(ugkvc_pool_t *p)
+{
+  if (p == NULL) return;
+  while (p->free != NULL)
+  {
+    ugkvc_conn_t *c = p->free;
+    p->free = c->nxt;
+    ugkvc_close(c);
+  }
+  pthread_mutex_destroy(&p->mtx);
+  pthread_cond_destroy(&p->cnd);
+  free(p->host);
+  free(p);
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef UGKVC_H
+#define UGKVC_H
+
+#include "protocol.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// client library for ugkv. a connection pipelines: requests are queued with a
+// completion and written together, replies are matched to them by id in whatever
+// order they come. a connection is used by one thread at a time, the pool hands
+// them out to many.
+#define UGKVC_PORT 8080
+#define UGKVC_BUFFER 65536 // initial read and write buffer
+#define UGKVC_PENDING 1024 // initial in flight slots, they grow as needed
+#define UGKVC_EINVAL -2 // a reply that does not match its request
+#define UGKVC_ECLOSED -3 // the server closed the connection
+
+typedef struct ugkvc_conn ugkvc_conn_t;
+typedef struct ugkvc_pool ugkvc_pool_t;
+
+// status is a PROTOCOL_STATUS_*, or UGKVC_ECLOSED when the connection went away with
+// the request in flight. data is only valid during the call.
+typedef void (*ugkvc_done_fn)(int, const char*, size_t, void*);
+
+ugkvc_conn_t *ugkvc_connect(const char*, unsigned short);
+ugkvc_conn_t *ugkvc_connect_unix(const char*);
+void ugkvc_close(ugkvc_conn_t*);
+
+// async: queue requests, drive the socket from an event loop with fd, want_write,
+// flush and process
+int ugkvc_fd(const ugkvc_conn_t*);
+int ugkvc_send(ugkvc_conn_t*, unsigned short, const char*, size_t, ugkvc_done_fn, void*);
+int ugkvc_send_set(ugkvc_conn_t*, const char*, size_t, const char*, size_t, ugkvc_done_fn, void*);
+int ugkvc_send_get(ugkvc_conn_t*, const char*, size_t, ugkvc_done_fn, void*);
+int ugkvc_send_del(ugkvc_conn_t*, const char*, size_t, ugkvc_done_fn, void*);
+bool ugkvc_want_write(const ugkvc_conn_t*);
+unsigned int ugkvc_pending(const ugkvc_conn_t*);
+int ugkvc_flush(ugkvc_conn_t*);
+int ugkvc_process(ugkvc_conn_t*);
+int ugkvc_wait(ugkvc_conn_t*);
+void ugkvc_on_event(ugkvc_conn_t*, ugkvc_done_fn, void*);
+void ugkvc_set_timeout(ugkvc_conn_t*, unsigned int);
+
+// blocking helpers on top
+int ugkvc_set(ugkvc_conn_t*, const char*, size_t, const char*, size_t);
+int ugkvc_get(ugkvc_conn_t*, const char*, size_t, char**, size_t*);
+int ugkvc_del(ugkvc_conn_t*, const char*, size_t);
+int ugkvc_watch(ugkvc_conn_t*, const char*, size_t, bool);
+int ugkvc_mset(ugkvc_conn_t*, unsigned int, const char**, const size_t*, const char**, const size_t*);
+int ugkvc_mget(ugkvc_conn_t*, unsigned int, const char**, const size_t*, char**, size_t*);
+
+// a fixed set of connections to one server, shared by threads
+ugkvc_pool_t *ugkvc_pool_new(const char*, unsigned short, unsigned int);
+ugkvc_conn_t *ugkvc_pool_get(ugkvc_pool_t*);
+void ugkvc_pool_put(ugkvc_pool_t*, ugkvc_conn_t*);
+void ugkvc_pool_free(ugkvc_pool_t*);
+
+#endif //UGKVC_H
@@ -0,0 +1,385 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "watch.h"
+#include "client.h"
+#include "stats.h"
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct watch_entry
+{
+  int fd;
+  struct watch_key *wk;
+  struct watch_entry *kprev, *knxt; // watchers of the key
+  struct watch_entry *fprev, *fnxt; // keys of the connection
+} watch_entry_t;
+
+typedef struct watch_key
+{
+  char *key;
+  unsigned long h;
+  unsigned int ns, nwatchers;
+  atomic_uchar pending; // event queued for the notifier, 0 when none
+  watch_entry_t *watchers;
+  struct watch_key *nxt; // in its bucket
+} watch_key_t;
+
+typedef struct watch_index
+{
+  watch_key_t **buckets;
+  unsigned long nbuckets, nkeys;
+} watch_index_t;
+
+typedef struct watch_event
+{
+  unsigned int ns;
+  struct watch_event *nxt;
+  char key[];
+} watch_event_t;
+
+typedef struct watch
+{
+  pthread_rwlock_t rwl; // the indexes and the lists of the connections
+  watch_index_t *indexes; // by namespace
+  unsigned int nindexes;
+  watch_entry_t *conns[CLIENTS];
+  atomic_ulong keys; // watched ones in all, writes return right away while 0
+
+  pthread_mutex_t mtx; // the event queue
+  pthread_cond_t cnd;
+  watch_event_t *head, *tail;
+  pthread_t thread;
+} watch_t;
+
+static watch_t watch = {
+  .rwl = PTHREAD_RWLOCK_INITIALIZER,
+  .mtx = PTHREAD_MUTEX_INITIALIZER,
+  .cnd = PTHREAD_COND_INITIALIZER,
+  .indexes = NULL,
+  .nindexes = 0,
+  .head = NULL,
+  .tail = NULL
+};
+
+static unsigned long watch_hash(const char *key)
+{
+  unsigned long h = 14695981039346656037ul;
+  for (const char *p = key; *p; p++)
+  {
+    h ^= (unsigned char)*p;
+    h *= 1099511628211ul;
+  }
+  return h;
+}
+
+static watch_key_t *watch_find(const watch_index_t *idx, const char *key, const unsigned long h)
+{
+  for (watch_key_t *wk = idx->buckets[h & (idx->nbuckets - 1)]; wk != NULL; wk = wk->nxt)
+    if (wk->h == h && strcmp(wk->key, key) == 0) return wk;
+  return NULL;
+}
+
+// doubles the buckets of idx, the write lock must be held
+static int watch_grow(watch_index_t *idx)
+{
+  const unsigned long nbuckets = idx->nbuckets * 2;
+  watch_key_t **buckets = calloc(nbuckets, sizeof(watch_key_t*));
+  if (buckets == NULL) return -1;
+
+  for (unsigned long ib = 0; ib < idx->nbuckets; ++ib)
+    while (idx->buckets[ib] != NULL)
+    {
+      watch_key_t *wk = idx->buckets[ib];
+      idx->buckets[ib] = wk->nxt;
+      wk->nxt = buckets[wk->h & (nbuckets - 1)];
+      buckets[wk->h & (nbuckets - 1)] = wk;
+    }
+
+  free(idx->buckets);
+  idx->buckets = buckets;
+  idx->nbuckets = nbuckets;
+  return 0;
+}
+
+// the key is dropped with its last watcher, the write lock must be held
+static void watch_unlink(watch_entry_t *e)
+{
+  watch_key_t *wk = e->wk;
+
+  if (e->kprev != NULL) e->kprev->knxt = e->knxt;
+  else wk->watchers = e->knxt;
+  if (e->knxt != NULL) e->knxt->kprev = e->kprev;
+  if (e->fprev != NULL) e->fprev->fnxt = e->fnxt;
+  else watch.conns[e->fd] = e->fnxt;
+  if (e->fnxt != NULL) e->fnxt->fprev = e->fprev;
+  free(e);
+
+  if (--wk->nwatchers > 0) return;
+
+  watch_index_t *idx = &watch.indexes[wk->ns];
+  watch_key_t **pwk = &idx->buckets[wk->h & (idx->nbuckets - 1)];
+  while (*pwk != wk) pwk = &(*pwk)->nxt;
+  *pwk = wk->nxt;
+  idx->nkeys--;
+  atomic_fetch_sub_explicit(&watch.keys, 1, memory_order_relaxed);
+  free(wk->key);
+  free(wk);
+}
+
+// the entry of connection fd for wk, the lock must be held
+static watch_entry_t *watch_entry(const int fd, const watch_key_t *wk)
+{
+  for (watch_entry_t *e = watch.conns[fd]; e != NULL; e = e->fnxt) if (e->wk == wk) return e;
+  return NULL;
+}
+
+// connection fd watches key of namespace ns, watching it twice is one watch
+int watch_add(const int fd, const unsigned int ns, const char *key)
+{
+  const unsigned long h = watch_hash(key);
+  watch_entry_t *e;
+  watch_key_t *wk;
+
+  if (fd < 0 || fd >= CLIENTS || ns >= watch.nindexes) return -1;
+  if ((e = malloc(sizeof(watch_entry_t))) == NULL) return -1;
+  if (pthread_rwlock_wrlock(&watch.rwl) != 0)
+  {
+    free(e);
+    return -1;
+  }
+
+  watch_index_t *idx = &watch.indexes[ns];
+  if ((wk = watch_find(idx, key, h)) == NULL)
+  {
+    if (idx->nkeys >= idx->nbuckets && watch_grow(idx) < 0) goto watch_add_error;
+    if ((wk = calloc(1, sizeof(watch_key_t))) == NULL) goto watch_add_error;
+    if ((wk->key = strdup(key)) == NULL)
+    {
+      free(wk);
+      goto watch_add_error;
+    }
+    wk->h = h;
+    wk->ns = ns;
+    atomic_init(&wk->pending, 0);
+    wk->nxt = idx->buckets[h & (idx->nbuckets - 1)];
+    idx->buckets[h & (idx->nbuckets - 1)] = wk;
+    idx->nkeys++;
+    atomic_fetch_add_explicit(&watch.keys, 1, memory_order_relaxed);
+  }
+  else if (watch_entry(fd, wk) != NULL)
+  {
+    free(e);
+    goto watch_add_final;
+  }
+
+  e->fd = fd;
+  e->wk = wk;
+  e->kprev = NULL;
+  e->knxt = wk->watchers;
+  if (e->knxt != NULL) e->knxt->kprev = e;
+  wk->watchers = e;
+  e->fprev = NULL;
+  e->fnxt = watch.conns[fd];
+  if (e->fnxt != NULL) e->fnxt->fprev = e;
+  watch.conns[fd] = e;
+  wk->nwatchers++;
+
+  watch_add_final:
+  pthread_rwlock_unlock(&watch.rwl);
+  return 0;
+
+  watch_add_error:
+  pthread_rwlock_unlock(&watch.rwl);
+  free(e);
+  return -1;
+}
+
+// WATCH_ENOENT when connection fd did not watch key of namespace ns
+int watch_remove(const int fd, const unsigned int ns, const char *key)
+{
+  const unsigned long h = watch_hash(key);
+  watch_entry_t *e = NULL;
+  watch_key_t *wk;
+
+  if (fd < 0 || fd >= CLIENTS || ns >= watch.nindexes) return -1;
+  if (pthread_rwlock_wrlock(&watch.rwl) != 0) return -1;
+  if ((wk = watch_find(&watch.indexes[ns], key, h)) != NULL && (e = watch_entry(fd, wk)) != NULL) watch_unlink(e);
+  pthread_rwlock_unlock(&watch.rwl);
+  return e != NULL ? 0 : WATCH_ENOENT;
+}
+
+// drops every watch of connection fd, once it is closed
+void watch_forget(const int fd)
+{
+  if (fd < 0 || fd >= CLIENTS || watch.nindexes == 0) return;
+  if (pthread_rwlock_wrlock(&watch.rwl) != 0) return;
+  while (watch.conns[fd] != NULL) watch_unlink(watch.conns[fd]);
+  pthread_rwlock_unlock(&watch.rwl);
+}
+
+// key of namespace ns was written or deleted. a key with no event queued yet gets
+// one, otherwise the queued one is updated: the writer never waits for the fan out
+void watch_notify(const unsigned int ns, const char *key, const unsigned char event)
+{
+  watch_event_t *ev = NULL;
+  watch_key_t *wk;
+  unsigned char prev = 0;
+
+  if (atomic_load_explicit(&watch.keys, memory_order_relaxed) == 0 || ns >= watch.nindexes) return;
+
+  const unsigned long h = watch_hash(key);
+  if (pthread_rwlock_rdlock(&watch.rwl) != 0) return;
+  if ((wk = watch_find(&watch.indexes[ns], key, h)) != NULL)
+  {
+    prev = atomic_exchange_explicit(&wk->pending, event, memory_order_acq_rel);
+    if (prev == 0 && (ev = malloc(sizeof(watch_event_t) + strlen(key) + 1)) == NULL)
+      atomic_store_explicit(&wk->pending, 0, memory_order_release);
+  }
+  pthread_rwlock_unlock(&watch.rwl);
+
+  if (wk == NULL) return;
+  stats_add(STATS_WATCH_EVENTS, 1);
+  if (prev != 0)
+  {
+    stats_add(STATS_WATCH_COALESCED, 1);
+    return;
+  }
+  if (ev == NULL) return;
+
+  ev->ns = ns;
+  ev->nxt = NULL;
+  strcpy(ev->key, key);
+  pthread_mutex_lock(&watch.mtx);
+  if (watch.tail != NULL) watch.tail->nxt = ev;
+  else watch.head = ev;
+  watch.tail = ev;
+  pthread_cond_signal(&watch.cnd);
+  pthread_mutex_unlock(&watch.mtx);
+}
+
+// pushes the pending event of a key to its watchers, taken under the lock and sent
+// without it. fds grows to the largest fan out seen
+static void watch_fanout(const watch_event_t *ev, int **fds, unsigned int *cfds)
+{
+  unsigned int n = 0;
+  unsigned char event = 0;
+  watch_key_t *wk;
+
+  if (pthread_rwlock_rdlock(&watch.rwl) != 0) return;
+  if ((wk = watch_find(&watch.indexes[ev->ns], ev->key, watch_hash(ev->key))) != NULL)
+  {
+    event = atomic_exchange_explicit(&wk->pending, 0, memory_order_acq_rel);
+    if (wk->nwatchers > *cfds)
+    {
+      int *tmp = realloc(*fds, wk->nwatchers * sizeof(int));
+      if (tmp != NULL)
+      {
+        *fds = tmp;
+        *cfds = wk->nwatchers;
+      }
+    }
+    for (const watch_entry_t *e = wk->watchers; e != NULL && n < *cfds; e = e->knxt) (*fds)[n++] = e->fd;
+  }
+  pthread_rwlock_unlock(&watch.rwl);
+  if (event == 0 || n == 0) return;
+
+  // event (1) | namespace (2) | key
+  const size_t lkey = strlen(ev->key);
+  const unsigned short ns = ev->ns;
+  char *payload = malloc(3 + lkey);
+  if (payload == NULL) return;
+  payload[0] = (char)event;
+  memcpy(payload + 1, &ns, 2);
+  memcpy(payload + 3, ev->key, lkey);
+
+  unsigned long pushed = 0, dropped = 0;
+  for (unsigned int iw = 0; iw < n; ++iw)
+  {
+    const int ret = client_push((*fds)[iw], PROTOCOL_STATUS_EVENT, payload, 3 + lkey);
+    if (ret == 0) pushed++;
+    else if (ret > 0) dropped++;
+  }
+  free(payload);
+  stats_add(STATS_WATCH_PUSHED, pushed);
+  stats_add(STATS_WATCH_DROPPED, dropped);
+}
+
+// takes the whole queue at a time, so events of a busy period go out in one batch
+static void *watch_thread_fn(void *args)
+{
+  (void)args;
+  int *fds = NULL;
+  unsigned int cfds = 0;
+
+  while (1)
+  {
+    pthread_mutex_lock(&watch.mtx);
+    while (watch.head == NULL) pthread_cond_wait(&watch.cnd, &watch.mtx);
+    watch_event_t *batch = watch.head;
+    watch.head = watch.tail = NULL;
+    pthread_mutex_unlock(&watch.mtx);
+
+    while (batch != NULL)
+    {
+      watch_event_t *ev = batch;
+      batch = ev->nxt;
+      watch_fanout(ev, &fds, &cfds);
+      free(ev);
+    }
+  }
+  return NULL;
+}
+
+// an index for each of namespaces, and the notifier
+int watch_setup(const unsigned int namespaces)
+{
+  if ((watch.indexes = calloc(namespaces, sizeof(watch_index_t))) == NULL)
+  {
+    perror("(watch) calloc");
+    return -1;
+  }
+  for (unsigned int in = 0; in < namespaces; ++in)
+  {
+    if ((watch.indexes[in].buckets = calloc(WATCH_BUCKETS, sizeof(watch_key_t*))) == NULL)
+    {
+      perror("(watch) calloc");
+      return -1;
+    }
+    watch.indexes[in].nbuckets = WATCH_BUCKETS;
+  }
+  watch.nindexes = namespaces;
+
+  if (pthread_create(&watch.thread, NULL, watch_thread_fn, NULL) != 0)
+  {
+    perror("(watch) pthread_create");
+    return -1;
+  }
+  return 0;
+}
+
+// "watch_keys:<keys watched>" line
+void watch_report(FILE *f)
+{
+  fprintf(f, "watch_keys:%lu\n", atomic_load_explicit(&watch.keys, memory_order_relaxed));
+}
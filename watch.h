@@ -0,0 +1,44 @@
+// Copyright (c) 2024, Caio Cozza
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this list of
+//    conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice, this list of
+//    conditions and the following disclaimer in the documentation and/or other materials provided
+//    with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS
+// BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+// OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+// OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdio.h>
+
+// connections WATCH keys of a namespace and are pushed a frame whenever one is
+// written or deleted:
+//   size (4) | PROTOCOL_STATUS_EVENT (2) | id 0 (4) | event (1) | namespace (2) | key
+// writers only mark the key, a notifier thread fans the events out. a key written
+// again before its event went out is sent once, with the latest event.
+#define WATCH_BUCKETS 1024 // per namespace at first, doubled once keys outnumber them
+#define WATCH_ENOENT -2
+
+#define WATCH_EVENT_SET 1
+#define WATCH_EVENT_DEL 2
+
+int watch_setup(unsigned int);
+int watch_add(int, unsigned int, const char*);
+int watch_remove(int, unsigned int, const char*);
+void watch_forget(int);
+void watch_notify(unsigned int, const char*, unsigned char);
+void watch_report(FILE*);
+
+#endif //WATCH_H
@@ -21,6 +21,7 @@
 
 #include "worker.h"
 #include "client.h"
+#include "topology.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -32,54 +33,43 @@
 // TODO
 #endif
 
-#define WORKER_BUFFER 12
-
 static int wfd = -1;
 
-static void worker_input_handler(int fd)
+static void worker_close(const int fd)
 {
-  int bytes;
-  char buffer[WORKER_BUFFER];
-
-  if ((bytes = read(fd, buffer, WORKER_BUFFER)) <= 0)
-  {
-    if (bytes == 0) printf("(worker) connection closed by peer, fd: %d\n", fd);
-    else perror("(worker) read error");
 #if defined(__linux__)
-    if (epoll_delete(wfd, fd) < 0) perror("(worker) epoll_delete");
+  if (epoll_delete(wfd, fd) < 0) perror("(worker) epoll_delete");
 #elif defined(__APPLE__)
-    // TODO
+  // TODO
 #endif
-    close(fd);
-    if (client_clear(fd) < 0) perror("(worker) client_clear");
-    return;
-  }
-  char *data = malloc(bytes);
-  if (data != NULL)
-  {
-    memcpy(data, buffer, bytes);
-    printf("bytes: %d\n", bytes);
-    if (client_append(fd, data, bytes) < 0) perror("(worker) client_append");
-    free(data);
-  }
-  #if defined(__linux__)
-  if (epoll_inmod(wfd, fd) < 0)
+  if (client_clear(fd) < 0) perror("(worker) client_clear");
+  close(fd);
+}
+
+static void worker_input_handler(int fd)
+{
+  int ret;
+
+  // the client reads straight from the socket into its frame buffer or value
+  if ((ret = client_read(fd)) <= 0)
   {
-    if (epoll_delete(wfd, fd) < 0) perror("(worker) epoll_delete");
-    close(fd);
-    if (client_clear(fd) < 0) perror("(worker) client_clear");
+    if (ret == 0) printf("(worker) connection closed by peer, fd: %d\n", fd);
+    else perror("(worker) client_read");
+    worker_close(fd);
+    return;
   }
-  #elif defined(__APPLE__)
-  #endif
+
+  if (client_arm(fd) < 0) worker_close(fd);
 }
 
-static void worker_output_handler(void)
+static void worker_output_handler(int fd)
 {
-  // will data output to clients
+  if (client_flush(fd) < 0 || client_arm(fd) < 0) worker_close(fd);
 }
 
 static void *worker_fn(void *args)
 {
+  (void)args;
   if (wfd < 0)
   {
     perror("(worker) sfd not set");
@@ -105,14 +95,14 @@ static void *worker_fn(void *args)
 #endif
 }
 
-int worker_setup(int fd, pthread_t (*workers)[WORKERS])
+int worker_setup(int fd, pthread_t *workers, const unsigned int nworkers)
 {
   wfd = fd;
-  client_setup();
-  for (unsigned int iw = 0; iw < WORKERS; ++iw)
-    if (pthread_create(&(*workers)[iw], NULL, worker_fn, NULL) < 0)
+  client_setup(fd);
+  for (unsigned int iw = 0; iw < nworkers; ++iw)
+    if (topology_thread_create(&workers[iw], TOPOLOGY_ROLE_WORKER, iw, worker_fn, NULL) < 0)
     {
-      perror("(worker) pthread_create");
+      perror("(worker) topology_thread_create");
       return -1;
     }
   return 0;
@@ -28,6 +28,6 @@
 
 #define WORKERS 2
 
-int worker_setup(int,pthread_t(*)[WORKERS]);
+int worker_setup(int,pthread_t*,unsigned int);
 
 #endif //WORKER_H
\ No newline at end of file